@@ -4,23 +4,81 @@
 // Simple PNG writer function by Alex Evans, 2011. Released into the public domain: https://gist.github.com/908299, more context at http://altdevblogaday.org/2011/04/06/a-smaller-jpg-encoder/.
 // Karl Malbrain's compact CRC-32. See "A compact CCITT crc16 and crc32 C implementation that balances processor cache usage against speed": http://www.geocities.com/malbrain/
 //
-// Compressor limitations: Only supports dynamic blocks, so it may slightly expand already compressed data.
+// Compressor limitations: Only emits dynamic blocks (plus stored blocks when degrading to meet a deadline or with AUTO_STRATEGY_FLAG), so it may slightly expand already compressed data.
 // Also, it's currently not smart about how it breaks up the stream into separate dynamic blocks.
 //
 // This is an stb_image.c-like header file library. If you only want the header, define TINYDEFLATE_HEADER_FILE_ONLY before including this file.
+// Define TINYDEFLATE_PACKER_MAIN when compiling this file on its own to build the asset packer, which precompresses files into a header at build time (see the end of this file).
+// With C++20, small assets can also be compressed by the compiler itself, see compress<"...">().
+// Define TINYDEFLATE_DAEMON_MAIN instead to build the compression offload daemon (Linux, C++11), which serves offload_client.
 #ifndef TINYDEFLATE_HEADER_INCLUDED
 #define TINYDEFLATE_HEADER_INCLUDED
 
+#ifndef TDEFL_CACHE_LINE_SIZE
+#define TDEFL_CACHE_LINE_SIZE 64
+#endif
+#ifndef TDEFL_PAGE_SIZE
+#define TDEFL_PAGE_SIZE 4096
+#endif
+#ifndef TDEFL_COMPRESSOR_ALIGNMENT
+#define TDEFL_COMPRESSOR_ALIGNMENT TDEFL_PAGE_SIZE
+#endif
+// Set to 1 to tag each hash chain entry with the first two bytes at the position it links to, so the match finder can reject most false candidates
+// without touching the dictionary. Only pays off when the dictionary isn't cache resident; doubles the hash and chain arrays (to 144KB).
+#ifndef TDEFL_TAGGED_HASH_CHAINS
+#define TDEFL_TAGGED_HASH_CHAINS 0
+#endif
+#ifdef _MSC_VER
+#define TDEFL_ALIGN(x) __declspec(align(x))
+#else
+#define TDEFL_ALIGN(x) __attribute__((aligned(x)))
+#endif
+#if (__cplusplus >= 201103L) || (defined(_MSC_VER) && (_MSC_VER >= 1900))
+#define TDEFL_CPP11 1
+#define TDEFL_NOTHROW noexcept
+#else
+#define TDEFL_CPP11 0
+#define TDEFL_NOTHROW throw()
+#endif
+// Set to 1 to compile in timeline tracing (see trace_start()). At 0 the trace points compile to nothing.
+#ifndef TDEFL_TRACING
+#define TDEFL_TRACING 0
+#endif
+#if TDEFL_TRACING && !TDEFL_CPP11
+#error TDEFL_TRACING requires C++11
+#endif
+#if (__cplusplus >= 202002L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 202002L))
+#define TDEFL_CPP20 1
+#else
+#define TDEFL_CPP20 0
+#endif
+#if TDEFL_CPP20 && defined(__cpp_impl_coroutine)
+#define TDEFL_COROUTINES 1
+#else
+#define TDEFL_COROUTINES 0
+#endif
+
+#include <stddef.h>
+#if TDEFL_COROUTINES
+#include <coroutine>
+#endif
+
 namespace tinydeflate
 {
-  typedef unsigned char uint8; typedef signed short int16; typedef unsigned short uint16; typedef unsigned int uint32; typedef unsigned int uint;
+  typedef unsigned char uint8; typedef signed short int16; typedef unsigned short uint16; typedef unsigned int uint32; typedef unsigned int uint; typedef unsigned long long uint64;
 
   // Compression parameters/flags (logically OR together):
   // DEFAULT_MAX_PROBES: The compressor defaults to 100 dictionary probes per dictionary search: 0=fastest (Huffman only), 1=fastest (Huffman+LZ), 4095=slowest.
   // NONDETERMINISTIC_PARSING_FLAG: Enable to decrease the compressor's initialization time to the minimum, but the output may vary from run to run given the same input (depending on the contents of memory).
   // GREEDY_PARSING_FLAG: Set to use faster greedy parsing, instead of more efficient lazy parsing.
   // WRITE_ZLIB_HEADER: If set, the compressor outputs a zlib header before the deflate data, and the Adler-32 of the source data at the end. Otherwise, you'll get raw deflate data.
-  enum { DEFAULT_MAX_PROBES = 100, NONDETERMINISTIC_PARSING_FLAG = 0x20000000, GREEDY_PARSING_FLAG = 0x40000000, WRITE_ZLIB_HEADER = 0x80000000 };
+  // AUTO_STRATEGY_FLAG: Set to classify each 16KB region of the input (by sampled entropy, match and run density) and switch between the hash chain parser, an RLE matcher, Huffman only and stored blocks.
+  // REPEAT_DIST_FLAG: Set to try the last few match distances (and any stride hints, see compressor::set_stride_hints()) before walking the hash chain.
+  //  Finds much longer matches at low probe counts on fixed-size records and tables, but costs some speed on other data.
+  // WORK_LIMIT_FLAG: Set to bound the match finder's work (hash chain steps plus compared bytes) to about compressor::WORK_BUDGET_PER_BYTE per input byte.
+  //  Each block that goes over halves its probe depth (down to 1) until the block ends. Use on untrusted input, where long periodic patterns can otherwise make
+  //  every position walk the full chain and compare hundreds of bytes.
+  enum { DEFAULT_MAX_PROBES = 100, WORK_LIMIT_FLAG = 0x04000000, REPEAT_DIST_FLAG = 0x08000000, AUTO_STRATEGY_FLAG = 0x10000000, NONDETERMINISTIC_PARSING_FLAG = 0x20000000, GREEDY_PARSING_FLAG = 0x40000000, WRITE_ZLIB_HEADER = 0x80000000 };
 
   // High level compression functions:
   // compress_mem_to_heap() compresses a block in memory to a heap block allocated via malloc().
@@ -36,6 +94,28 @@ namespace tinydeflate
   // compress_mem_to_mem() compresses a block in memory to another block in memory. 
   // Returns 0 on failure.
   size_t compress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+  // compress_mem_to_fit() compresses as much of a block as fits in out_buf_len bytes (zlib header and trailer included) into a complete stream, in a single pass.
+  // On entry *pSrc_buf_len is the size of the source block, on return it's the number of source bytes the stream holds (0 if there's only room for an empty stream).
+  // Blocks use fixed codes where they're smaller, so even pages of a few dozen bytes are filled.
+  // Returns the compressed size, or 0 on failure (out_buf_len is too small for even an empty stream).
+  size_t compress_mem_to_fit(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t *pSrc_buf_len, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+  // compress_mem_in_place() compresses buf_len bytes at pBuf into the same buffer, writing the output over the input already consumed, so no second buffer
+  // of the same size is needed. The buffer must be compress_mem_in_place_bound(buf_len) bytes long: parts of the input that don't compress are written as
+  // stored blocks, which expand it a little. Only a staging buffer of a few hundred KB is allocated.
+  // Returns the compressed size, or 0 on failure (the buffer's contents are then undefined).
+  size_t compress_mem_in_place(void *pBuf, size_t buf_len, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+  size_t compress_mem_in_place_bound(size_t buf_len);
+
+  // compress_mem_to_heap_with_deadline() is like compress_mem_to_heap(), but the compression must finish within time_budget_usecs microseconds.
+  // It starts at the level given by flags, then degrades toward greedy parsing, fewer probes, Huffman only and finally stored blocks as the deadline approaches.
+  // The output is always a valid stream; only the ratio suffers when the budget is tight.
+  void *compress_mem_to_heap_with_deadline(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, uint time_budget_usecs, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+  // High resolution monotonic timer used for deadlines.
+  uint64 get_ticks();
+  uint64 get_ticks_per_second();
   
   // Compresses an image to a compressed PNG file in memory.
   // On entry:
@@ -63,7 +143,7 @@ namespace tinydeflate
     size_t m_size, m_capacity;
     void *m_pBuf;
   public:
-    inline expandable_malloc_output_stream::expandable_malloc_output_stream(size_t initial_capacity = 0) : m_pBuf(0), m_size(0), m_capacity(0) { init(initial_capacity); }
+    inline expandable_malloc_output_stream(size_t initial_capacity = 0) : m_size(0), m_capacity(0), m_pBuf(0) { init(initial_capacity); }
     virtual ~expandable_malloc_output_stream() { clear(); }
 
     void init(size_t initial_capacity);
@@ -73,6 +153,7 @@ namespace tinydeflate
     inline size_t get_size() { return m_size; }
     inline size_t get_capacity() { return m_capacity; }
     inline void *assume_buf_ownership() { void *p = m_pBuf; m_pBuf = 0; m_size = m_capacity = 0; return p; }
+    inline void reset() { m_size = 0; }
 
     virtual bool put_buf(const void* pBuf, int len);
   };
@@ -96,8 +177,47 @@ namespace tinydeflate
     virtual bool put_buf(const void* pBuf, int len);
   };
 
+  // Input stream interface, the decompressor's counterpart of output_stream.
+  class input_stream
+  {
+  public:
+    virtual ~input_stream() { };
+    // Reads up to max_len bytes into pBuf. Returns the number of bytes read, 0 at the end of the input, or -1 on failure.
+    virtual int get_buf(void *pBuf, int max_len) = 0;
+  };
+
+  // Memory block input stream class.
+  class buffer_input_stream : public input_stream
+  {
+    const void *m_pBuf;
+    size_t m_size, m_ofs;
+  public:
+    inline buffer_input_stream(const void *pBuf = 0, size_t buf_size = 0) { init(pBuf, buf_size); }
+
+    inline void init(const void *pBuf, size_t buf_size) { m_pBuf = pBuf; m_size = buf_size; m_ofs = 0; }
+    inline size_t get_ofs() const { return m_ofs; }
+
+    virtual int get_buf(void *pBuf, int max_len);
+  };
+
   uint32 adler32(const uint8 *ptr, size_t buf_len, uint32 adler32 = 0);
+  // Returns the Adler-32 of the concatenation of two buffers, given the Adler-32 of each (seeded with 1) and the length of the second one.
+  uint32 adler32_combine(uint32 adler1, uint32 adler2, size_t len2);
   uint32 crc32(const uint8 *ptr, size_t buf_len, uint32 crc = 0);
+  // gzip (RFC 1952) framing around raw deflate data (the compressor's output without WRITE_ZLIB_HEADER, including encode_tokens()'s): write the header,
+  // the deflate stream, then the trailer, which holds the crc32() and size of the uncompressed data.
+  bool write_gzip_header(output_stream *pStream);
+  bool write_gzip_trailer(output_stream *pStream, uint32 crc, uint64 size);
+  // Austin Appleby's MurmurHash3 (x64, 128-bit variant). Fast non-cryptographic hash, used to key caches on content.
+  void murmur3_128(const void *pBuf, size_t buf_len, uint32 seed, uint64 *pHash128);
+
+  // An LZ77 token, as written by the compressor's parser (see compressor::init_parser()) and coded by compressor::encode_tokens(): a literal
+  // (m_dist is 0 and m_len_or_lit is the byte) or a match of m_len_or_lit bytes (3-258) starting m_dist bytes back (1-32768).
+  struct lz_token { uint16 m_len_or_lit, m_dist; };
+
+  // parse_mem_to_heap() runs only the match finder and parser over a block, and returns the parse as a malloc()'d array of *pNum_tokens tokens, or NULL on failure.
+  // flags sets the max probes and parsing flags, as for compress_mem_to_heap(). Encode it (as often as needed, with different block splits) with compressor::encode_tokens().
+  lz_token *parse_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pNum_tokens, int flags = DEFAULT_MAX_PROBES);
 
   // This class may be used directly if the above helper functions aren't flexible enough. This class does not make any heap allocations, unlike the above helper functions.
   class compressor
@@ -105,613 +225,5113 @@ namespace tinydeflate
   public:
     compressor() : m_pStream(0), m_all_writes_succeeded(false) { }
 
+    // Heap allocated compressors are aligned to TDEFL_COMPRESSOR_ALIGNMENT (a page by default), so the per-byte arrays keep their page alignment.
+    // Define TDEFL_COMPRESSOR_ALIGNMENT to 2MB before including this file to have them backed by a transparent huge page where the OS supports it.
+    // Doesn't throw: new compressor returns NULL when out of memory.
+    static void *operator new(size_t size) TDEFL_NOTHROW;
+    static void operator delete(void *p);
+
     // Initializes the compressor.
     bool init(output_stream *pStream, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+    // Preset dictionary (the FDICT option of RFC 1950): the last 32KB of pDict become history the data can reference, so input that resembles it (short
+    // messages especially) compresses much better. The decompressor needs the same dictionary; with WRITE_ZLIB_HEADER the header carries its Adler-32.
+    // Call once, after init() and before compressing anything.
+    bool set_dictionary(const void *pDict, uint dict_len);
+
+    // Starts a new stream like init(), with the last dict_len bytes this compressor was given as its preset dictionary. They're still in the window with
+    // their hash chains built, so unlike set_dictionary() nothing is copied or hashed. dict_id is their Adler-32 (seeded with 1), for the zlib header.
+    // Call once the previous stream is finished. Returns false if the window doesn't hold dict_len bytes (stored blocks and full flushes clear it).
+    bool reinit_with_dictionary(output_stream *pStream, int flags, uint dict_len, uint32 dict_id);
     
     // Compresses a block of data. 
     // To flush the compressor: call this function with pData set to NULL and data_len set to 0. This function cannot be called again once this is done, but you can call init() to reinitialize to compress again.
     bool compress_data(const void *pData, uint data_len);
 
+    // Compresses all pending input and ends the current block with an empty stored block, so everything written so far is byte aligned and
+    // can be decompressed up to this point. FULL_FLUSH also resets the dictionary, so the data following the flush doesn't reference anything before it.
+    // BLOCK_FLUSH only ends the current block, to split blocks where the caller wants.
+    enum { BLOCK_FLUSH = 0, SYNC_FLUSH = 1, FULL_FLUSH = 2 };
+    bool flush(uint flush_type = SYNC_FLUSH);
+
+    // Compresses as much of pData as fits in max_out_len bytes of output (header and trailer included), finishes the stream as compress_data(NULL, 0) would,
+    // and returns the number of input bytes it holds. The exact size of the pending block is checked as the input is parsed, and the last block is cut at
+    // the longest run of codes that fits. Call right after init(); the output stream must accept max_out_len bytes. Deadlines and AUTO_STRATEGY_FLAG are ignored.
+    size_t compress_to_fit(const void *pData, size_t data_len, size_t max_out_len);
+
     inline bool get_all_writes_succeeded() const { return m_all_writes_succeeded; }
 
+    // Token level interface, to parse once and encode many times, or to encode a parse made elsewhere.
+    // init_parser() initializes the compressor to only run the match finder and parser: compress_data() and flush() then write the parse to pToken_stream
+    // as an array of lz_tokens instead of compressed data. WRITE_ZLIB_HEADER and AUTO_STRATEGY_FLAG are ignored, and so are deadlines.
+    bool init_parser(output_stream *pToken_stream, int flags = DEFAULT_MAX_PROBES);
+
+    // Codes tokens into the current block, in place of compress_data(). pSrc/src_len are the bytes the tokens cover, and are read for the zlib trailer
+    // (for gzip, init without WRITE_ZLIB_HEADER and see write_gzip_header()). Split blocks with flush(BLOCK_FLUSH) (they also end when the LZ code buffer fills), and finish with compress_data(NULL, 0).
+    // Returns false, without coding any of them, if a token is invalid, reaches back further than the data coded so far or the window (see set_window_bits()),
+    // or disagrees with pSrc: literals and match copies are checked against it, except for the bytes a match copies from data given to earlier calls, which
+    // the compressor doesn't keep. The caller must make sure those match.
+    bool encode_tokens(const lz_token *pTokens, size_t num_tokens, const void *pSrc, size_t src_len);
+
+    // Degrade levels used by deadline-aware compression, from slowest to fastest.
+    enum { DEGRADE_NONE = 0, DEGRADE_GREEDY, DEGRADE_MIN_PROBES, DEGRADE_HUFFMAN_ONLY, DEGRADE_STORED };
+
+    // Sets a deadline (in get_ticks() units, 0=none) by which the caller wants to finish the stream. Call after init().
+    // expected_total_len is the number of bytes the caller intends to compress, or 0 if unknown. When known, the compressor
+    // projects its finish time from the measured speed and degrades as soon as the projection misses the deadline, otherwise it degrades on elapsed time alone.
+    void set_deadline(uint64 deadline_ticks, size_t expected_total_len = 0);
+    inline uint get_degrade_level() const { return m_degrade_level; }
+
+    // Per-block parsing strategies. STRATEGY_LZ is always used unless AUTO_STRATEGY_FLAG is set.
+    enum { STRATEGY_LZ = 0, STRATEGY_RLE, STRATEGY_HUFFMAN_ONLY, STRATEGY_STORED };
+    inline uint get_strategy() const { return m_strategy; }
+
+    // Stride hints for fixed-size records and tables: before walking the hash chain, the match finder tries the distances of one and two strides back
+    // (along with the last few distances used, as with REPEAT_DIST_FLAG). Pass up to MAX_STRIDE_HINTS record or row sizes, or none to disable. Call after init().
+    enum { MAX_STRIDE_HINTS = 4 };
+    bool set_stride_hints(const uint *pStrides, uint num_strides);
+
+    // Limits match distances to 2^window_bits (8-15, default 15), for decoders with a smaller window, like a WebSocket peer that negotiated a
+    // max_window_bits parameter. Call after init().
+    bool set_window_bits(uint window_bits);
+
+    // Match finder work allowed per input byte with WORK_LIMIT_FLAG, and the allowance each block (and each probe depth reduction) starts with.
+    enum { WORK_BUDGET_PER_BYTE = 64, WORK_BUDGET_SLACK = 64 * 1024 };
+
   private:
     enum 
     { 
       OUT_BUF_SIZE = 4096, MAX_HUFF_TABLES = 3, MAX_HUFF_SYMBOLS = 384, MAX_HUFF_SYMBOLS_0 = 288, MAX_HUFF_SYMBOLS_1 = 32, MAX_HUFF_SYMBOLS_2 = 19,
       LZ_DICT_SIZE = 32768, LZ_DICT_SIZE_MASK = LZ_DICT_SIZE - 1, MIN_MATCH_LEN = 3, MAX_MATCH_LEN = 258, LZ_HASH_BITS = 12, LZ_HASH_SIZE = 1 << LZ_HASH_BITS, LZ_CODE_BUF_SIZE = 24U * 1024U,
+      NUM_REP_DISTS = 3, SKIP_TRIGGER_BITS = 5, MIN_FIT_CHUNK_SIZE = 512, MAX_STORED_BLOCK_SIZE = 65535, DEADLINE_CHECK_INTERVAL = 4096, REGION_SIZE = 16384, REGION_SAMPLE_SLICES = 4, REGION_SAMPLE_SLICE_SIZE = 1024, MIN_REGION_SAMPLE_SIZE = 512
     };
 
-    output_stream *m_pStream;
-    uint m_flags, m_max_probes; 
-    bool m_greedy_parsing, m_all_writes_succeeded;
-    uint m_adler32, m_lookahead_pos, m_lookahead_size, m_dict_size;
-    uint8 *m_pLZ_code_buf, *m_pLZ_flags, *m_pOutput_buf;
-    uint m_num_flags_left, m_bits_in, m_bit_buffer;
-    uint m_saved_match_dist, m_saved_match_len, m_saved_lit;
-    uint8 m_dict[LZ_DICT_SIZE + MAX_MATCH_LEN - 1];
+#if TDEFL_TAGGED_HASH_CHAINS
+    typedef uint32 chain_entry;
+#else
+    typedef uint16 chain_entry;
+#endif
+
+    // Hot state touched for every input byte: one cache line at the start of the object.
+    TDEFL_ALIGN(TDEFL_CACHE_LINE_SIZE) uint8 *m_pLZ_code_buf; uint8 *m_pLZ_flags;
+    uint m_lookahead_pos, m_lookahead_size, m_dict_size, m_max_probes, m_num_flags_left, m_strategy;
+    uint m_saved_match_dist, m_saved_match_len, m_saved_lit, m_num_misses;
+    bool m_greedy_parsing;
+    int m_work_left;
+    // Bit output state, touched while flushing blocks.
+    TDEFL_ALIGN(TDEFL_CACHE_LINE_SIZE) uint8 *m_pOutput_buf; output_stream *m_pStream;
+    uint m_bit_buffer, m_bits_in, m_flags, m_adler32;
+    uint m_rep_dists[NUM_REP_DISTS], m_num_stride_hints;
+    bool m_all_writes_succeeded;
+    size_t m_total_out;
+    // Cold state, touched once per call or per DEADLINE_CHECK_INTERVAL bytes.
+    TDEFL_ALIGN(TDEFL_CACHE_LINE_SIZE) uint64 m_deadline_ticks; uint64 m_start_ticks, m_level_start_ticks;
+    size_t m_expected_total_len, m_total_in, m_level_start_total_in;
+    uint m_degrade_level, m_region_bytes_left, m_block_max_probes, m_max_dict_size;
+    bool m_parse_only;
+    uint m_stride_hints[MAX_STRIDE_HINTS];
+    // Per-block Huffman tables share the header pages.
     uint16 m_huff_count[MAX_HUFF_TABLES][MAX_HUFF_SYMBOLS];
     uint16 m_huff_codes[MAX_HUFF_TABLES][MAX_HUFF_SYMBOLS];
     uint8 m_huff_code_sizes[MAX_HUFF_TABLES][MAX_HUFF_SYMBOLS];
-    uint8 m_lz_code_buf[LZ_CODE_BUF_SIZE];
-    uint16 m_next[LZ_DICT_SIZE];
-    uint16 m_hash[LZ_HASH_SIZE];
-    uint8 m_output_buf[OUT_BUF_SIZE];
+    // Per-byte arrays, each page aligned, in the order the dictionary update and match finder touch them.
+    TDEFL_ALIGN(TDEFL_PAGE_SIZE) chain_entry m_hash[LZ_HASH_SIZE];
+    TDEFL_ALIGN(TDEFL_PAGE_SIZE) chain_entry m_next[LZ_DICT_SIZE];
+    TDEFL_ALIGN(TDEFL_PAGE_SIZE) uint8 m_dict[LZ_DICT_SIZE + MAX_MATCH_LEN - 1];
+    TDEFL_ALIGN(TDEFL_PAGE_SIZE) uint8 m_lz_code_buf[LZ_CODE_BUF_SIZE];
+    TDEFL_ALIGN(TDEFL_PAGE_SIZE) uint8 m_output_buf[OUT_BUF_SIZE];
 
-    void optimize_huffman_table(int table_num, int table_len, int code_size_limit);
+    bool start_stream(output_stream *pStream, int flags, bool has_dict, uint32 dict_id);
+    void optimize_huffman_table(int table_num, int table_len, int code_size_limit, bool static_table = false);
     inline void flush_output_buffer();
+    uint pack_code_sizes(uint8 *pPacked_code_sizes, int &num_lit_codes, int &num_dist_codes, int &num_bit_lengths);
     void start_dynamic_block(bool last_block);
-    void flush_block(bool last_block);
+    void start_static_block(bool last_block);
+    void flush_block(bool last_block, bool static_block = false);
+    void write_tokens();
+    uint64 compute_block_bits(uint &num_codes, uint8 *&pCodes_end, size_t &num_bytes, bool &static_block);
+    bool fit_block(uint64 max_bits, bool last_block, size_t &num_bytes);
     inline void record_literal(uint8 lit);
     inline void record_match(uint match_len, uint match_dist);
     inline void find_match(uint pos, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len);
+    inline void find_chain_match(uint pos, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len);
+    inline void try_match_dist(uint pos, uint dist, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len);
+    inline void find_rle_match(uint pos, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len);
+    void compress_lz(const uint8 *pSrc, uint data_len);
+    void compress_stored(const uint8 *pSrc, uint data_len);
+    void end_block();
+    void put_stored_block_header(uint len);
+    void update_degrade_level();
+    static uint classify_region(const uint8 *pBuf, uint len);
+    void set_strategy(uint strategy);
   };
 
-} // tinydeflate
+  // Streaming decompressor for zlib (RFC 1950), raw deflate (RFC 1951) and single member gzip (RFC 1952) streams. Compressed data is read from an input
+  // stream as it's needed, and the decompressed data is written to an output stream 32KB at a time, so memory use doesn't depend on the stream's size.
+  // zlib and gzip checksums are verified. Like the compressor it makes no heap allocations, but it's about 100KB, so don't put it on the stack.
+  class decompressor
+  {
+  public:
+    enum { FORMAT_RAW = 0, FORMAT_ZLIB, FORMAT_GZIP, FORMAT_AUTO };
 
-#endif // TINYDEFLATE_HEADER_INCLUDED
+    decompressor() : m_pIn(0), m_pOut(0), m_pBody_copy(0), m_pDict(0), m_dict_len(0), m_dict_id(0), m_format(FORMAT_RAW), m_in_ofs(0), m_in_base(0), m_total_out(0) { }
 
-// -------------------  End of header file
-// If you only want the header file, define TINYDEFLATE_HEADER_FILE_ONLY then include this file (tinydeflate.cpp).
+    // Preset dictionary for the following decompress() calls, or NULL for none. zlib streams that need one (FDICT) are checked against its Adler-32,
+    // and raw deflate streams start with it as history. Only the last 32KB are used. The buffer isn't copied, so it must outlive the calls.
+    // Pass its Adler-32 (seeded with 1) as dict_id if it's already known, or 0 to have it computed.
+    void set_dictionary(const void *pDict, uint dict_len, uint32 dict_id = 0);
 
-#ifndef TINYDEFLATE_HEADER_FILE_ONLY
+    // Decompresses one stream. FORMAT_AUTO recognizes zlib and gzip headers, and otherwise assumes raw deflate. If pBody_copy isn't NULL, the deflate
+    // data itself (the stream minus the container's header and trailer) is copied to it as it's read, so it can be rewrapped without recompressing it.
+    // Returns false if the input is invalid or truncated, fails its checksum, or a read or write failed.
+    bool decompress(input_stream *pIn, output_stream *pOut, uint format = FORMAT_AUTO, output_stream *pBody_copy = 0);
 
-#include <stdlib.h>
-#include <string.h>
-#include <assert.h>
-#define TDEFL_ASSERT(x) assert(x)
+    // The format of the last stream (as detected with FORMAT_AUTO), the number of compressed bytes it used so far (container included), and the number of bytes written.
+    inline uint get_format() const { return m_format; }
+    inline uint64 get_total_in() const { return m_in_base + m_in_ofs; }
+    inline uint64 get_total_out() const { return m_total_out; }
 
-// The core tinydeflate::compressor class doesn't use the heap at all, but the optional high-level helper functions do.
-#define TDEFL_MALLOC(x) malloc(x)
-#define TDEFL_FREE(x) free(x)
-#define TDEFL_REALLOC(p, x) realloc(p, x)
-#define TDEFL_NEW new
-#define TDEFL_DELETE delete
+  private:
+    enum { IN_BUF_SIZE = 16384, IN_BUF_KEEP = 8, WINDOW_SIZE = 65536, FAST_BITS = 10, MAX_HUFF_SYMBOLS_0 = 288, MAX_HUFF_SYMBOLS_1 = 32, MAX_HUFF_SYMBOLS_2 = 19 };
 
-#define TDEFL_MAX(a,b) (((a)>(b))?(a):(b))
-#define TDEFL_MIN(a,b) (((a)<(b))?(a):(b))
+    // Codes up to FAST_BITS long are decoded with one lookup in m_fast (length << 9 | symbol, or -1), longer ones a bit at a time from m_count and m_symbols.
+    struct huff_table { int16 m_fast[1 << FAST_BITS]; uint16 m_count[16], m_symbols[MAX_HUFF_SYMBOLS_0]; };
 
-namespace tinydeflate
-{
-  // Purposely making these tables static for faster init and thread safety.
-  static const uint16 s_len_sym[256] = {
-    257,258,259,260,261,262,263,264,265,265,266,266,267,267,268,268,269,269,269,269,270,270,270,270,271,271,271,271,272,272,272,272,
-    273,273,273,273,273,273,273,273,274,274,274,274,274,274,274,274,275,275,275,275,275,275,275,275,276,276,276,276,276,276,276,276,
-    277,277,277,277,277,277,277,277,277,277,277,277,277,277,277,277,278,278,278,278,278,278,278,278,278,278,278,278,278,278,278,278,
-    279,279,279,279,279,279,279,279,279,279,279,279,279,279,279,279,280,280,280,280,280,280,280,280,280,280,280,280,280,280,280,280,
-    281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,
-    282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,
-    283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,
-    284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,285 };
+    input_stream *m_pIn;
+    output_stream *m_pOut, *m_pBody_copy;
+    const uint8 *m_pDict;
+    uint m_dict_len, m_dict_avail;
+    uint32 m_dict_id;
+    uint m_format, m_in_ofs, m_in_size, m_num_pad, m_bit_buf, m_num_bits, m_window_ofs;
+    uint64 m_in_base, m_copy_pos, m_total_out;
+    uint32 m_checksum;
+    bool m_in_eof, m_succeeded;
+    huff_table m_tables[3];
+    uint8 m_in_buf[IN_BUF_SIZE];
+    uint8 m_window[WINDOW_SIZE];
 
-  static const uint8 s_len_extra[256] = {
-    0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
-    4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
-    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
-    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,0 };
+    void refill();
+    inline uint get_byte();
+    inline uint get_bits(uint num_bits);
+    inline int decode_symbol(const huff_table &table);
+    inline bool put_byte(uint c);
+    bool build_table(huff_table &table, const uint8 *pCode_sizes, uint num_syms);
+    bool read_dynamic_tables();
+    bool decode_block();
+    bool write_window(uint ofs, uint len);
+    void end_body();
+  };
 
-  static const uint8 s_small_dist_sym[512] = {
-    0,1,2,3,4,4,5,5,6,6,6,6,7,7,7,7,8,8,8,8,8,8,8,8,9,9,9,9,9,9,9,9,10,10,10,10,10,10,10,10,10,10,10,10,10,10,10,10,11,11,11,11,11,11,
-    11,11,11,11,11,11,11,11,11,11,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,13,
-    13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,14,14,14,14,14,14,14,14,14,14,14,14,
-    14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,
-    14,14,14,14,14,14,14,14,14,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
-    15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,16,16,16,16,16,16,16,16,16,16,16,16,16,
-    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
-    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
-    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,17,17,17,17,17,17,17,17,17,17,17,17,17,17,
-    17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,
-    17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,
-    17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17 };
+  // Reversible preconditioning filters for arrays of fixed-size elements (float and integer arrays, counters, structs), which LZ77 alone compresses poorly:
+  // neighbouring elements tend to share their high bytes, but those are interleaved with low bytes that don't repeat. Subtracting or XORing each element
+  // with the previous one turns slowly changing values into small numbers, and splitting the elements into byte planes (or one plane per struct field)
+  // puts the bytes that do repeat next to each other.
+  struct precondition_params
+  {
+    // m_delta: DELTA_SUB subtracts each field of the previous element (fields of 1, 2, 4 or 8 bytes as little endian integers, others byte by byte),
+    // DELTA_XOR XORs them, which usually does better on floats.
+    enum { DELTA_NONE = 0, DELTA_SUB, DELTA_XOR };
+    // m_layout: LAYOUT_SHUFFLE splits the elements into m_elem_size byte planes (as Blosc's shuffle does), LAYOUT_TRANSPOSE into one plane per field.
+    enum { LAYOUT_NONE = 0, LAYOUT_SHUFFLE, LAYOUT_TRANSPOSE };
+    enum { MAX_ELEM_SIZE = 255, MAX_FIELDS = 16 };
 
-  static const uint8 s_small_dist_extra[512] = {
-    0,0,0,0,1,1,1,1,2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,5,5,5,5,5,5,5,5,
-    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-    6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
-    6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
-    7,7,7,7,7,7,7,7 };
+    uint m_elem_size, m_delta, m_layout, m_num_fields;
+    uint8 m_field_sizes[MAX_FIELDS];
 
-  static const uint8 s_large_dist_sym[128] = {
-    0,0,18,19,20,20,21,21,22,22,22,22,23,23,23,23,24,24,24,24,24,24,24,24,25,25,25,25,25,25,25,25,26,26,26,26,26,26,26,26,26,26,26,26,
-    26,26,26,26,27,27,27,27,27,27,27,27,27,27,27,27,27,27,27,27,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,
-    28,28,28,28,28,28,28,28,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29 };
+    inline precondition_params(uint elem_size = 4, uint delta = DELTA_NONE, uint layout = LAYOUT_SHUFFLE) : m_elem_size(elem_size), m_delta(delta), m_layout(layout), m_num_fields(0) { }
 
-  static const uint8 s_large_dist_extra[128] = {
-    0,0,8,8,9,9,9,9,10,10,10,10,10,10,10,10,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,
-    12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,
-    13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13 };
-  
-  template <class T> inline void clear_obj(T &obj) { memset(&obj, 0, sizeof(obj)); }
+    // Adds the next field of a struct element. The field sizes must add up to m_elem_size; without any fields, the whole element is one field.
+    inline bool add_field(uint size) { if ((m_num_fields >= MAX_FIELDS) || (!size) || (size > MAX_ELEM_SIZE)) return false; m_field_sizes[m_num_fields++] = static_cast<uint8>(size); return true; }
+    bool is_valid() const;
+  };
 
-  uint32 adler32(const uint8 *ptr, size_t buf_len, uint32 adler32)
-  {
-    uint32 i, s1 = adler32 & 0xffff, s2 = adler32 >> 16; size_t block_len = buf_len % 5552;
-    while (buf_len) {
-      for (i = 0; i + 7 < block_len; i += 8, ptr += 8) {
-        s1 += ptr[0], s2 += s1; s1 += ptr[1], s2 += s1; s1 += ptr[2], s2 += s1; s1 += ptr[3], s2 += s1; 
-        s1 += ptr[4], s2 += s1; s1 += ptr[5], s2 += s1; s1 += ptr[6], s2 += s1; s1 += ptr[7], s2 += s1; 
-      }
-      for ( ; i < block_len; ++i) s1 += *ptr++, s2 += s1;
-      s1 %= 65521U, s2 %= 65521U; buf_len -= block_len; block_len = 5552;
-    }
-    return (s2 << 16) + s1;
-  }
+  // precondition_mem() filters len bytes from pSrc into pDst, and unprecondition_mem() undoes it. The buffers must not overlap. A trailing partial
+  // element is copied as is. Returns false if params isn't valid.
+  bool precondition_mem(void *pDst, const void *pSrc, size_t len, const precondition_params &params);
+  bool unprecondition_mem(void *pDst, const void *pSrc, size_t len, const precondition_params &params);
 
-  uint32 crc32(const uint8 *ptr, size_t buf_len, uint32 crc)
-  {
-    static const uint32 s_crc32[16] = { 0, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
-    crc = ~crc; while (buf_len--) { uint8 b = *ptr++; crc = (crc >> 4) ^ s_crc32[(crc & 0xF) ^ (b & 0xF)]; crc = (crc >> 4) ^ s_crc32[(crc & 0xF) ^ (b >> 4)]; } return ~crc;
-  }
-  
-  // Radix sorts sym_freq[] array by 16-bit key m_key. Returns ptr to sorted values.
-  struct sym_freq { uint16 m_key, m_sym_index; };
-  static inline sym_freq* radix_sort_syms(uint num_syms, sym_freq* pSyms0, sym_freq* pSyms1)
+  // compress_preconditioned_to_heap() filters a block, then compresses it like compress_mem_to_heap(). The output starts with a 4 byte header (plus one
+  // byte per field) recording params and the container, so decompress_preconditioned_to_heap() needs nothing but the output to get the block back.
+  // Both return a malloc()'d block, or NULL on failure.
+  void *compress_preconditioned_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, const precondition_params &params, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+  void *decompress_preconditioned_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len);
+
+  // Incremental recompression of a buffer that changes a little between calls (documents saved after small edits, and the like).
+  // The input is cut into content-defined segments: a gear rolling hash picks the boundaries, so inserting or deleting bytes only moves the boundaries near the edit.
+  // Each segment is compressed on its own and ends with a full flush. On the following calls, segments whose MurmurHash3 hash matches a segment of the previous
+  // call are copied instead of compressed, and the zlib trailer is rebuilt from the per-segment Adler-32s with adler32_combine().
+  class incremental_compressor
   {
-    const uint cMaxPasses = 2; uint32 hist[256 * cMaxPasses]; clear_obj(hist);
-    for (uint i = 0; i < num_syms; i++) { uint freq = pSyms0[i].m_key; hist[freq & 0xFF]++; hist[256 + ((freq >> 8) & 0xFF)]++; }
-    sym_freq* pCur_syms = pSyms0, *pNew_syms = pSyms1;
-    uint total_passes = cMaxPasses; while ((total_passes > 1) && (num_syms == hist[(total_passes - 1) * 256])) total_passes--;
-    for (uint pass_shift = 0, pass = 0; pass < total_passes; pass++, pass_shift += 8)
-    {
-      const uint32* pHist = &hist[pass << 8];
-      uint offsets[256], cur_ofs = 0;
-      for (uint i = 0; i < 256; i++) { offsets[i] = cur_ofs; cur_ofs += pHist[i]; }
-      for (uint i = 0; i < num_syms; i++) pNew_syms[offsets[(pCur_syms[i].m_key >> pass_shift) & 0xFF]++] = pCur_syms[i];
-      sym_freq* t = pCur_syms; pCur_syms = pNew_syms; pNew_syms = t;
-    }
-    return pCur_syms;
-  }
+  public:
+    incremental_compressor();
+    ~incremental_compressor();
 
-  // calculate_minimum_redundancy() originally written by: Alistair Moffat, alistair@cs.mu.oz.au, Jyrki Katajainen, jyrki@diku.dk, November 1996.
-  static void calculate_minimum_redundancy(sym_freq *A, int n)
+    // avg_segment_size is rounded down to a power of 2 (minimum 1KB, maximum 256MB). Segments are between a quarter of and 4 times that size. Forgets the previous output.
+    bool init(int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER, uint avg_segment_size = 64U * 1024U);
+
+    // Compresses pBuf, reusing the segments it has in common with the buffer passed to the previous call. The output stays valid until the next call.
+    bool compress(const void *pBuf, size_t buf_len);
+
+    inline const uint8 *get_output_buf() const { return m_out[m_cur].get_buf(); }
+    inline size_t get_output_size() { return m_out[m_cur].get_size(); }
+    inline uint get_num_segments() const { return m_num_segs[m_cur]; }
+    inline uint get_num_reused_segments() const { return m_num_reused_segs; }
+
+  private:
+    struct segment { uint64 m_hash[2]; uint32 m_adler32; uint m_src_len; size_t m_comp_ofs, m_comp_len; };
+
+    compressor *m_pComp;
+    int m_flags;
+    uint m_min_seg_size, m_max_seg_size, m_num_reused_segs, m_cur;
+    uint64 m_boundary_mask;
+    uint64 m_gear[256];
+    expandable_malloc_output_stream m_out[2];
+    segment *m_pSegs[2];
+    uint m_num_segs[2], m_seg_capacity[2];
+    uint *m_pSeg_index;
+    uint m_seg_index_size;
+
+    uint find_segment_len(const uint8 *pBuf, size_t buf_len) const;
+    incremental_compressor(const incremental_compressor &);
+    incremental_compressor &operator= (const incremental_compressor &);
+  };
+
+  // Compresses a step at a time, for single threaded event loops that can't block for a whole compress_data() call. step() compresses until a time or
+  // byte budget is used up and returns; everything else (window, hash chains, pending block, lazy parser state) stays in the compressor for the next step.
+  // The budget is checked every STEP_GRANULE bytes, so a step overshoots it by up to a granule's worth of work, plus a block flush when one is due.
+  // Input can be given in pieces, as it arrives. C++20 coroutines can co_await step_async() instead.
+  class compression_task
   {
-    int root, leaf, next, avbl, used, dpth;
-    if (n==0) return; else if (n==1) { A[0].m_key = 1; return; }
-    A[0].m_key += A[1].m_key; root = 0; leaf = 2;
-    for (next=1; next < n-1; next++)
-    {
-      if (leaf>=n || A[root].m_key<A[leaf].m_key) { A[next].m_key = A[root].m_key; A[root++].m_key = (uint16)next; } else A[next].m_key = A[leaf++].m_key;
-      if (leaf>=n || (root<next && A[root].m_key<A[leaf].m_key)) { A[next].m_key = (uint16)(A[next].m_key + A[root].m_key); A[root++].m_key = (uint16)next; } else A[next].m_key = (uint16)(A[next].m_key + A[leaf++].m_key);
-    }
-    A[n-2].m_key = 0; for (next=n-3; next>=0; next--) A[next].m_key = A[A[next].m_key].m_key+1;
-    avbl = 1; used = dpth = 0; root = n-2; next = n-1;
-    while (avbl>0)
+  public:
+    enum { STEP_GRANULE = 4096 };
+    enum status { STATUS_FAILED = -1, STATUS_IN_PROGRESS, STATUS_NEED_INPUT, STATUS_DONE };
+
+    compression_task();
+    ~compression_task();
+
+    bool init(output_stream *pOut, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+    // Sets the input the next steps compress. The buffer must stay valid until step() returns STATUS_NEED_INPUT or STATUS_DONE. With last_input, the
+    // stream is finished once it's compressed. Fails if the previous input isn't consumed yet.
+    bool set_input(const void *pSrc, size_t src_len, bool last_input = true);
+
+    // Compresses for up to max_usecs microseconds and max_bytes input bytes (0 for either means no limit). Returns STATUS_IN_PROGRESS if the budget ran out
+    // first, STATUS_NEED_INPUT once the input is consumed (call set_input() before stepping again), and STATUS_DONE once the stream is finished.
+    status step(uint max_usecs, size_t max_bytes = 0);
+
+    inline status get_status() const { return m_status; }
+    inline uint64 get_total_in() const { return m_total_in; }
+
+#if TDEFL_COROUTINES
+    // co_await step_async() runs a step, and if its budget ran out first, suspends the coroutine and passes its std::coroutine_handle<> to schedule
+    // (say, to queue it on the event loop) to be resumed later. Evaluates to the step's status, so a coroutine compresses its input in slices with:
+    //   while ((co_await task.step_async(500, schedule)) == compression_task::STATUS_IN_PROGRESS) { }
+    template <typename Scheduler> struct step_awaiter
     {
-      while (root>=0 && (int)A[root].m_key==dpth) { used++; root--; }
-      while (avbl>used) { A[next--].m_key = (uint16)(dpth); avbl--; }
-      avbl = 2*used; dpth++; used = 0;
-    }
-  }
+      compression_task *m_pTask; uint m_max_usecs; size_t m_max_bytes; Scheduler m_schedule; status m_status;
 
-  // Limits canonical Huffman code table's max code size.
-  enum { MAX_SUPPORTED_HUFF_CODESIZE = 32 };
-  static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, int max_code_size)
-  {
-    if (code_list_len <= 1) return;
-    for (int i = max_code_size + 1; i <= MAX_SUPPORTED_HUFF_CODESIZE; i++) pNum_codes[max_code_size] += pNum_codes[i];
-    uint32 total = 0; for (int i = max_code_size; i > 0; i--) total += (((uint32)pNum_codes[i]) << (max_code_size - i));
-    while (total != (1UL << max_code_size))
+      bool await_ready() { m_status = m_pTask->step(m_max_usecs, m_max_bytes); return m_status != STATUS_IN_PROGRESS; }
+      void await_suspend(std::coroutine_handle<> h) { m_schedule(h); }
+      status await_resume() const { return m_status; }
+    };
+    template <typename Scheduler> step_awaiter<Scheduler> step_async(uint max_usecs, Scheduler schedule, size_t max_bytes = 0)
     {
-      pNum_codes[max_code_size]--; 
-      for (int i = max_code_size - 1; i > 0; i--) if (pNum_codes[i]) { pNum_codes[i]--; pNum_codes[i + 1] += 2; break; } 
-      total--;
+      return step_awaiter<Scheduler>{ this, max_usecs, max_bytes, schedule, STATUS_IN_PROGRESS };
     }
-  }
+#endif
+
+  private:
+    compressor *m_pComp;
+    const uint8 *m_pSrc;
+    size_t m_src_len, m_src_ofs;
+    uint64 m_total_in;
+    bool m_last_input;
+    status m_status;
+
+    compression_task(const compression_task &);
+    compression_task &operator= (const compression_task &);
+  };
 
-  void compressor::optimize_huffman_table(int table_num, int table_len, int code_size_limit)
+  // Message encoder for the WebSocket permessage-deflate extension (RFC 7692). Keep one per connection: the compressor, and with context takeover its
+  // dictionary, lives across messages, so short messages can reference the ones sent before them. Each message ends with a sync flush, minus the
+  // trailing 00 00 ff ff the RFC has the sender remove. Short messages get fixed Huffman codes when those beat a dynamic block's header.
+  class permessage_deflate_encoder
   {
-    sym_freq syms0[MAX_HUFF_SYMBOLS], syms1[MAX_HUFF_SYMBOLS];
-    
-    int num_used_syms = 0;
-    const uint16 *pSym_count = &m_huff_count[table_num][0];
-    for (int i = 0; i < table_len; i++) if (pSym_count[i]) { syms0[num_used_syms].m_key = (uint16)pSym_count[i]; syms0[num_used_syms++].m_sym_index = (uint16)i; }
-      
-    sym_freq* pSyms = radix_sort_syms(num_used_syms, syms0, syms1); calculate_minimum_redundancy(pSyms, num_used_syms);
+  public:
+    permessage_deflate_encoder();
+    ~permessage_deflate_encoder();
 
-    int num_codes[1 + MAX_SUPPORTED_HUFF_CODESIZE]; clear_obj(num_codes); for (int i = 0; i < num_used_syms; i++) num_codes[pSyms[i].m_key]++;
+    // max_window_bits is the negotiated server_max_window_bits (client_max_window_bits on the client side), 8-15. Set no_context_takeover if
+    // server_no_context_takeover (client_no_context_takeover) was negotiated: each message then ends with a full flush instead. flags must not include WRITE_ZLIB_HEADER.
+    bool init(int flags = DEFAULT_MAX_PROBES, uint max_window_bits = 15, bool no_context_takeover = false);
 
-    huffman_enforce_max_code_size(num_codes, num_used_syms, code_size_limit);
+    // Compresses one message into the payload of its frame(s), which stays valid until the next call. After a failure the compression context is
+    // lost, so the connection can't send further compressed messages without calling init() again.
+    bool compress_message(const void *pMsg, size_t msg_len);
 
-    clear_obj(m_huff_code_sizes[table_num]); clear_obj(m_huff_codes[table_num]); 
-    for (int i = 1, j = num_used_syms; i <= code_size_limit; i++) 
-      for (int l = num_codes[i]; l > 0; l--) m_huff_code_sizes[table_num][pSyms[--j].m_sym_index] = static_cast<uint8>(i);
+    inline const uint8 *get_payload_buf() const { return m_out.get_buf(); }
+    inline size_t get_payload_size() const { return m_payload_size; }
 
-    uint next_code[MAX_SUPPORTED_HUFF_CODESIZE + 1]; next_code[1] = 0;
-    for (int j = 0, i = 2; i <= code_size_limit; i++) next_code[i] = j = ((j + num_codes[i - 1]) << 1);
+  private:
+    compressor *m_pComp;
+    expandable_malloc_output_stream m_out;
+    size_t m_payload_size;
+    bool m_no_context_takeover;
 
-    for (int i = 0; i < table_len; i++)
-    {
-      uint code_size; if ((code_size = m_huff_code_sizes[table_num][i]) == 0) continue;
-      uint rev_code = 0, code = next_code[code_size]++;
-      for (int l = code_size; l > 0; l--, code >>= 1) rev_code = (rev_code << 1) | (code & 1);
-      m_huff_codes[table_num][i] = static_cast<uint16>(rev_code);
-    }
-  }
-  
-  inline void compressor::flush_output_buffer()
+    permessage_deflate_encoder(const permessage_deflate_encoder &);
+    permessage_deflate_encoder &operator= (const permessage_deflate_encoder &);
+  };
+
+  // Rolling per-channel dictionary, for channels (a topic, a tenant, ...) whose messages resemble each other. Each message is compressed as a complete
+  // stream, but with the last history_size bytes of the channel's earlier messages as its preset dictionary, so short messages get most of the benefit
+  // of context takeover without a long-lived stream, and without a trained dictionary to maintain. The sender and the receiver each keep a channel_context,
+  // which must see the same messages in the same order. The version counts the messages in the history; senders can pass it along so receivers can check
+  // it, and with zlib streams the header's dictionary id makes a receiver that's out of sync fail rather than return garbage.
+  // The sender keeps its compressor between messages, so the history stays in the window with its hash chains built, and nothing is hashed again.
+  class channel_context
   {
-    if ((m_all_writes_succeeded) && (m_pOutput_buf > m_output_buf))
-      m_all_writes_succeeded = m_pStream->put_buf(m_output_buf, static_cast<int>(m_pOutput_buf - m_output_buf));
-    m_pOutput_buf = m_output_buf;
-  }
+  public:
+    enum { MIN_HISTORY_SIZE = 256, MAX_HISTORY_SIZE = 32768 };
 
-#define TDEFL_PUT_BITS(b, l) do { uint bits = b; uint len = l; TDEFL_ASSERT(bits <= ((1U << len) - 1U)); m_bit_buffer |= (bits << m_bits_in); m_bits_in += len; \
-  while (m_bits_in >= 8) { *m_pOutput_buf++ = static_cast<uint8>(m_bit_buffer); if (m_pOutput_buf == &m_output_buf[OUT_BUF_SIZE]) flush_output_buffer(); m_bit_buffer >>= 8; m_bits_in -= 8; } } while (0)
-  
-#define TDEFL_RLE_PREV_CODE_SIZE() { if (rle_repeat_count) { \
-    if (rle_repeat_count < 3) { \
-      m_huff_count[2][prev_code_size] = (uint16)(m_huff_count[2][prev_code_size] + rle_repeat_count); \
-      while (rle_repeat_count--) packed_code_sizes[num_packed_code_sizes++] = prev_code_size; \
-    } else { \
-      m_huff_count[2][16] = (uint16)(m_huff_count[2][16] + 1); packed_code_sizes[num_packed_code_sizes++] = 16; packed_code_sizes[num_packed_code_sizes++] = (uint8)(rle_repeat_count - 3); \
-  } rle_repeat_count = 0; } }
+    channel_context();
+    ~channel_context();
 
-#define TDEFL_RLE_ZERO_CODE_SIZE() { if (rle_z_count) { \
-    if (rle_z_count < 3) { \
-      m_huff_count[2][0] = (uint16)(m_huff_count[2][0] + rle_z_count); while (rle_z_count--) packed_code_sizes[num_packed_code_sizes++] = 0; \
-    } else if (rle_z_count <= 10) { \
-      m_huff_count[2][17] = (uint16)(m_huff_count[2][17] + 1); packed_code_sizes[num_packed_code_sizes++] = 17; packed_code_sizes[num_packed_code_sizes++] = (uint8)(rle_z_count - 3); \
-    } else { \
-      m_huff_count[2][18] = (uint16)(m_huff_count[2][18] + 1); packed_code_sizes[num_packed_code_sizes++] = 18; packed_code_sizes[num_packed_code_sizes++] = (uint8)(rle_z_count - 11); \
-  } rle_z_count = 0; } }
-  
-  void compressor::start_dynamic_block(bool last_block)
+    // flags as for compress_mem_to_heap(): WRITE_ZLIB_HEADER picks zlib streams (with the dictionary id) over raw deflate. AUTO_STRATEGY_FLAG is
+    // ignored. history_size must be between MIN_HISTORY_SIZE and MAX_HISTORY_SIZE. Clears the history and the version.
+    bool init(int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER, uint history_size = MAX_HISTORY_SIZE);
+
+    // Compresses a message to pOut as one complete stream, then appends it to the history. *pVersion, if not NULL, is set to the version the
+    // message was compressed against.
+    bool compress_message(const void *pMsg, size_t msg_len, output_stream *pOut, uint64 *pVersion = NULL);
+
+    // Decompresses a message to pOut, then appends it to the history. Fails, leaving the history as it was, if the stream is invalid, was compressed
+    // against a different dictionary, or expected_version (unless it's ~0ULL) isn't the current version.
+    bool decompress_message(input_stream *pIn, output_stream *pOut, uint64 expected_version = ~0ULL);
+
+    // Appends data to the history without compressing it, e.g. to seed both ends with typical content. Counts as a message.
+    bool append(const void *pBuf, size_t len);
+
+    inline uint64 get_version() const { return m_version; }
+    inline const uint8 *get_history() const { return m_pBuf + m_hist_ofs; }
+    inline uint get_history_size() const { return m_hist_len; }
+    // Adler-32 of the history, as found in the header of zlib streams compressed against it.
+    inline uint32 get_dict_id() const { return m_dict_id; }
+
+  private:
+    compressor *m_pComp;
+    decompressor *m_pDecomp;
+    expandable_malloc_output_stream m_message;
+    // The history lives in a buffer twice its maximum size, and is only moved back to the start when an append reaches the end.
+    uint8 *m_pBuf;
+    uint m_max_hist_len, m_hist_ofs, m_hist_len;
+    uint32 m_dict_id;
+    uint64 m_version;
+    int m_flags;
+    bool m_comp_primed;
+
+    void append_history(const uint8 *pSrc, size_t len);
+    channel_context(const channel_context &);
+    channel_context &operator= (const channel_context &);
+  };
+
+  // Record batch container: many small records compressed together, with random access. Records are grouped into frames of about frame_size bytes,
+  // each compressed as its own stream, so reading one record only decompresses its frame. Per-frame record size tables go in a compressed directory
+  // at the end, followed by a fixed TRAILER_SIZE byte trailer (directory offset and size, counts, flags, magic), so the writer streams its output.
+  // With reordering, the writer sorts a window of REORDER_WINDOW_FRAMES frames of records by a MinHash signature of their 4 byte shingles before
+  // cutting frames, so records with a lot of content in common land in the same frame. Record indices still follow the order they were added in, but
+  // reading a reordered batch in index order jumps between the frames of each window.
+  class record_batch_writer
   {
-    optimize_huffman_table(0, MAX_HUFF_SYMBOLS_0, 15); optimize_huffman_table(1, MAX_HUFF_SYMBOLS_1, 15);
-    
-    int num_lit_codes; for (num_lit_codes = 286; num_lit_codes > 257; num_lit_codes--) if (m_huff_code_sizes[0][num_lit_codes - 1]) break;
-    int num_dist_codes; for (num_dist_codes = 30; num_dist_codes > 1; num_dist_codes--) if (m_huff_code_sizes[1][num_dist_codes - 1]) break;
+  public:
+    enum { DEFAULT_FRAME_SIZE = 65536, REORDER_WINDOW_FRAMES = 16, TRAILER_SIZE = 32 };
 
-    uint8 code_sizes_to_pack[MAX_HUFF_SYMBOLS_0 + MAX_HUFF_SYMBOLS_1], packed_code_sizes[MAX_HUFF_SYMBOLS_0 + MAX_HUFF_SYMBOLS_1], prev_code_size = 0xFF;
-    memcpy(code_sizes_to_pack, &m_huff_code_sizes[0][0], num_lit_codes);
-    memcpy(code_sizes_to_pack + num_lit_codes, &m_huff_code_sizes[1][0], num_dist_codes);
-    uint total_code_sizes_to_pack = num_lit_codes + num_dist_codes, num_packed_code_sizes = 0, rle_z_count = 0, rle_repeat_count = 0;
+    record_batch_writer();
+    ~record_batch_writer();
 
-    memset(&m_huff_count[2][0], 0, sizeof(m_huff_count[2][0]) * MAX_HUFF_SYMBOLS_2);
-    for (uint i = 0; i < total_code_sizes_to_pack; i++)
-    {
-      uint8 code_size = code_sizes_to_pack[i];
-      if (!code_size)
-      {
+    // flags: probes and parsing flags for the frames; with WRITE_ZLIB_HEADER they're zlib streams, with checksums, instead of raw deflate.
+    bool init(output_stream *pStream, int flags = DEFAULT_MAX_PROBES, uint frame_size = DEFAULT_FRAME_SIZE, bool reorder = false);
+
+    // Adds the next record; its index is the number of records added before it. Records over frame_size get a frame of their own.
+    bool add_record(const void *pRecord, uint len);
+
+    // Writes the pending frames, the directory and the trailer.
+    bool finish();
+
+    inline uint get_num_records() const { return m_num_records; }
+    inline uint get_num_frames() const { return m_num_frames; }
+
+  private:
+    output_stream *m_pStream;
+    int m_flags;
+    uint m_frame_size, m_num_records, m_num_frames, m_window_first_record;
+    bool m_reorder, m_all_writes_succeeded;
+    uint64 m_out_ofs;
+    // The records of the current window back to back, and their offsets (one more than there are records).
+    expandable_malloc_output_stream m_window, m_window_ofs;
+    expandable_malloc_output_stream m_frame, m_comp;
+    // Directory: per frame compressed size, size and number of records; per slot (records in frame order) its size; with reordering, per record its slot.
+    expandable_malloc_output_stream m_dir_frames, m_dir_sizes, m_dir_slots;
+
+    bool flush_window();
+    bool flush_frame(uint num_records);
+    record_batch_writer(const record_batch_writer &);
+    record_batch_writer &operator= (const record_batch_writer &);
+  };
+
+  // Reads records from a record batch container in memory (e.g. a mapped file), which must outlive the reader. The last frame read stays decompressed,
+  // so reading nearby records costs nothing more. Not thread safe: use one reader per thread.
+  class record_batch_reader
+  {
+  public:
+    record_batch_reader();
+    ~record_batch_reader();
+
+    // Reads the trailer and directory. Returns false if the container is invalid.
+    bool init(const void *pBuf, size_t buf_len);
+
+    inline uint get_num_records() const { return m_num_records; }
+    inline uint get_num_frames() const { return m_num_frames; }
+    inline uint64 get_num_frames_decompressed() const { return m_num_frames_decompressed; }
+
+    // Returns a pointer to a record, valid until the next call, and its size in *pLen. Returns NULL if the index is out of range or its frame is corrupt.
+    const void *get_record(uint index, uint *pLen);
+
+  private:
+    struct frame { uint64 m_ofs; uint m_comp_size, m_size, m_first_slot; };
+
+    const uint8 *m_pBuf;
+    uint m_num_records, m_num_frames, m_cur_frame;
+    bool m_zlib_frames;
+    uint64 m_num_frames_decompressed;
+    frame *m_pFrames;
+    // Per slot its offset in its frame, per record its slot (NULL if the records weren't reordered).
+    uint *m_pSlot_ofs, *m_pRecord_slots;
+    uint8 *m_pFrame_buf;
+    decompressor *m_pDecomp;
+
+    void clear();
+    record_batch_reader(const record_batch_reader &);
+    record_batch_reader &operator= (const record_batch_reader &);
+  };
+
+#if TDEFL_CPP11
+  // Memoizing front end for compress_mem_to_heap(), for workloads that compress the same bytes over and over.
+  // Results are keyed by the MurmurHash3 128-bit hash of the source plus its length and flags (a hash collision would return the wrong stream, with negligible probability).
+  // The cache is split into shards, each with its own lock for inserts and evictions and its own share of max_bytes. Lookups don't take any locks;
+  // evicted entries are freed once the lookups in flight when they were evicted are done, and an insert waits for that rather than exceed max_bytes.
+  // Eviction uses the CLOCK approximation of LRU: a hit just sets a referenced bit on the entry.
+  // Requires C++11.
+  class compressed_cache
+  {
+  public:
+    compressed_cache(size_t max_bytes = 64U * 1024U * 1024U, uint num_shards = 16);
+    ~compressed_cache();
+
+    // Same contract as tinydeflate::compress_mem_to_heap(): the caller must free() the returned block. Hits return a copy of the cached stream.
+    void *compress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+    void clear();
+    uint64 get_num_hits() const;
+    uint64 get_num_misses() const;
+    size_t get_size_in_bytes() const;
+
+  private:
+    struct shard;
+    shard *m_pShards;
+    uint m_num_shards;
+    size_t m_max_shard_bytes;
+
+    compressed_cache(const compressed_cache &);
+    compressed_cache &operator= (const compressed_cache &);
+  };
+
+  // transcode_stream() recompresses a zlib, gzip or raw deflate stream with new settings, and optionally into a different container (a decompressor::FORMAT_).
+  // The decompressor runs on a second thread and feeds the compressor through a bounded buffer, so memory use doesn't depend on the stream's size.
+  // in_format may be FORMAT_AUTO. flags sets the probes and parsing flags (WRITE_ZLIB_HEADER is ignored: out_format picks the container).
+  // The first 256KB of input are decompressed and recompressed as a sample first. If that doesn't save at least min_gain_percent, the deflate data is
+  // passed through as is (rewrapped if the container changes). *pRecompressed, if not NULL, says which happened.
+  // Requires C++11.
+  bool transcode_stream(input_stream *pIn, output_stream *pOut, uint in_format, uint out_format, int flags = DEFAULT_MAX_PROBES, uint min_gain_percent = 3, bool *pRecompressed = NULL);
+
+  // Compresses log records appended by any number of threads, without ever blocking them.
+  // append() copies a record into a lock-free ring of 64-byte slots: a compare-and-swap reserves the slots, and a release store publishes the record once
+  // it's copied in. It takes no locks and doesn't allocate. When the ring is full the record is dropped (and counted) rather than waited on.
+  // A background thread drains the ring into a compressor in append order. It ends the block with a sync flush once flush_bytes bytes are pending, or once the
+  // oldest pending record is flush_interval_ms old. So a record can be decompressed from the output at most flush_interval_ms plus two polling periods (an
+  // eighth of flush_interval_ms, between 1 and 20ms) after it was appended. Records are written back to back, so include any separator in the record.
+  // The output stream is only called from the background thread.
+  // Requires C++11.
+  class log_compressor
+  {
+  public:
+    log_compressor();
+    ~log_compressor();
+
+    // Starts the background thread. ring_size is rounded up to a power of 2 number of slots; records larger than the ring are always dropped.
+    bool init(output_stream *pStream, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER, uint ring_size = 1024U * 1024U, uint flush_bytes = 64U * 1024U, uint flush_interval_ms = 100);
+
+    // May be called from any thread, until the log_compressor is destroyed or initialized again. Returns false if the record was dropped.
+    bool append(const void *pRecord, uint len);
+
+    // Compresses every record appended before close() was called, finishes the stream and stops the background thread. Records appended from then on are
+    // dropped. Returns false if a write to the output stream failed.
+    bool close();
+
+    uint64 get_num_dropped() const;
+    uint64 get_num_flushes() const;
+
+  private:
+    struct state;
+    state *m_pState;
+
+    log_compressor(const log_compressor &);
+    log_compressor &operator= (const log_compressor &);
+  };
+
+  // Compressed in-process arena for rarely read buffers (the zram idea, for one process's caches). Objects are copied in and packed into pages, and only
+  // a small LRU of pages is kept decompressed. Pages falling out of it are compressed on their own (with the fastest parsing by default); reading an
+  // object decompresses its page back in. A page that was written to through lock() is compressed again when it's evicted. release() leaves holes in
+  // compressed pages, so a background thread rewrites pages that are mostly holes, moving their remaining objects into fresh pages.
+  // Handles stay valid when objects move, and are checked: a released handle never matches a new object.
+  // Thread safe. A single mutex guards the arena, so misses (and the evictions they cause) serialize accesses. Requires C++11.
+  class compressed_arena
+  {
+  public:
+    typedef uint64 handle;
+    enum { MIN_PAGE_SIZE = 1024, DEFAULT_PAGE_SIZE = 4096, MAX_PAGE_SIZE = 1024 * 1024 };
+
+    compressed_arena();
+    ~compressed_arena();
+
+    // Objects are packed into page_size byte pages (larger ones get a page of their own), and at most max_hot_pages pages are kept decompressed, besides
+    // pinned ones. flags sets the probes and parsing flags for compressing pages (WRITE_ZLIB_HEADER is ignored). The background thread looks for pages to
+    // compact every compaction_interval_ms; pass 0 to not start it (and call compact() instead). Frees any objects stored before.
+    bool init(uint page_size = DEFAULT_PAGE_SIZE, uint max_hot_pages = 64, int flags = 1 | GREEDY_PARSING_FLAG, uint compaction_interval_ms = 1000);
+    void deinit();
+
+    // Copies len bytes into the arena. Returns 0 on failure.
+    handle store(const void *pBuf, size_t len);
+    // Frees an object. Returns false if h isn't a valid handle. Don't release an object that's locked.
+    bool release(handle h);
+
+    // Returns an object's size, or 0 if h isn't valid.
+    size_t get_size(handle h);
+    // Copies an object to pDst, which must hold get_size() bytes.
+    bool read(handle h, void *pDst, size_t dst_len);
+
+    // Pins an object's page decompressed in memory and returns a pointer to the object, valid until the matching unlock(). Locks nest.
+    // Returns NULL if h isn't valid, or on failure. Pass modified if the object was written to, so its page is compressed again.
+    void *lock(handle h, size_t *pLen = NULL);
+    void unlock(handle h, bool modified = false);
+
+    // Rewrites the compressed pages that are mostly holes, one page per lock of the mutex. This is what the background thread runs.
+    void compact();
+
+    struct stats
+    {
+      size_t m_num_objects, m_object_bytes;
+      // Memory held by compressed and by decompressed pages. Their sum is the arena's footprint, not counting its tables.
+      size_t m_compressed_bytes, m_hot_bytes;
+      uint64 m_num_hits, m_num_misses, m_num_evictions, m_num_compacted_pages;
+    };
+    stats get_stats();
+
+  private:
+    struct state;
+    state *m_pState;
+
+    compressed_arena(const compressed_arena &);
+    compressed_arena &operator= (const compressed_arena &);
+  };
+
+  // Tiered compression, so writes don't wait on a slow level and storage still ends up well compressed. put() compresses an object right away with
+  // fast_flags. Background threads, at the lowest scheduling priority, then recompress it with slow_flags and swap the new stream in under the lock
+  // when it's at least min_gain_percent smaller. A read sees either stream, never a mix of both.
+  // The store measures the threads' CPU time against the bytes recompression saves, in windows of POLICY_WINDOW_USECS of CPU time. After a window that
+  // saved less than min_savings_per_cpu_ms bytes per ms, it only recompresses one queued object in PROBE_INTERVAL (the rest keep their fast stream) until
+  // a window does better again.
+  // Objects are held as zlib streams. Thread safe. Requires C++11.
+  class tiered_store
+  {
+  public:
+    typedef uint64 handle;
+    enum { PROBE_INTERVAL = 16, POLICY_WINDOW_USECS = 100000 };
+
+    tiered_store();
+    ~tiered_store();
+
+    // Starts num_threads background threads. WRITE_ZLIB_HEADER is implied in both flags. Frees any objects stored before.
+    bool init(int fast_flags = 1 | GREEDY_PARSING_FLAG, int slow_flags = 1024, uint num_threads = 1, uint min_gain_percent = 2, uint min_savings_per_cpu_ms = 256);
+    // Stops the background threads (objects still queued keep their fast stream) and frees all objects.
+    void deinit();
+
+    // Compresses len bytes and queues them for recompression. Returns 0 on failure.
+    handle put(const void *pBuf, size_t len);
+    // Returns false if h isn't a valid handle.
+    bool remove(handle h);
+
+    // Returns an object's size, or 0 if h isn't valid.
+    size_t get_size(handle h);
+    // Decompresses an object to pDst, which must hold get_size() bytes.
+    bool read(handle h, void *pDst, size_t dst_len);
+    // Returns a copy of an object's current zlib stream, which the caller must free(), or NULL if h isn't valid.
+    void *get_compressed(handle h, size_t *pLen);
+
+    // Waits until the recompression queue is empty and no object is being recompressed.
+    void wait_idle();
+
+    struct stats
+    {
+      size_t m_num_objects, m_queued;
+      uint64 m_object_bytes, m_stored_bytes;
+      // Objects whose slow stream replaced the fast one, that didn't gain enough, and that the policy left alone.
+      uint64 m_num_recompressed, m_num_rejected, m_num_skipped;
+      uint64 m_bytes_saved, m_cpu_usecs;
+      bool m_paused;
+    };
+    stats get_stats();
+
+  private:
+    struct state;
+    state *m_pState;
+
+    tiered_store(const tiered_store &);
+    tiered_store &operator= (const tiered_store &);
+  };
+
+  // Runs compression jobs from any number of threads on a pool of worker threads, by priority class, so bulk jobs can't hold up latency critical ones.
+  // Latency class jobs always go first. num_reserved of the workers only take latency class jobs, so one is normally free to start a latency job at once.
+  // The others also take bulk jobs, which they feed to the compressor slice_size bytes at a time. At each slice boundary a bulk job yields its worker if a
+  // latency job is waiting and no reserved worker is free: the job goes back to the front of the bulk queue with its compressor, and continues on the next
+  // worker that picks it up. Slicing doesn't change the output, which is the same stream compress_mem_to_output_stream() would write. While latency jobs
+  // run and the workers outnumber the cores, bulk jobs also pause at slice boundaries, so the OS doesn't share a core between them.
+  // Queueing delay (time spent in the queue, in total for bulk jobs that yielded) is recorded per class in a log2 histogram.
+  // Requires C++11.
+  class compression_scheduler
+  {
+  public:
+    enum { CLASS_LATENCY = 0, CLASS_BULK, NUM_CLASSES };
+    enum { DEFAULT_SLICE_SIZE = 16 * 1024, DELAY_HISTOGRAM_BUCKETS = 32 };
+    struct job;
+
+    compression_scheduler();
+    ~compression_scheduler();
+
+    // Starts num_workers threads, num_reserved of them for latency class jobs only (at least one worker is left for bulk jobs).
+    bool init(uint num_workers = 4, uint num_reserved = 1, uint slice_size = DEFAULT_SLICE_SIZE);
+    // Lets running jobs finish and stops the workers. Jobs still queued fail; they still have to be waited on, which can be done after deinit().
+    void deinit();
+
+    // Queues a job that compresses src_len bytes at pSrc to pOut. The source must stay valid, and pOut unused, until wait() returns. Returns NULL on failure.
+    job *submit(uint qos_class, const void *pSrc, size_t src_len, output_stream *pOut, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+    // Waits for a job to finish and frees it. Returns false if it failed.
+    bool wait(job *pJob);
+    // submit() then wait(), except that latency class jobs run on the calling thread: it would only block until a worker ran the job, and on a loaded
+    // machine handing the job over and back can cost a scheduler time slice each way. They still count as running latency jobs for the bulk jobs.
+    bool compress(uint qos_class, const void *pSrc, size_t src_len, output_stream *pOut, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+    struct class_stats
+    {
+      uint64 m_num_jobs, m_num_failed, m_num_preemptions, m_total_delay_usecs, m_max_delay_usecs;
+      // Bucket i counts finished jobs that were queued for less than 2^i microseconds (and at least 2^(i-1)).
+      uint64 m_delay_histogram[DELAY_HISTOGRAM_BUCKETS];
+      size_t m_queued;
+    };
+    class_stats get_stats(uint qos_class);
+    // Upper bound of the given percentile (0-100) of a class's queueing delay, from its histogram.
+    uint64 get_delay_percentile_usecs(uint qos_class, uint percentile);
+
+  private:
+    struct state;
+    state *m_pState;
+
+    compression_scheduler(const compression_scheduler &);
+    compression_scheduler &operator= (const compression_scheduler &);
+  };
+
+#ifdef __linux__
+// NULL picks tinydeflate.sock in $XDG_RUNTIME_DIR, or else in /tmp/tinydeflate-<uid>, a directory only the user can access. Don't point this into a
+// directory other users can write to: they could bind the path first.
+#ifndef TDEFL_OFFLOAD_SOCKET_PATH
+#define TDEFL_OFFLOAD_SOCKET_PATH NULL
+#endif
+  // Compression offload to a local daemon (offload_server), so short lived processes that each compress a little data don't each pay for allocating and
+  // warming up a compressor. The client shares a memfd with the daemon over a UNIX socket: input is written to its first half, the daemon compresses it
+  // with a pooled compressor straight into the second half, and only small request and reply messages go over the socket. One request is in flight at a time.
+  // Without a daemon (or once it goes away), or when a request can't be served (input too large, dictionary not preloaded, output too large), the client
+  // compresses in process instead, with the same results. Only a daemon running as the same user is used. Linux only. Requires C++11.
+  class offload_client
+  {
+  public:
+    enum { DEFAULT_SHARED_SIZE = 4 * 1024 * 1024, DEFAULT_TIMEOUT_MS = 2000 };
+
+    offload_client();
+    ~offload_client();
+
+    // Connects to the daemon (pSocket_path="" to compress in process only). Returns true if the client is usable, daemon or not (see is_connected()).
+    // If the daemon doesn't answer a request within timeout_ms, the client disconnects and compresses in process from then on.
+    bool init(const char *pSocket_path = TDEFL_OFFLOAD_SOCKET_PATH, size_t shared_size = DEFAULT_SHARED_SIZE, uint timeout_ms = DEFAULT_TIMEOUT_MS);
+    void deinit();
+    inline bool is_connected() const { return m_fd >= 0; }
+
+    // Preset dictionary for the following requests (NULL to clear). The daemon must have preloaded the same dictionary (it's identified by its Adler-32),
+    // or requests using it are compressed in process.
+    bool set_dictionary(const void *pDict, uint dict_len);
+
+    // Input buffer, in shared memory when connected: write up to get_max_input_size() bytes here and call compress_shared() to compress them without copies.
+    inline uint8 *get_input_buf() { return m_pShared; }
+    inline size_t get_max_input_size() const { return m_shared_size / 2U; }
+    // Returns the compressed stream, valid until the next call, or NULL on failure.
+    const uint8 *compress_shared(size_t len, size_t *pOut_len, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+    // Copies the input into shared memory and the output out of it. Input too large for the shared buffer is compressed in process.
+    bool compress(const void *pSrc, size_t src_len, output_stream *pOut, int flags = DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER);
+
+    inline uint64 get_num_offloaded() const { return m_num_offloaded; }
+    inline uint64 get_num_local() const { return m_num_local; }
+
+  private:
+    int m_fd;
+    uint8 *m_pShared;
+    size_t m_shared_size;
+    bool m_shared_mapped;
+    uint8 *m_pDict;
+    uint m_dict_len;
+    uint32 m_dict_id;
+    compressor *m_pComp;
+    expandable_malloc_output_stream m_local_out;
+    uint64 m_num_offloaded, m_num_local;
+
+    bool connect_to_daemon(const char *pSocket_path, uint timeout_ms);
+    void disconnect();
+    bool compress_local(const uint8 *pSrc, size_t src_len, output_stream *pOut, int flags);
+    offload_client(const offload_client &);
+    offload_client &operator= (const offload_client &);
+  };
+
+  // The daemon side of offload_client. Each client is served on its own thread, with compressors from a pool shared by all of them.
+  // Linux only. Requires C++11.
+  class offload_server
+  {
+  public:
+    offload_server();
+    ~offload_server();
+
+    // Preloads a dictionary clients can ask for. Call before start().
+    bool add_dictionary(const void *pDict, uint dict_len);
+
+    // Listens on pSocket_path, replacing a stale socket the same user left there (anything else makes start() fail). Only clients running as the same
+    // user are served. Up to max_pooled_compressors idle compressors are kept for reuse.
+    bool start(const char *pSocket_path = TDEFL_OFFLOAD_SOCKET_PATH, uint max_pooled_compressors = 8);
+    // The path listened on, or NULL when stopped.
+    const char *get_socket_path() const;
+    // Disconnects all clients (they carry on in process) and removes the socket file.
+    void stop();
+
+    struct stats { uint64 m_num_clients, m_num_requests, m_num_failed, m_bytes_in, m_bytes_out; };
+    stats get_stats();
+
+  private:
+    struct state;
+    state *m_pState;
+    struct dictionary { uint32 m_id; uint m_len; uint8 *m_pData; };
+    dictionary *m_pDicts;
+    uint m_num_dicts;
+
+    offload_server(const offload_server &);
+    offload_server &operator= (const offload_server &);
+  };
+#endif // __linux__
+#endif // TDEFL_CPP11
+
+#if TDEFL_CPP20
+  // Compile-time compression (C++20): constexpr auto blob = tinydeflate::compress<"...">(); puts a zlib stream of the string (without its terminator)
+  // in blob.data()/blob.size(), with nothing left to do at run time. It's a separate, much simpler encoder than the compressor's: one fixed Huffman block,
+  // greedy parsing over hash chains of up to MaxProbes candidates. Compilers cap constant evaluation (see -fconstexpr-ops-limit, -fconstexpr-steps), and
+  // this gets slow past a few KB: precompress bigger assets with the asset packer (TINYDEFLATE_PACKER_MAIN), which also compresses much better.
+  template <size_t N> struct ct_string
+  {
+    char m_data[N];
+    constexpr ct_string(const char (&str)[N]) { for (size_t i = 0; i < N; i++) m_data[i] = str[i]; }
+  };
+
+  template <size_t N> struct ct_blob
+  {
+    uint8 m_data[N];
+    constexpr const uint8 *data() const { return m_data; }
+    constexpr size_t size() const { return N; }
+  };
+
+  // Worst case ct_compress() output size: 9 bits per byte (no match costs more than its bytes as 9-bit literals), plus the 2 byte zlib header,
+  // 3 bit block header, 7 bit end of block code, padding to a byte and 4 byte Adler-32.
+  constexpr size_t ct_compress_bound(size_t src_len) { return src_len + (src_len + 7U) / 8U + 9U; }
+
+  namespace ct_detail
+  {
+    enum { HASH_BITS = 12, HASH_SIZE = 1 << HASH_BITS, WINDOW_SIZE = 32768, MIN_MATCH = 3, MAX_MATCH = 258 };
+    inline constexpr uint16 s_len_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+    inline constexpr uint8 s_len_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+    inline constexpr uint16 s_dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+    inline constexpr uint8 s_dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+    struct bit_writer
+    {
+      uint8 *m_pDst; size_t m_dst_capacity, m_dst_ofs; uint32 m_bit_buf; uint m_bits_in; bool m_overflow;
+
+      constexpr void put_byte(uint8 c) { if (m_dst_ofs < m_dst_capacity) m_pDst[m_dst_ofs++] = c; else m_overflow = true; }
+      constexpr void put_bits(uint32 bits, uint len)
+      {
+        m_bit_buf |= bits << m_bits_in; m_bits_in += len;
+        while (m_bits_in >= 8) { put_byte(static_cast<uint8>(m_bit_buf)); m_bit_buf >>= 8; m_bits_in -= 8; }
+      }
+      // Huffman codes go out MSB first.
+      constexpr void put_code(uint32 code, uint len) { uint32 r = 0; for (uint i = 0; i < len; i++, code >>= 1) r = (r << 1) | (code & 1); put_bits(r, len); }
+      constexpr void put_lit_len_sym(uint sym)
+      {
+        if (sym < 144) put_code(0x30 + sym, 8); else if (sym < 256) put_code(0x190 + sym - 144, 9);
+        else if (sym < 280) put_code(sym - 256, 7); else put_code(0xC0 + sym - 280, 8);
+      }
+    };
+
+    template <typename T> constexpr uint hash3(const T *p) { return ((static_cast<uint8>(p[0]) << 8) ^ (static_cast<uint8>(p[1]) << 4) ^ static_cast<uint8>(p[2])) & (HASH_SIZE - 1); }
+  }
+
+  // Compresses pSrc to a zlib stream in pDst at compile time (or at run time, though the compressor is far better there). Returns the stream's size,
+  // or 0 if dst_capacity is less than needed (ct_compress_bound(src_len) is always enough). Takes about 150KB of stack at run time.
+  template <typename T> constexpr size_t ct_compress(const T *pSrc, size_t src_len, uint8 *pDst, size_t dst_capacity, uint max_probes = 16)
+  {
+    using namespace ct_detail;
+    if (src_len >= 0xFFFFFFFFU) return 0;
+    // Chains link positions + 1, so 0 ends a chain.
+    uint32 hash[HASH_SIZE] = { }, next[WINDOW_SIZE] = { };
+    bit_writer w = { pDst, dst_capacity, 0, 0, 0, false };
+    w.put_byte(0x78); w.put_byte(0x01);
+    w.put_bits(1, 1); w.put_bits(1, 2);
+
+    uint32 s1 = 1, s2 = 0;
+    for (size_t ofs = 0; ofs < src_len; )
+    {
+      uint match_len = 0, match_dist = 0;
+      if (src_len - ofs >= MIN_MATCH)
+      {
+        const uint max_len = static_cast<uint>((src_len - ofs < MAX_MATCH) ? (src_len - ofs) : static_cast<size_t>(MAX_MATCH));
+        uint32 cand = hash[hash3(pSrc + ofs)];
+        for (uint probes = max_probes; (cand) && (probes) && (ofs - (cand - 1) <= WINDOW_SIZE); probes--)
+        {
+          const size_t cand_ofs = cand - 1;
+          uint len = 0;
+          while ((len < max_len) && (pSrc[cand_ofs + len] == pSrc[ofs + len])) len++;
+          if (len > match_len) { match_len = len; match_dist = static_cast<uint>(ofs - cand_ofs); if (len == max_len) break; }
+          // A slot overwritten by a newer position no longer belongs to this chain.
+          if ((cand = next[cand_ofs & (WINDOW_SIZE - 1)]) > cand_ofs) break;
+        }
+      }
+      if (match_len < MIN_MATCH) match_len = 1;
+
+      if (match_len == 1)
+        w.put_lit_len_sym(static_cast<uint8>(pSrc[ofs]));
+      else
+      {
+        uint i = 28; while (s_len_base[i] > match_len) i--;
+        w.put_lit_len_sym(257 + i); w.put_bits(match_len - s_len_base[i], s_len_extra[i]);
+        uint j = 29; while (s_dist_base[j] > match_dist) j--;
+        w.put_code(j, 5); w.put_bits(match_dist - s_dist_base[j], s_dist_extra[j]);
+      }
+
+      for (const size_t end_ofs = ofs + match_len; ofs < end_ofs; ofs++)
+      {
+        s1 = (s1 + static_cast<uint8>(pSrc[ofs])) % 65521U; s2 = (s2 + s1) % 65521U;
+        if (src_len - ofs >= MIN_MATCH)
+        {
+          const uint h = hash3(pSrc + ofs);
+          next[ofs & (WINDOW_SIZE - 1)] = hash[h]; hash[h] = static_cast<uint32>(ofs + 1);
+        }
+      }
+    }
+    w.put_lit_len_sym(256);
+    if (w.m_bits_in) w.put_bits(0, 8 - w.m_bits_in);
+
+    const uint32 adler32 = (s2 << 16) | s1;
+    for (int i = 24; i >= 0; i -= 8) w.put_byte(static_cast<uint8>(adler32 >> i));
+    return w.m_overflow ? 0 : w.m_dst_ofs;
+  }
+
+  namespace ct_detail
+  {
+    template <size_t N> struct buffer { uint8 m_data[N]; size_t m_size; };
+    template <size_t N, typename T> constexpr buffer<N> compress_to_buffer(const T *pSrc, size_t src_len, uint max_probes)
+    {
+      buffer<N> buf = { };
+      buf.m_size = ct_compress(pSrc, src_len, buf.m_data, N, max_probes);
+      return buf;
+    }
+  }
+
+  template <ct_string S, uint MaxProbes = 16> consteval auto compress()
+  {
+    constexpr size_t src_len = sizeof(S.m_data) - 1;
+    // Compressed into a worst case sized buffer, then copied into a blob of the exact size.
+    constexpr auto buf = ct_detail::compress_to_buffer<ct_compress_bound(src_len)>(S.m_data, src_len, MaxProbes);
+    static_assert(buf.m_size != 0, "tinydeflate::compress: output exceeded ct_compress_bound()");
+    ct_blob<buf.m_size> blob = { };
+    for (size_t i = 0; i < buf.m_size; i++) blob.m_data[i] = buf.m_data[i];
+    return blob;
+  }
+#endif // TDEFL_CPP20
+
+#if TDEFL_TRACING
+  // Timeline tracing (TDEFL_TRACING=1), to see where the threads of the parallel and pipelined helpers sit idle or wait on each other. Every thread records
+  // spans into its own buffer, without locking. While not recording, a trace point costs a call and a relaxed atomic load.
+  // Spans nest: a compress span contains the block flushes and output writes made during it.
+  enum trace_span_type { TRACE_COMPRESS, TRACE_DICTIONARY, TRACE_FLUSH_BLOCK, TRACE_OUTPUT_WRITE, TRACE_CHECKSUM, TRACE_WAIT, TRACE_TOTAL_SPAN_TYPES };
+
+  // Starts recording, discarding the previous trace. Each thread keeps its first max_spans_per_thread spans and counts the rest as dropped.
+  void trace_start(uint max_spans_per_thread = 65536);
+  void trace_stop();
+  // Labels the calling thread's track. The library's own threads are already named.
+  void trace_set_thread_name(const char *pName);
+  // Writes the trace as Chrome trace JSON, which Perfetto (ui.perfetto.dev) and chrome://tracing open. Call once the traced work is done and trace_stop()
+  // has returned: spans that end while it's running may be missing.
+  bool trace_write_chrome_json(output_stream *pOut);
+
+  // Records the time from its construction to its destruction, for tracing your own code alongside the library's.
+  class trace_span
+  {
+  public:
+    explicit trace_span(trace_span_type type);
+    ~trace_span();
+
+  private:
+    uint64 m_start_ticks; // 0 when not recording
+    trace_span_type m_type;
+
+    trace_span(const trace_span &);
+    trace_span &operator= (const trace_span &);
+  };
+#endif // TDEFL_TRACING
+
+} // tinydeflate
+
+#endif // TINYDEFLATE_HEADER_INCLUDED
+
+// -------------------  End of header file
+// If you only want the header file, define TINYDEFLATE_HEADER_FILE_ONLY then include this file (tinydeflate.cpp).
+
+#ifndef TINYDEFLATE_HEADER_FILE_ONLY
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/mman.h>
+#endif
+#if TDEFL_CPP11
+#include <atomic>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdio.h>
+#endif
+#if TDEFL_TRACING
+#include <stdio.h>
+#endif
+#endif
+#define TDEFL_ASSERT(x) assert(x)
+
+// The core tinydeflate::compressor class doesn't use the heap at all, but the optional high-level helper functions do.
+#define TDEFL_MALLOC(x) malloc(x)
+#define TDEFL_FREE(x) free(x)
+#define TDEFL_REALLOC(p, x) realloc(p, x)
+#define TDEFL_NEW new
+#define TDEFL_DELETE delete
+
+#define TDEFL_MAX(a,b) (((a)>(b))?(a):(b))
+#define TDEFL_MIN(a,b) (((a)<(b))?(a):(b))
+
+#if TDEFL_TRACING
+#define TDEFL_TRACE_SPAN(name, type) trace_span name(type)
+#define TDEFL_TRACE_THREAD_NAME(pName) trace_set_thread_name(pName)
+#else
+#define TDEFL_TRACE_SPAN(name, type)
+#define TDEFL_TRACE_THREAD_NAME(pName)
+#endif
+
+namespace tinydeflate
+{
+  // Purposely making these tables static for faster init and thread safety.
+  static const uint16 s_len_sym[256] = {
+    257,258,259,260,261,262,263,264,265,265,266,266,267,267,268,268,269,269,269,269,270,270,270,270,271,271,271,271,272,272,272,272,
+    273,273,273,273,273,273,273,273,274,274,274,274,274,274,274,274,275,275,275,275,275,275,275,275,276,276,276,276,276,276,276,276,
+    277,277,277,277,277,277,277,277,277,277,277,277,277,277,277,277,278,278,278,278,278,278,278,278,278,278,278,278,278,278,278,278,
+    279,279,279,279,279,279,279,279,279,279,279,279,279,279,279,279,280,280,280,280,280,280,280,280,280,280,280,280,280,280,280,280,
+    281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,281,
+    282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,282,
+    283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,283,
+    284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,284,285 };
+
+  static const uint8 s_len_extra[256] = {
+    0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+    4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,0 };
+
+  static const uint8 s_small_dist_sym[512] = {
+    0,1,2,3,4,4,5,5,6,6,6,6,7,7,7,7,8,8,8,8,8,8,8,8,9,9,9,9,9,9,9,9,10,10,10,10,10,10,10,10,10,10,10,10,10,10,10,10,11,11,11,11,11,11,
+    11,11,11,11,11,11,11,11,11,11,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,13,
+    13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,14,14,14,14,14,14,14,14,14,14,14,14,
+    14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,
+    14,14,14,14,14,14,14,14,14,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,
+    15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,15,16,16,16,16,16,16,16,16,16,16,16,16,16,
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,
+    16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,16,17,17,17,17,17,17,17,17,17,17,17,17,17,17,
+    17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,
+    17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,
+    17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17,17 };
+
+  static const uint8 s_small_dist_extra[512] = {
+    0,0,0,0,1,1,1,1,2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,5,5,5,5,5,5,5,5,
+    5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+    6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,
+    6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,6,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+    7,7,7,7,7,7,7,7 };
+
+  static const uint8 s_large_dist_sym[128] = {
+    0,0,18,19,20,20,21,21,22,22,22,22,23,23,23,23,24,24,24,24,24,24,24,24,25,25,25,25,25,25,25,25,26,26,26,26,26,26,26,26,26,26,26,26,
+    26,26,26,26,27,27,27,27,27,27,27,27,27,27,27,27,27,27,27,27,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,28,
+    28,28,28,28,28,28,28,28,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29,29 };
+
+  static const uint8 s_large_dist_extra[128] = {
+    0,0,8,8,9,9,9,9,10,10,10,10,10,10,10,10,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,11,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,
+    12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,12,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,
+    13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13,13 };
+
+  static const uint8 s_packed_code_size_syms_swizzle[] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+  
+  template <class T> inline void clear_obj(T &obj) { memset(&obj, 0, sizeof(obj)); }
+
+  uint32 adler32(const uint8 *ptr, size_t buf_len, uint32 adler32)
+  {
+    uint32 i, s1 = adler32 & 0xffff, s2 = adler32 >> 16; size_t block_len = buf_len % 5552;
+    while (buf_len) {
+      for (i = 0; i + 7 < block_len; i += 8, ptr += 8) {
+        s1 += ptr[0], s2 += s1; s1 += ptr[1], s2 += s1; s1 += ptr[2], s2 += s1; s1 += ptr[3], s2 += s1; 
+        s1 += ptr[4], s2 += s1; s1 += ptr[5], s2 += s1; s1 += ptr[6], s2 += s1; s1 += ptr[7], s2 += s1; 
+      }
+      for ( ; i < block_len; ++i) s1 += *ptr++, s2 += s1;
+      s1 %= 65521U, s2 %= 65521U; buf_len -= block_len; block_len = 5552;
+    }
+    return (s2 << 16) + s1;
+  }
+
+  uint32 adler32_combine(uint32 adler1, uint32 adler2, size_t len2)
+  {
+    const uint32 base = 65521U; uint32 rem = static_cast<uint32>(len2 % base);
+    uint32 s1 = adler1 & 0xffff, s2 = (rem * s1) % base;
+    s1 += (adler2 & 0xffff) + base - 1; s2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+    if (s1 >= base) s1 -= base;
+    if (s1 >= base) s1 -= base;
+    if (s2 >= (base << 1)) s2 -= (base << 1);
+    if (s2 >= base) s2 -= base;
+    return (s2 << 16) | s1;
+  }
+
+  uint32 crc32(const uint8 *ptr, size_t buf_len, uint32 crc)
+  {
+    static const uint32 s_crc32[16] = { 0, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+    crc = ~crc; while (buf_len--) { uint8 b = *ptr++; crc = (crc >> 4) ^ s_crc32[(crc & 0xF) ^ (b & 0xF)]; crc = (crc >> 4) ^ s_crc32[(crc & 0xF) ^ (b >> 4)]; } return ~crc;
+  }
+
+  // No file name or time stamp, OS unknown.
+  bool write_gzip_header(output_stream *pStream)
+  {
+    return (pStream) && (pStream->put_buf("\x1F\x8B\x08\0\0\0\0\0\0\xFF", 10));
+  }
+
+  bool write_gzip_trailer(output_stream *pStream, uint32 crc, uint64 size)
+  {
+    uint8 trailer[8]; for (uint i = 0; i < 4; i++) { trailer[i] = static_cast<uint8>(crc >> (i * 8)); trailer[4 + i] = static_cast<uint8>(size >> (i * 8)); }
+    return (pStream) && (pStream->put_buf(trailer, 8));
+  }
+  
+  static inline uint64 rotl64(uint64 x, int r) { return (x << r) | (x >> (64 - r)); }
+  static inline uint64 murmur3_fmix64(uint64 k) { k ^= k >> 33; k *= 0xff51afd7ed558ccdULL; k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL; k ^= k >> 33; return k; }
+
+  void murmur3_128(const void *pBuf, size_t buf_len, uint32 seed, uint64 *pHash128)
+  {
+    const uint8 *p = static_cast<const uint8*>(pBuf); const size_t num_blocks = buf_len / 16;
+    const uint64 c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL; uint64 h1 = seed, h2 = seed;
+    for (size_t i = 0; i < num_blocks; i++, p += 16)
+    {
+      uint64 k1, k2; memcpy(&k1, p, 8); memcpy(&k2, p + 8, 8);
+      k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1; h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+      k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2; h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    // The tail's bytes are loaded little endian, the first 8 into k1 and the rest into k2.
+    const uint tail_len = static_cast<uint>(buf_len & 15); uint64 k1 = 0, k2 = 0;
+    for (uint i = tail_len; i > 8; i--) k2 = (k2 << 8) | p[i - 1];
+    for (uint i = TDEFL_MIN(tail_len, 8U); i; i--) k1 = (k1 << 8) | p[i - 1];
+    if (tail_len > 8) { k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2; }
+    if (tail_len) { k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1; }
+    h1 ^= buf_len; h2 ^= buf_len; h1 += h2; h2 += h1;
+    h1 = murmur3_fmix64(h1); h2 = murmur3_fmix64(h2); h1 += h2; h2 += h1;
+    pHash128[0] = h1; pHash128[1] = h2;
+  }
+
+  // Radix sorts sym_freq[] array by 16-bit key m_key. Returns ptr to sorted values.
+  struct sym_freq { uint16 m_key, m_sym_index; };
+  static inline sym_freq* radix_sort_syms(uint num_syms, sym_freq* pSyms0, sym_freq* pSyms1)
+  {
+    const uint cMaxPasses = 2; uint32 hist[256 * cMaxPasses]; clear_obj(hist);
+    for (uint i = 0; i < num_syms; i++) { uint freq = pSyms0[i].m_key; hist[freq & 0xFF]++; hist[256 + ((freq >> 8) & 0xFF)]++; }
+    sym_freq* pCur_syms = pSyms0, *pNew_syms = pSyms1;
+    uint total_passes = cMaxPasses; while ((total_passes > 1) && (num_syms == hist[(total_passes - 1) * 256])) total_passes--;
+    for (uint pass_shift = 0, pass = 0; pass < total_passes; pass++, pass_shift += 8)
+    {
+      const uint32* pHist = &hist[pass << 8];
+      uint offsets[256], cur_ofs = 0;
+      for (uint i = 0; i < 256; i++) { offsets[i] = cur_ofs; cur_ofs += pHist[i]; }
+      for (uint i = 0; i < num_syms; i++) pNew_syms[offsets[(pCur_syms[i].m_key >> pass_shift) & 0xFF]++] = pCur_syms[i];
+      sym_freq* t = pCur_syms; pCur_syms = pNew_syms; pNew_syms = t;
+    }
+    return pCur_syms;
+  }
+
+  // calculate_minimum_redundancy() originally written by: Alistair Moffat, alistair@cs.mu.oz.au, Jyrki Katajainen, jyrki@diku.dk, November 1996.
+  static void calculate_minimum_redundancy(sym_freq *A, int n)
+  {
+    int root, leaf, next, avbl, used, dpth;
+    if (n==0) return; else if (n==1) { A[0].m_key = 1; return; }
+    A[0].m_key += A[1].m_key; root = 0; leaf = 2;
+    for (next=1; next < n-1; next++)
+    {
+      if (leaf>=n || A[root].m_key<A[leaf].m_key) { A[next].m_key = A[root].m_key; A[root++].m_key = (uint16)next; } else A[next].m_key = A[leaf++].m_key;
+      if (leaf>=n || (root<next && A[root].m_key<A[leaf].m_key)) { A[next].m_key = (uint16)(A[next].m_key + A[root].m_key); A[root++].m_key = (uint16)next; } else A[next].m_key = (uint16)(A[next].m_key + A[leaf++].m_key);
+    }
+    A[n-2].m_key = 0; for (next=n-3; next>=0; next--) A[next].m_key = A[A[next].m_key].m_key+1;
+    avbl = 1; used = dpth = 0; root = n-2; next = n-1;
+    while (avbl>0)
+    {
+      while (root>=0 && (int)A[root].m_key==dpth) { used++; root--; }
+      while (avbl>used) { A[next--].m_key = (uint16)(dpth); avbl--; }
+      avbl = 2*used; dpth++; used = 0;
+    }
+  }
+
+  // Limits canonical Huffman code table's max code size.
+  enum { MAX_SUPPORTED_HUFF_CODESIZE = 32 };
+  static void huffman_enforce_max_code_size(int *pNum_codes, int code_list_len, int max_code_size)
+  {
+    if (code_list_len <= 1) return;
+    for (int i = max_code_size + 1; i <= MAX_SUPPORTED_HUFF_CODESIZE; i++) pNum_codes[max_code_size] += pNum_codes[i];
+    uint32 total = 0; for (int i = max_code_size; i > 0; i--) total += (((uint32)pNum_codes[i]) << (max_code_size - i));
+    while (total != (1UL << max_code_size))
+    {
+      pNum_codes[max_code_size]--; 
+      for (int i = max_code_size - 1; i > 0; i--) if (pNum_codes[i]) { pNum_codes[i]--; pNum_codes[i + 1] += 2; break; } 
+      total--;
+    }
+  }
+
+  // With static_table set, the code sizes already in m_huff_code_sizes are kept and only the codes are built.
+  void compressor::optimize_huffman_table(int table_num, int table_len, int code_size_limit, bool static_table)
+  {
+    int num_codes[1 + MAX_SUPPORTED_HUFF_CODESIZE]; clear_obj(num_codes);
+    if (static_table)
+    {
+      for (int i = 0; i < table_len; i++) num_codes[m_huff_code_sizes[table_num][i]]++;
+    }
+    else
+    {
+      sym_freq syms0[MAX_HUFF_SYMBOLS], syms1[MAX_HUFF_SYMBOLS];
+    
+      int num_used_syms = 0;
+      const uint16 *pSym_count = &m_huff_count[table_num][0];
+      for (int i = 0; i < table_len; i++) if (pSym_count[i]) { syms0[num_used_syms].m_key = (uint16)pSym_count[i]; syms0[num_used_syms++].m_sym_index = (uint16)i; }
+      
+      sym_freq* pSyms = radix_sort_syms(num_used_syms, syms0, syms1); calculate_minimum_redundancy(pSyms, num_used_syms);
+
+      for (int i = 0; i < num_used_syms; i++) num_codes[pSyms[i].m_key]++;
+
+      huffman_enforce_max_code_size(num_codes, num_used_syms, code_size_limit);
+
+      clear_obj(m_huff_code_sizes[table_num]); clear_obj(m_huff_codes[table_num]); 
+      for (int i = 1, j = num_used_syms; i <= code_size_limit; i++) 
+        for (int l = num_codes[i]; l > 0; l--) m_huff_code_sizes[table_num][pSyms[--j].m_sym_index] = static_cast<uint8>(i);
+    }
+
+    uint next_code[MAX_SUPPORTED_HUFF_CODESIZE + 1]; next_code[1] = 0;
+    for (int j = 0, i = 2; i <= code_size_limit; i++) next_code[i] = j = ((j + num_codes[i - 1]) << 1);
+
+    for (int i = 0; i < table_len; i++)
+    {
+      uint code_size; if ((code_size = m_huff_code_sizes[table_num][i]) == 0) continue;
+      uint rev_code = 0, code = next_code[code_size]++;
+      for (int l = code_size; l > 0; l--, code >>= 1) rev_code = (rev_code << 1) | (code & 1);
+      m_huff_codes[table_num][i] = static_cast<uint16>(rev_code);
+    }
+  }
+  
+  inline void compressor::flush_output_buffer()
+  {
+    if ((m_all_writes_succeeded) && (m_pOutput_buf > m_output_buf))
+    {
+      TDEFL_TRACE_SPAN(write_span, TRACE_OUTPUT_WRITE);
+      m_all_writes_succeeded = m_pStream->put_buf(m_output_buf, static_cast<int>(m_pOutput_buf - m_output_buf));
+    }
+    m_total_out += m_pOutput_buf - m_output_buf; m_pOutput_buf = m_output_buf;
+  }
+
+#define TDEFL_PUT_BITS(b, l) do { uint bits = b; uint len = l; TDEFL_ASSERT(bits <= ((1U << len) - 1U)); m_bit_buffer |= (bits << m_bits_in); m_bits_in += len; \
+  while (m_bits_in >= 8) { *m_pOutput_buf++ = static_cast<uint8>(m_bit_buffer); if (m_pOutput_buf == &m_output_buf[OUT_BUF_SIZE]) flush_output_buffer(); m_bit_buffer >>= 8; m_bits_in -= 8; } } while (0)
+  
+#define TDEFL_RLE_PREV_CODE_SIZE() { if (rle_repeat_count) { \
+    if (rle_repeat_count < 3) { \
+      m_huff_count[2][prev_code_size] = (uint16)(m_huff_count[2][prev_code_size] + rle_repeat_count); \
+      while (rle_repeat_count--) packed_code_sizes[num_packed_code_sizes++] = prev_code_size; \
+    } else { \
+      m_huff_count[2][16] = (uint16)(m_huff_count[2][16] + 1); packed_code_sizes[num_packed_code_sizes++] = 16; packed_code_sizes[num_packed_code_sizes++] = (uint8)(rle_repeat_count - 3); \
+  } rle_repeat_count = 0; } }
+
+#define TDEFL_RLE_ZERO_CODE_SIZE() { if (rle_z_count) { \
+    if (rle_z_count < 3) { \
+      m_huff_count[2][0] = (uint16)(m_huff_count[2][0] + rle_z_count); while (rle_z_count--) packed_code_sizes[num_packed_code_sizes++] = 0; \
+    } else if (rle_z_count <= 10) { \
+      m_huff_count[2][17] = (uint16)(m_huff_count[2][17] + 1); packed_code_sizes[num_packed_code_sizes++] = 17; packed_code_sizes[num_packed_code_sizes++] = (uint8)(rle_z_count - 3); \
+    } else { \
+      m_huff_count[2][18] = (uint16)(m_huff_count[2][18] + 1); packed_code_sizes[num_packed_code_sizes++] = 18; packed_code_sizes[num_packed_code_sizes++] = (uint8)(rle_z_count - 11); \
+  } rle_z_count = 0; } }
+  
+  // Builds the literal/length and distance tables from m_huff_count, then run length codes their code sizes for the block header and builds the code length table.
+  // Returns the number of entries written to pPacked_code_sizes (code length symbols, each of 16-18 followed by its repeat count).
+  uint compressor::pack_code_sizes(uint8 *pPacked_code_sizes, int &num_lit_codes, int &num_dist_codes, int &num_bit_lengths)
+  {
+    optimize_huffman_table(0, MAX_HUFF_SYMBOLS_0, 15); optimize_huffman_table(1, MAX_HUFF_SYMBOLS_1, 15);
+    
+    for (num_lit_codes = 286; num_lit_codes > 257; num_lit_codes--) if (m_huff_code_sizes[0][num_lit_codes - 1]) break;
+    for (num_dist_codes = 30; num_dist_codes > 1; num_dist_codes--) if (m_huff_code_sizes[1][num_dist_codes - 1]) break;
+
+    uint8 code_sizes_to_pack[MAX_HUFF_SYMBOLS_0 + MAX_HUFF_SYMBOLS_1], *packed_code_sizes = pPacked_code_sizes, prev_code_size = 0xFF;
+    memcpy(code_sizes_to_pack, &m_huff_code_sizes[0][0], num_lit_codes);
+    memcpy(code_sizes_to_pack + num_lit_codes, &m_huff_code_sizes[1][0], num_dist_codes);
+    uint total_code_sizes_to_pack = num_lit_codes + num_dist_codes, num_packed_code_sizes = 0, rle_z_count = 0, rle_repeat_count = 0;
+
+    memset(&m_huff_count[2][0], 0, sizeof(m_huff_count[2][0]) * MAX_HUFF_SYMBOLS_2);
+    for (uint i = 0; i < total_code_sizes_to_pack; i++)
+    {
+      uint8 code_size = code_sizes_to_pack[i];
+      if (!code_size)
+      {
         TDEFL_RLE_PREV_CODE_SIZE();
         if (++rle_z_count == 138) { TDEFL_RLE_ZERO_CODE_SIZE(); }
       }
-      else
+      else
+      {
+        TDEFL_RLE_ZERO_CODE_SIZE();
+        if (code_size != prev_code_size)
+        {
+          TDEFL_RLE_PREV_CODE_SIZE();
+          m_huff_count[2][code_size] = (uint16)(m_huff_count[2][code_size] + 1); packed_code_sizes[num_packed_code_sizes++] = code_size;
+        }
+        else if (++rle_repeat_count == 6)
+        {
+          TDEFL_RLE_PREV_CODE_SIZE();
+        }
+      }
+      prev_code_size = code_size;
+    }
+    if (rle_repeat_count) { TDEFL_RLE_PREV_CODE_SIZE(); } else { TDEFL_RLE_ZERO_CODE_SIZE(); }
+
+    optimize_huffman_table(2, MAX_HUFF_SYMBOLS_2, 7);
+
+    for (num_bit_lengths = 18; num_bit_lengths >= 0; num_bit_lengths--) if (m_huff_code_sizes[2][s_packed_code_size_syms_swizzle[num_bit_lengths]]) break;
+    num_bit_lengths = TDEFL_MAX(4, (num_bit_lengths + 1));
+    return num_packed_code_sizes;
+  }
+
+  void compressor::start_dynamic_block(bool last_block)
+  {
+    uint8 packed_code_sizes[MAX_HUFF_SYMBOLS_0 + MAX_HUFF_SYMBOLS_1]; int num_lit_codes, num_dist_codes, num_bit_lengths;
+    uint num_packed_code_sizes = pack_code_sizes(packed_code_sizes, num_lit_codes, num_dist_codes, num_bit_lengths);
+            
+    TDEFL_PUT_BITS(last_block, 1); TDEFL_PUT_BITS(2, 2); TDEFL_PUT_BITS(num_lit_codes - 257, 5); TDEFL_PUT_BITS(num_dist_codes - 1, 5);
+    TDEFL_PUT_BITS(num_bit_lengths - 4, 4);
+    for (int i = 0; i < num_bit_lengths; i++) TDEFL_PUT_BITS(m_huff_code_sizes[2][s_packed_code_size_syms_swizzle[i]], 3);
+
+    for (uint packed_code_sizes_index = 0; packed_code_sizes_index < num_packed_code_sizes; )
+    {
+      uint code = packed_code_sizes[packed_code_sizes_index++]; TDEFL_ASSERT(code < MAX_HUFF_SYMBOLS_2);
+      TDEFL_PUT_BITS(m_huff_codes[2][code], m_huff_code_sizes[2][code]);
+      if (code >= 16) TDEFL_PUT_BITS(packed_code_sizes[packed_code_sizes_index++], "\02\03\07"[code - 16]);
+    }
+  }
+
+  // Fixed code sizes of the literal/length symbols, from the deflate spec.
+  static inline uint fixed_lit_code_size(uint sym) { return (sym < 144) ? 8 : ((sym < 256) ? 9 : ((sym < 280) ? 7 : 8)); }
+
+  void compressor::start_static_block(bool last_block)
+  {
+    for (uint i = 0; i < MAX_HUFF_SYMBOLS_0; i++) m_huff_code_sizes[0][i] = static_cast<uint8>(fixed_lit_code_size(i));
+    memset(m_huff_code_sizes[1], 5, MAX_HUFF_SYMBOLS_1);
+    optimize_huffman_table(0, MAX_HUFF_SYMBOLS_0, 15, true); optimize_huffman_table(1, MAX_HUFF_SYMBOLS_1, 15, true);
+    TDEFL_PUT_BITS(last_block, 1); TDEFL_PUT_BITS(1, 2);
+  }
+
+  void compressor::flush_block(bool last_block, bool static_block)
+  {
+    TDEFL_TRACE_SPAN(span, TRACE_FLUSH_BLOCK);
+    if (m_parse_only) { write_tokens(); return; }
+    *m_pLZ_flags = static_cast<uint8>(*m_pLZ_flags >> m_num_flags_left); m_pLZ_code_buf -= (m_num_flags_left == 8);
+
+    memset(&m_huff_count[0][0], 0, sizeof(m_huff_count[0][0]) * MAX_HUFF_SYMBOLS_0); memset(&m_huff_count[1][0], 0, sizeof(m_huff_count[1][0]) * MAX_HUFF_SYMBOLS_1);
+    for (uint pass = 0; pass < 2; pass++)
+    {
+      uint flags = 1; 
+      for (uint8 *pLZ_codes = m_lz_code_buf; pLZ_codes < m_pLZ_code_buf; flags >>= 1)
+      {
+        if (flags == 1) flags = *pLZ_codes++ | 0x100;
+        if (flags & 1)
+        {
+          uint match_len = pLZ_codes[0], match_dist = (pLZ_codes[1] | (pLZ_codes[2] << 8)); pLZ_codes += 3;
+          if (!pass)
+          {
+            m_huff_count[0][s_len_sym[match_len]]++;
+            if (match_dist < 512)
+              m_huff_count[1][s_small_dist_sym[match_dist]]++;
+            else
+              m_huff_count[1][s_large_dist_sym[match_dist >> 8]]++;
+          }
+          else
+          {
+            TDEFL_PUT_BITS(m_huff_codes[0][s_len_sym[match_len]], m_huff_code_sizes[0][s_len_sym[match_len]]); TDEFL_PUT_BITS(match_len & ((1 << s_len_extra[match_len]) - 1), s_len_extra[match_len]);
+            uint sym, num_extra_bits;
+            if (match_dist < 512)
+            {
+              sym = s_small_dist_sym[match_dist]; num_extra_bits = s_small_dist_extra[match_dist];
+            }
+            else
+            {
+              sym = s_large_dist_sym[match_dist >> 8]; num_extra_bits = s_large_dist_extra[match_dist >> 8];
+            }
+            TDEFL_PUT_BITS(m_huff_codes[1][sym], m_huff_code_sizes[1][sym]); TDEFL_PUT_BITS(match_dist & ((1 << num_extra_bits) - 1), num_extra_bits);
+          }
+        }
+        else
+        {
+          uint lit = *pLZ_codes++;
+          if (!pass)
+            m_huff_count[0][lit]++;
+          else
+            TDEFL_PUT_BITS(m_huff_codes[0][lit], m_huff_code_sizes[0][lit]);
+        }
+      }
+            
+      if (!pass)
+      {
+        m_huff_count[0][256]++;
+        if (static_block) start_static_block(last_block); else start_dynamic_block(last_block);
+      }
+      else
+        TDEFL_PUT_BITS(m_huff_codes[0][256], m_huff_code_sizes[0][256]);
+    }
+    
+    if ((last_block) && (m_bits_in & 7)) { TDEFL_PUT_BITS(0, 8 - m_bits_in); }
+
+    m_pLZ_code_buf = m_lz_code_buf + 1; m_pLZ_flags = m_lz_code_buf; m_num_flags_left = 8;
+    m_max_probes = m_block_max_probes; m_work_left = WORK_BUDGET_SLACK;
+  }
+
+  // Parse only: writes the pending LZ codes to the token stream instead of coding a block.
+  void compressor::write_tokens()
+  {
+    *m_pLZ_flags = static_cast<uint8>(*m_pLZ_flags >> m_num_flags_left); m_pLZ_code_buf -= (m_num_flags_left == 8);
+    lz_token tokens[256]; uint num_tokens = 0, flags = 1;
+    for (uint8 *pLZ_codes = m_lz_code_buf; pLZ_codes < m_pLZ_code_buf; flags >>= 1)
+    {
+      if (flags == 1) flags = *pLZ_codes++ | 0x100;
+      lz_token &t = tokens[num_tokens++];
+      if (flags & 1)
+      {
+        t.m_len_or_lit = static_cast<uint16>(pLZ_codes[0] + MIN_MATCH_LEN); t.m_dist = static_cast<uint16>((pLZ_codes[1] | (pLZ_codes[2] << 8)) + 1); pLZ_codes += 3;
+      }
+      else
+      {
+        t.m_len_or_lit = *pLZ_codes++; t.m_dist = 0;
+      }
+      if ((num_tokens == 256) || (pLZ_codes >= m_pLZ_code_buf))
+      {
+        if ((m_all_writes_succeeded) && (!m_pStream->put_buf(tokens, static_cast<int>(num_tokens * sizeof(lz_token))))) m_all_writes_succeeded = false;
+        num_tokens = 0;
+      }
+    }
+    m_pLZ_code_buf = m_lz_code_buf + 1; m_pLZ_flags = m_lz_code_buf; m_num_flags_left = 8;
+    m_max_probes = m_block_max_probes; m_work_left = WORK_BUDGET_SLACK;
+  }
+
+  // Returns the exact size in bits of a block holding the first num_codes pending LZ codes (or all of them, if there are fewer), coded with whichever of
+  // dynamic or fixed codes is smaller, and sets static_block if that's the fixed codes. On return num_codes is the number of codes counted, pCodes_end
+  // points just past them, and num_bytes is the number of input bytes they cover.
+  uint64 compressor::compute_block_bits(uint &num_codes, uint8 *&pCodes_end, size_t &num_bytes, bool &static_block)
+  {
+    memset(&m_huff_count[0][0], 0, sizeof(m_huff_count[0][0]) * MAX_HUFF_SYMBOLS_0); memset(&m_huff_count[1][0], 0, sizeof(m_huff_count[1][0]) * MAX_HUFF_SYMBOLS_1);
+    uint64 num_bits = 0; uint n = 0, flags = 1; num_bytes = 0;
+    // The current flag byte only holds its codes' flags in the top bits until flush_block() shifts it down.
+    uint8 *pLZ_codes = m_lz_code_buf, *pLZ_codes_end = m_pLZ_code_buf - (m_num_flags_left == 8);
+    for ( ; (n < num_codes) && (pLZ_codes < pLZ_codes_end); n++, flags >>= 1)
+    {
+      if (flags == 1) { flags = ((pLZ_codes == m_pLZ_flags) ? (*pLZ_codes >> m_num_flags_left) : *pLZ_codes) | 0x100; pLZ_codes++; }
+      if (flags & 1)
+      {
+        uint match_len = pLZ_codes[0], match_dist = (pLZ_codes[1] | (pLZ_codes[2] << 8)); pLZ_codes += 3;
+        m_huff_count[0][s_len_sym[match_len]]++; num_bits += s_len_extra[match_len]; num_bytes += match_len + MIN_MATCH_LEN;
+        if (match_dist < 512)
+        {
+          m_huff_count[1][s_small_dist_sym[match_dist]]++; num_bits += s_small_dist_extra[match_dist];
+        }
+        else
+        {
+          m_huff_count[1][s_large_dist_sym[match_dist >> 8]]++; num_bits += s_large_dist_extra[match_dist >> 8];
+        }
+      }
+      else
+      {
+        m_huff_count[0][*pLZ_codes++]++; num_bytes++;
+      }
+    }
+    num_codes = n; pCodes_end = pLZ_codes;
+    m_huff_count[0][256]++;
+
+    uint64 static_bits = num_bits + 1 + 2, dynamic_bits = num_bits + 1 + 2 + 5 + 5 + 4;
+    for (uint i = 0; i < MAX_HUFF_SYMBOLS_0; i++) static_bits += m_huff_count[0][i] * fixed_lit_code_size(i);
+    for (uint i = 0; i < MAX_HUFF_SYMBOLS_1; i++) static_bits += m_huff_count[1][i] * 5;
+
+    uint8 packed_code_sizes[MAX_HUFF_SYMBOLS_0 + MAX_HUFF_SYMBOLS_1]; int num_lit_codes, num_dist_codes, num_bit_lengths;
+    uint num_packed_code_sizes = pack_code_sizes(packed_code_sizes, num_lit_codes, num_dist_codes, num_bit_lengths);
+    dynamic_bits += 3 * num_bit_lengths;
+    for (uint i = 0; i < num_packed_code_sizes; i++)
+    {
+      uint code = packed_code_sizes[i]; dynamic_bits += m_huff_code_sizes[2][code];
+      if (code >= 16) { dynamic_bits += "\02\03\07"[code - 16]; i++; }
+    }
+    for (uint i = 0; i < MAX_HUFF_SYMBOLS_0; i++) dynamic_bits += m_huff_count[0][i] * m_huff_code_sizes[0][i];
+    for (uint i = 0; i < MAX_HUFF_SYMBOLS_1; i++) dynamic_bits += m_huff_count[1][i] * m_huff_code_sizes[1][i];
+    static_block = static_bits < dynamic_bits;
+    return TDEFL_MIN(static_bits, dynamic_bits);
+  }
+
+  // Writes the pending block if it fits within max_bits of output, leaving room for the empty final block (10 bits with fixed codes) that must follow it
+  // unless it's the last one. Otherwise the longest run of its codes that fits is written as the last block; the caller always leaves room for at least
+  // an empty one. Returns true if the whole block was written. num_bytes is increased by the number of input bytes written.
+  bool compressor::fit_block(uint64 max_bits, bool last_block, size_t &num_bytes)
+  {
+    *m_pLZ_flags = static_cast<uint8>(*m_pLZ_flags >> m_num_flags_left); m_pLZ_code_buf -= (m_num_flags_left == 8); m_num_flags_left = 0;
+    uint64 used_bits = (m_total_out + (m_pOutput_buf - m_output_buf)) * 8ULL + m_bits_in;
+    uint num_codes = 0xFFFFFFFF; uint8 *pCodes_end; size_t block_bytes; bool static_block;
+    if (used_bits + compute_block_bits(num_codes, pCodes_end, block_bytes, static_block) + (last_block ? 0 : 10) <= max_bits)
+    {
+      flush_block(last_block, static_block); num_bytes += block_bytes; return true;
+    }
+
+    // A prefix's size grows (almost always) with its length, so binary search for the longest one that fits.
+    uint lo = 0, hi = num_codes, best_num_codes = 0;
+    while (lo < hi)
+    {
+      uint mid = (lo + hi) >> 1, n = mid;
+      if (used_bits + compute_block_bits(n, pCodes_end, block_bytes, static_block) <= max_bits) { best_num_codes = mid; lo = mid + 1; } else hi = mid;
+    }
+    num_codes = best_num_codes; compute_block_bits(num_codes, pCodes_end, block_bytes, static_block);
+    m_pLZ_code_buf = pCodes_end; flush_block(true, static_block); num_bytes += block_bytes;
+    return false;
+  }
+
+  inline void compressor::record_literal(uint8 lit)
+  {
+    *m_pLZ_code_buf++ = lit;
+    *m_pLZ_flags = static_cast<uint8>(*m_pLZ_flags >> 1); if (--m_num_flags_left == 0) { m_num_flags_left = 8; m_pLZ_flags = m_pLZ_code_buf++; }
+    if (m_pLZ_code_buf > &m_lz_code_buf[LZ_CODE_BUF_SIZE - 4]) flush_block(false);
+  }
+
+  inline void compressor::record_match(uint match_len, uint match_dist)
+  {
+    TDEFL_ASSERT((match_len >= MIN_MATCH_LEN) && (match_dist >= 1) && (match_dist <= LZ_DICT_SIZE));
+    m_pLZ_code_buf[0] = static_cast<uint8>(match_len - MIN_MATCH_LEN); match_dist -= 1; m_pLZ_code_buf[1] = static_cast<uint8>(match_dist & 0xFF); m_pLZ_code_buf[2] = static_cast<uint8>(match_dist >> 8);
+    m_pLZ_code_buf += 3;
+    if (++match_dist != m_rep_dists[0]) { m_rep_dists[2] = m_rep_dists[1]; m_rep_dists[1] = m_rep_dists[0]; m_rep_dists[0] = match_dist; }
+    *m_pLZ_flags = static_cast<uint8>((*m_pLZ_flags >> 1) | 0x80); if (--m_num_flags_left == 0) { m_num_flags_left = 8; m_pLZ_flags = m_pLZ_code_buf++; }
+    if (m_pLZ_code_buf > &m_lz_code_buf[LZ_CODE_BUF_SIZE - 4]) flush_block(false);
+  }
+
+  inline void compressor::try_match_dist(uint pos, uint dist, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len)
+  {
+    if ((!dist) || (dist > max_dist)) return;
+    const uint8 *p = m_dict + pos, *q = m_dict + ((pos - dist) & LZ_DICT_SIZE_MASK);
+    if ((q[match_len] != p[match_len]) || (q[match_len - 1] != p[match_len - 1])) return;
+    uint len = 0; while ((len < max_match_len) && (p[len] == q[len])) len++;
+    if (len > match_len) { match_dist = dist; match_len = len; }
+  }
+
+  inline void compressor::find_match(uint pos, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len)
+  {
+    TDEFL_ASSERT(max_match_len <= MAX_MATCH_LEN); if ((max_match_len <= match_len) || (!m_max_probes)) return;
+    if ((!(m_flags & REPEAT_DIST_FLAG)) && (!m_num_stride_hints)) { find_chain_match(pos, max_dist, max_match_len, match_dist, match_len); return; }
+    // Cheap candidates first: the last distances used, the pending lazy match carried forward from the previous position, and the stride hints.
+    uint cand_dist = 0, cand_len = match_len;
+    for (uint i = 0; i < NUM_REP_DISTS; i++) try_match_dist(pos, m_rep_dists[i], max_dist, max_match_len, cand_dist, cand_len);
+    if (m_saved_match_len) try_match_dist(pos, m_saved_match_dist, max_dist, max_match_len, cand_dist, cand_len);
+    for (uint i = 0; i < m_num_stride_hints; i++) { try_match_dist(pos, m_stride_hints[i], max_dist, max_match_len, cand_dist, cand_len); try_match_dist(pos, m_stride_hints[i] * 2, max_dist, max_match_len, cand_dist, cand_len); }
+    if (!cand_dist) { find_chain_match(pos, max_dist, max_match_len, match_dist, match_len); return; }
+    if (cand_len == max_match_len) { match_dist = cand_dist; match_len = cand_len; return; }
+    // The chain only has to beat the candidate, but it may still find an equally long match nearer (cheaper to code), so search from one byte shorter.
+    match_len = cand_len - 1; find_chain_match(pos, max_dist, max_match_len, match_dist, match_len);
+    if ((match_len < cand_len) || ((match_len == cand_len) && (match_dist > cand_dist))) { match_dist = cand_dist; match_len = cand_len; }
+  }
+
+#if TDEFL_TAGGED_HASH_CHAINS
+  #define TDEFL_CHAIN_ENTRY(pos, tag) static_cast<chain_entry>((pos) | ((tag) << 16))
+  #define TDEFL_CHAIN_TAG_MATCHES(entry) (((entry) >> 16) == tag)
+#else
+  #define TDEFL_CHAIN_ENTRY(pos, tag) static_cast<chain_entry>(pos)
+  #define TDEFL_CHAIN_TAG_MATCHES(entry) true
+#endif
+  // Charges the chain steps and compared bytes of a search against the block's work budget.
+  #define TDEFL_CHAIN_RETURN { m_work_left -= static_cast<int>(m_max_probes - num_probes_left + num_compared); return; }
+
+  inline void compressor::find_chain_match(uint pos, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len)
+  {
+    uint probe_len, probe_pos = pos, prev_dist = 0, num_probes_left = m_max_probes, num_compared = 0, next_probe_pos, dist; chain_entry next_entry;
+    const uint8 *r = m_dict + pos;
+    uint8 c0 = m_dict[pos + match_len], c1 = m_dict[pos + match_len - 1];
+#if TDEFL_TAGGED_HASH_CHAINS
+    const uint tag = r[0] | (r[1] << 8);
+#endif
+    for ( ; ; )
+    {
+      for ( ; ; )
+      {
+        if (num_probes_left-- == 0) TDEFL_CHAIN_RETURN;
+        #define TDEFL_PROBE \
+          next_entry = m_next[probe_pos]; next_probe_pos = next_entry & 0xFFFF; if (static_cast<int16>(next_probe_pos) < 0) TDEFL_CHAIN_RETURN; \
+          dist = (pos - next_probe_pos) & LZ_DICT_SIZE_MASK; \
+          if ((dist > max_dist) || (dist <= prev_dist)) { m_next[probe_pos] = 0xFFFF; TDEFL_CHAIN_RETURN; } \
+          prev_dist = dist; probe_pos = next_probe_pos; \
+          if ((TDEFL_CHAIN_TAG_MATCHES(next_entry)) && (m_dict[probe_pos + match_len] == c0) && (m_dict[probe_pos + match_len - 1] == c1)) break;
+        TDEFL_PROBE; TDEFL_PROBE; TDEFL_PROBE;
+      }
+      const uint8 *p = r, *q = m_dict + probe_pos; for (probe_len = 0; probe_len < max_match_len; probe_len++) if (*p++ != *q++) break;
+      num_compared += probe_len;
+      if (probe_len > match_len)
+      {
+        match_dist = prev_dist; if ((match_len = probe_len) == max_match_len) TDEFL_CHAIN_RETURN;
+        c0 = m_dict[pos + match_len]; c1 = m_dict[pos + match_len - 1];
+      }
+    }
+  }
+
+  // Runs the LZ parser over data_len bytes. Pass pSrc=NULL to parse the remaining lookahead (the saved lazy match is left pending).
+  void compressor::compress_lz(const uint8 *pSrc, uint data_len)
+  {
+    while ((data_len) || ((!pSrc) && (m_lookahead_size)))
+    {
+      // Update dictionary and hash chains. Keeps the lookahead size equal to MAX_MATCH_LEN.
+      if (m_lookahead_size >= (MIN_MATCH_LEN - 1))
+      {
+        // Alternate dictionary update loop (avoids a load hit stores per iteration).
+        uint dst_pos = (m_lookahead_pos + m_lookahead_size) & LZ_DICT_SIZE_MASK;
+        uint ins_pos = (dst_pos - 2) & LZ_DICT_SIZE_MASK;
+        uint hash = (m_dict[ins_pos] << 4) ^ m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK];
+#if TDEFL_TAGGED_HASH_CHAINS
+        uint tag = m_dict[ins_pos] | (m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK] << 8);
+#endif
+        uint num_bytes_to_process = TDEFL_MIN(data_len, MAX_MATCH_LEN - m_lookahead_size);
+        const uint8 *pSrc_end = pSrc + num_bytes_to_process;
+        data_len -= num_bytes_to_process;  m_lookahead_size += num_bytes_to_process;
+        while (pSrc != pSrc_end)
+        {
+          uint8 c = *pSrc++; m_dict[dst_pos] = c; if (dst_pos < (MAX_MATCH_LEN - 1)) m_dict[LZ_DICT_SIZE + dst_pos] = c;
+          hash = ((hash << 4) ^ c) & (LZ_HASH_SIZE - 1);
+          m_next[ins_pos] = m_hash[hash]; m_hash[hash] = TDEFL_CHAIN_ENTRY(ins_pos, tag);
+#if TDEFL_TAGGED_HASH_CHAINS
+          tag = (tag >> 8) | (c << 8);
+#endif
+          dst_pos = (dst_pos + 1) & LZ_DICT_SIZE_MASK; ins_pos = (ins_pos + 1) & LZ_DICT_SIZE_MASK;
+        }
+      }
+      else
+      {
+        while ((data_len) && (m_lookahead_size < MAX_MATCH_LEN))
+        {
+          uint8 c = *pSrc++; data_len--;
+          uint dst_pos = (m_lookahead_pos + m_lookahead_size) & LZ_DICT_SIZE_MASK;
+          m_dict[dst_pos] = c; if (dst_pos < (MAX_MATCH_LEN - 1)) m_dict[LZ_DICT_SIZE + dst_pos] = c;
+          // Each position is hashed once the two bytes after it are in. The first new bytes after a preset dictionary (or a window kept from the last
+          // stream) complete the window's last two positions.
+          if ((++m_lookahead_size + m_dict_size) >= MIN_MATCH_LEN)
+          {
+            uint ins_pos = (dst_pos - 2) & LZ_DICT_SIZE_MASK;
+            uint hash = ((m_dict[ins_pos] << 8) ^ (m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK] << 4) ^ c) & (LZ_HASH_SIZE - 1);
+            m_next[ins_pos] = m_hash[hash]; m_hash[hash] = TDEFL_CHAIN_ENTRY(ins_pos, m_dict[ins_pos] | (m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK] << 8));
+          }
+        }
+      }          
+      m_dict_size = TDEFL_MIN(LZ_DICT_SIZE - m_lookahead_size, m_dict_size);
+      if ((pSrc) && (m_lookahead_size < MAX_MATCH_LEN)) break;
+      
+      // Simple lazy/greedy parsing state machine.
+      uint len_to_move = 1, cur_match_dist = 0, cur_match_len = m_saved_match_len ? m_saved_match_len : (MIN_MATCH_LEN - 1);
+      if (m_strategy == STRATEGY_LZ)
+      {
+        find_match(m_lookahead_pos, m_dict_size, m_lookahead_size, cur_match_dist, cur_match_len);
+        // Over the block's work budget: halve the probe depth for the rest of the block, and give the new depth a fresh allowance.
+        if ((m_work_left < 0) && (m_flags & WORK_LIMIT_FLAG) && (m_max_probes > 1)) { m_max_probes >>= 1; m_work_left = WORK_BUDGET_SLACK; }
+      }
+      else if (m_strategy == STRATEGY_RLE)
+        find_rle_match(m_lookahead_pos, m_dict_size, m_lookahead_size, cur_match_dist, cur_match_len);
+      if ((cur_match_len == MIN_MATCH_LEN) && (cur_match_dist >= 12U*1024U)) { cur_match_dist = cur_match_len = 0; } // reject really far small matches as not worth using
+      if (m_saved_match_len)
+      {
+        if (cur_match_len > m_saved_match_len)
+        {
+          record_literal((uint8)m_saved_lit);
+          if (cur_match_len >= 64)
+          {
+            record_match(cur_match_len, cur_match_dist);
+            m_saved_match_len = 0; len_to_move = cur_match_len;
+          }
+          else
+          {
+            m_saved_lit = m_dict[m_lookahead_pos]; m_saved_match_dist = cur_match_dist; m_saved_match_len = cur_match_len; len_to_move = 1;
+          }
+        }
+        else
+        {
+          record_match(m_saved_match_len, m_saved_match_dist);
+          len_to_move = m_saved_match_len - 1; m_saved_match_len = 0;
+        }
+      }
+      else if (!cur_match_dist)
+      {
+        record_literal(m_dict[m_lookahead_pos]);
+        // Greedy parsing only: after every 2^SKIP_TRIGGER_BITS consecutive misses, search one position further apart and emit the skipped bytes as literals.
+        // The skipped bytes are still in the hash chains (they were inserted as they entered the lookahead), so later matches can reference them.
+        if ((m_greedy_parsing) && ((len_to_move = TDEFL_MIN(1 + (++m_num_misses >> SKIP_TRIGGER_BITS), m_lookahead_size)) > 1))
+        {
+          for (uint i = 1; i < len_to_move; i++) record_literal(m_dict[m_lookahead_pos + i]);
+        }
+      }
+      else if ((m_greedy_parsing) || (cur_match_len >= 64))
+      {
+        record_match(cur_match_len, cur_match_dist);
+        len_to_move = cur_match_len; m_num_misses = 0;
+      }
+      else
+      {
+        m_saved_lit = m_dict[m_lookahead_pos]; m_saved_match_dist = cur_match_dist; m_saved_match_len = cur_match_len;
+      }
+      // Move the lookahead forward by len_to_move bytes.
+      m_work_left += static_cast<int>(len_to_move * WORK_BUDGET_PER_BYTE);
+      m_lookahead_pos = (m_lookahead_pos + len_to_move) & LZ_DICT_SIZE_MASK;
+      TDEFL_ASSERT(m_lookahead_size >= len_to_move); m_lookahead_size -= len_to_move;
+      m_dict_size = TDEFL_MIN(m_dict_size + len_to_move, m_max_dict_size);
+    }
+  }
+
+  // Parses the remaining lookahead and ends the current block, if it holds any codes.
+  void compressor::end_block()
+  {
+    compress_lz(NULL, 0);
+    if (m_saved_match_len) { record_match(m_saved_match_len, m_saved_match_dist); m_saved_match_len = 0; }
+    if ((m_pLZ_code_buf == m_lz_code_buf + 1) && (m_num_flags_left == 8)) return;
+    if (m_parse_only) { write_tokens(); return; }
+    // Blocks ended early by a flush are often short enough for the fixed codes to beat a dynamic block's header.
+    uint num_codes = 0xFFFFFFFF; uint8 *pCodes_end; size_t num_bytes; bool static_block;
+    compute_block_bits(num_codes, pCodes_end, num_bytes, static_block);
+    flush_block(false, static_block);
+  }
+
+  void compressor::put_stored_block_header(uint len)
+  {
+    TDEFL_PUT_BITS(0, 3); if (m_bits_in) { TDEFL_PUT_BITS(0, 8 - m_bits_in); }
+    TDEFL_PUT_BITS(len & 0xFFFF, 16); TDEFL_PUT_BITS(~len & 0xFFFF, 16);
+  }
+
+  // Ends the current block and writes data_len bytes as stored blocks, bypassing the dictionary.
+  void compressor::compress_stored(const uint8 *pSrc, uint data_len)
+  {
+    end_block();
+    while (data_len)
+    {
+      uint n = TDEFL_MIN(data_len, (uint)MAX_STORED_BLOCK_SIZE);
+      put_stored_block_header(n);
+      for (uint i = n; i; )
+      {
+        uint bytes_to_copy = TDEFL_MIN(i, static_cast<uint>(&m_output_buf[OUT_BUF_SIZE] - m_pOutput_buf));
+        memcpy(m_pOutput_buf, pSrc, bytes_to_copy); m_pOutput_buf += bytes_to_copy; pSrc += bytes_to_copy; i -= bytes_to_copy;
+        if (m_pOutput_buf == &m_output_buf[OUT_BUF_SIZE]) flush_output_buffer();
+      }
+      data_len -= n;
+    }
+    // The skipped bytes never entered the dictionary, so matches must not reach back past this point.
+    m_dict_size = 0;
+  }
+
+  uint64 get_ticks()
+  {
+#ifdef _WIN32
+    LARGE_INTEGER t; QueryPerformanceCounter(&t); return static_cast<uint64>(t.QuadPart);
+#else
+    timespec t; clock_gettime(CLOCK_MONOTONIC, &t); return static_cast<uint64>(t.tv_sec) * 1000000000ULL + static_cast<uint64>(t.tv_nsec);
+#endif
+  }
+
+  uint64 get_ticks_per_second()
+  {
+#ifdef _WIN32
+    LARGE_INTEGER f; QueryPerformanceFrequency(&f); return static_cast<uint64>(f.QuadPart);
+#else
+    return 1000000000ULL;
+#endif
+  }
+
+  void compressor::set_deadline(uint64 deadline_ticks, size_t expected_total_len)
+  {
+    // Degrading all the way to stored blocks would bypass the parser.
+    if (m_parse_only) return;
+    m_deadline_ticks = deadline_ticks; m_expected_total_len = expected_total_len;
+    m_start_ticks = m_level_start_ticks = get_ticks(); m_level_start_total_in = m_total_in;
+  }
+
+  void compressor::update_degrade_level()
+  {
+    if (m_degrade_level == DEGRADE_STORED) return;
+    uint64 now = get_ticks();
+    // Keep 1/8th of the budget in reserve for the final block flush and the stored tail.
+    uint64 budget = (m_deadline_ticks > m_start_ticks) ? (m_deadline_ticks - m_start_ticks) : 0, reserve = budget >> 3;
+    uint new_level = m_degrade_level;
+    if (now + reserve >= m_deadline_ticks)
+      new_level = DEGRADE_STORED;
+    else if (m_expected_total_len)
+    {
+      // Project the finish time from the speed measured since the last level change.
+      size_t bytes_done = m_total_in - m_level_start_total_in, bytes_left = (m_expected_total_len > m_total_in) ? (m_expected_total_len - m_total_in) : 0;
+      if (bytes_done >= DEADLINE_CHECK_INTERVAL * 4)
+      {
+        double projected = static_cast<double>(now - m_level_start_ticks) * static_cast<double>(bytes_left) / static_cast<double>(bytes_done);
+        // Stored blocks are nearly free, so the step to them is left to the reserve check above: Huffman only runs for as long as the deadline allows.
+        if ((projected > static_cast<double>(m_deadline_ticks - reserve - now)) && (new_level < DEGRADE_HUFFMAN_ONLY)) new_level++;
+      }
+    }
+    else
+    {
+      // Total size unknown: degrade one step per elapsed fraction of the budget.
+      static const uint s_level_thresholds[DEGRADE_STORED] = { 0, 4, 5, 6 };
+      uint elapsed_eighths = static_cast<uint>(((now - m_start_ticks) * 8) / TDEFL_MAX(budget, 1ULL));
+      while ((new_level < DEGRADE_STORED - 1) && (elapsed_eighths >= s_level_thresholds[new_level + 1])) new_level++;
+    }
+    if (new_level == m_degrade_level) return;
+    m_degrade_level = new_level; m_level_start_ticks = now; m_level_start_total_in = m_total_in;
+    if (new_level >= DEGRADE_GREEDY) m_greedy_parsing = true;
+    if (new_level >= DEGRADE_MIN_PROBES) m_block_max_probes = TDEFL_MIN(m_block_max_probes, 1U);
+    if (new_level >= DEGRADE_HUFFMAN_ONLY) m_block_max_probes = 0;
+    m_max_probes = TDEFL_MIN(m_max_probes, m_block_max_probes);
+  }
+
+  inline void compressor::find_rle_match(uint pos, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len)
+  {
+    TDEFL_ASSERT(max_match_len <= MAX_MATCH_LEN); if ((!max_dist) || (max_match_len <= match_len)) return;
+    const uint8 c = m_dict[(pos - 1) & LZ_DICT_SIZE_MASK], *p = m_dict + pos; uint run_len = 0;
+    while ((run_len < max_match_len) && (p[run_len] == c)) run_len++;
+    if (run_len > match_len) { match_dist = 1; match_len = run_len; }
+  }
+
+  // Picks a strategy for the region at pBuf from a few evenly spaced slices: order-0 entropy, the fraction of bytes repeating
+  // their predecessor, and the fraction of 4-byte groups already seen earlier in the slice (a cheap stand-in for match density).
+  uint compressor::classify_region(const uint8 *pBuf, uint len)
+  {
+    uint hist[256]; clear_obj(hist); uint32 seen[1024]; uint num_sampled = 0, num_runs = 0, num_matches = 0;
+    uint slice_size = TDEFL_MIN(len / REGION_SAMPLE_SLICES, (uint)REGION_SAMPLE_SLICE_SIZE);
+    for (uint slice = 0; slice < REGION_SAMPLE_SLICES; slice++)
+    {
+      const uint8 *p = pBuf + (len / REGION_SAMPLE_SLICES) * slice; memset(seen, 0xFF, sizeof(seen));
+      for (uint i = 0; i < slice_size; i++)
+      {
+        hist[p[i]]++; if ((i) && (p[i] == p[i - 1])) num_runs++;
+        if (i + 4 <= slice_size)
+        {
+          uint32 v = p[i] | (p[i + 1] << 8) | (p[i + 2] << 16) | ((uint32)p[i + 3] << 24), h = (v * 2654435761U) >> 22;
+          if (seen[h] == v) num_matches++; else seen[h] = v;
+        }
+      }
+      num_sampled += slice_size;
+    }
+    if (!num_sampled) return STRATEGY_LZ;
+    double entropy = 0.0;
+    for (uint i = 0; i < 256; i++) if (hist[i]) { double p = (double)hist[i] / num_sampled; entropy -= p * log(p); }
+    entropy *= 1.4426950408889634; // to bits per byte
+    if (num_runs * 2 >= num_sampled) return STRATEGY_RLE;
+    if (num_matches * 32 >= num_sampled) return STRATEGY_LZ;
+    return (entropy >= 7.5) ? STRATEGY_STORED : STRATEGY_HUFFMAN_ONLY;
+  }
+
+  // Ends the current block when switching strategies, so each block gets Huffman tables fitted to its own content.
+  void compressor::set_strategy(uint strategy)
+  {
+    if (strategy == m_strategy) return;
+    if ((m_pLZ_code_buf != m_lz_code_buf + 1) || (m_num_flags_left != 8)) flush_block(false);
+    m_strategy = strategy;
+  }
+
+  bool compressor::set_stride_hints(const uint *pStrides, uint num_strides)
+  {
+    if ((num_strides > MAX_STRIDE_HINTS) || ((num_strides) && (!pStrides))) return false;
+    m_num_stride_hints = 0;
+    for (uint i = 0; i < num_strides; i++) if ((pStrides[i]) && (pStrides[i] <= LZ_DICT_SIZE / 2)) m_stride_hints[m_num_stride_hints++] = pStrides[i];
+    return true;
+  }
+
+  bool compressor::init_parser(output_stream *pToken_stream, int flags)
+  {
+    if (!init(pToken_stream, flags & ~(WRITE_ZLIB_HEADER | AUTO_STRATEGY_FLAG))) return false;
+    m_parse_only = true;
+    return true;
+  }
+
+  bool compressor::encode_tokens(const lz_token *pTokens, size_t num_tokens, const void *pSrc, size_t src_len)
+  {
+    if ((!m_pStream) || (!m_all_writes_succeeded) || (m_parse_only) || ((num_tokens) && (!pTokens)) || ((src_len) && (!pSrc))) return false;
+    const uint8 *pSrc_bytes = static_cast<const uint8*>(pSrc);
+    size_t num_covered = 0;
+    for (size_t i = 0; i < num_tokens; i++)
+    {
+      uint len = pTokens[i].m_len_or_lit, dist = pTokens[i].m_dist;
+      if (!dist) { if ((len > 255) || (num_covered == src_len) || (pSrc_bytes[num_covered] != len)) return false; num_covered++; continue; }
+      if ((len < MIN_MATCH_LEN) || (len > MAX_MATCH_LEN) || (dist > m_max_dict_size) || (dist > m_total_in + num_covered) || (len > src_len - num_covered)) return false;
+      // Only the part of the copy that comes from within pSrc can be checked.
+      const size_t check_ofs = TDEFL_MAX(num_covered, static_cast<size_t>(dist));
+      if ((check_ofs < num_covered + len) && (memcmp(pSrc_bytes + check_ofs, pSrc_bytes + check_ofs - dist, num_covered + len - check_ofs))) return false;
+      num_covered += len;
+    }
+    if (num_covered != src_len) return false;
+    if (m_flags & WRITE_ZLIB_HEADER) m_adler32 = adler32(pSrc_bytes, src_len, m_adler32);
+    for (size_t i = 0; i < num_tokens; i++)
+    {
+      if (pTokens[i].m_dist) record_match(pTokens[i].m_len_or_lit, pTokens[i].m_dist); else record_literal(static_cast<uint8>(pTokens[i].m_len_or_lit));
+    }
+    m_total_in += src_len;
+    return m_all_writes_succeeded;
+  }
+
+  bool compressor::set_window_bits(uint window_bits)
+  {
+    if ((window_bits < 8) || (window_bits > 15)) return false;
+    m_max_dict_size = 1U << window_bits; m_dict_size = TDEFL_MIN(m_dict_size, m_max_dict_size);
+    return true;
+  }
+
+  bool compressor::flush(uint flush_type)
+  {
+    if ((!m_pStream) || (!m_all_writes_succeeded)) return false;
+    end_block(); if ((flush_type != BLOCK_FLUSH) && (!m_parse_only)) put_stored_block_header(0);
+    if (flush_type == FULL_FLUSH) m_dict_size = 0;
+    flush_output_buffer();
+    return m_all_writes_succeeded;
+  }
+
+  bool compressor::compress_data(const void *pData, uint data_len)
+  {
+    TDEFL_TRACE_SPAN(span, TRACE_COMPRESS);
+    if ((!m_pStream) || (!m_all_writes_succeeded)) return false;
+    const uint8 *pSrc = static_cast<const uint8*>(pData); if (m_flags & WRITE_ZLIB_HEADER) { m_adler32 = adler32(pSrc, data_len, m_adler32); }
+    while (data_len)
+    {
+      uint n = data_len;
+      if (m_deadline_ticks)
+      {
+        update_degrade_level();
+        if (m_degrade_level == DEGRADE_STORED) { compress_stored(pSrc, data_len); m_total_in += data_len; break; }
+        n = TDEFL_MIN(n, (uint)DEADLINE_CHECK_INTERVAL);
+      }
+      if (m_flags & AUTO_STRATEGY_FLAG)
+      {
+        // Small writes keep the current strategy: a tiny sample says little about the content.
+        if (!m_region_bytes_left) { if (data_len >= MIN_REGION_SAMPLE_SIZE) set_strategy(classify_region(pSrc, TDEFL_MIN(data_len, (uint)REGION_SIZE))); m_region_bytes_left = REGION_SIZE; }
+        n = TDEFL_MIN(n, m_region_bytes_left); m_region_bytes_left -= n;
+      }
+      if (m_strategy == STRATEGY_STORED) compress_stored(pSrc, n); else compress_lz(pSrc, n);
+      pSrc += n; data_len -= n; m_total_in += n;
+    }
+    if (!pData)
+    {
+      compress_lz(NULL, 0);
+      if (m_saved_match_len) record_match(m_saved_match_len, m_saved_match_dist);
+      flush_block(true);
+      if (m_flags & WRITE_ZLIB_HEADER) { for (uint i = 0; i < 4; i++) { TDEFL_PUT_BITS((m_adler32 >> 24) & 0xFF, 8); m_adler32 <<= 8; } }
+      flush_output_buffer(); m_pStream = NULL;
+    }
+    return m_all_writes_succeeded;
+  }
+
+  size_t compressor::compress_to_fit(const void *pData, size_t data_len, size_t max_out_len)
+  {
+    if ((!m_pStream) || (!m_all_writes_succeeded) || (m_parse_only)) return 0;
+    const uint8 *pSrc = static_cast<const uint8*>(pData); uint64 trailer_bits = (m_flags & WRITE_ZLIB_HEADER) ? 32 : 0;
+    uint64 used_bits = (m_total_out + (m_pOutput_buf - m_output_buf)) * 8ULL + m_bits_in;
+    // The header, an empty final block and the trailer must fit at the very least.
+    if (used_bits + 10 + trailer_bits > max_out_len * 8ULL) { m_all_writes_succeeded = false; return 0; }
+    uint64 max_bits = max_out_len * 8ULL - trailer_bits;
+    size_t num_fed = 0, num_written = 0;
+    while (num_fed < data_len)
+    {
+      uint num_codes = 0xFFFFFFFF; uint8 *pCodes_end; size_t pending_bytes; bool static_block;
+      used_bits = (m_total_out + (m_pOutput_buf - m_output_buf)) * 8ULL + m_bits_in;
+      uint64 total_bits = used_bits + compute_block_bits(num_codes, pCodes_end, pending_bytes, static_block) + 10;
+      if (total_bits > max_bits) break;
+      // A literal takes 9/8 bytes of the LZ code buffer and a match less per input byte, so this many input bytes (leaving room for the lookahead to drain)
+      // can't fill it up mid-chunk. Write the block when the buffer is close to full.
+      uint buf_left = static_cast<uint>(&m_lz_code_buf[LZ_CODE_BUF_SIZE - 4] - m_pLZ_code_buf), max_chunk_size = (buf_left * 8U) / 9U;
+      max_chunk_size = (max_chunk_size > 2U * MAX_MATCH_LEN) ? (max_chunk_size - 2U * MAX_MATCH_LEN) : 0;
+      if (max_chunk_size < MIN_FIT_CHUNK_SIZE) { if (!fit_block(max_bits, false, num_written)) break; continue; }
+      // Feed enough input to fill about half of the room left, at the ratio seen so far.
+      double bytes_per_bit = num_fed ? (static_cast<double>(num_fed) / static_cast<double>(total_bits)) : 0.125;
+      double chunk_size = static_cast<double>(max_bits - total_bits) * 0.5 * bytes_per_bit;
+      uint n = static_cast<uint>(TDEFL_MIN(TDEFL_MIN(static_cast<double>(data_len - num_fed), static_cast<double>(max_chunk_size)), TDEFL_MAX(chunk_size, static_cast<double>(MIN_FIT_CHUNK_SIZE))));
+      compress_lz(pSrc + num_fed, n); num_fed += n;
+    }
+    compress_lz(NULL, 0);
+    if (m_saved_match_len) { record_match(m_saved_match_len, m_saved_match_dist); m_saved_match_len = 0; }
+    fit_block(max_bits, true, num_written);
+    TDEFL_ASSERT(num_written <= data_len);
+    if (m_flags & WRITE_ZLIB_HEADER) { m_adler32 = adler32(pSrc, num_written, 1); for (uint i = 0; i < 4; i++) { TDEFL_PUT_BITS((m_adler32 >> 24) & 0xFF, 8); m_adler32 <<= 8; } }
+    flush_output_buffer(); m_pStream = NULL;
+    return num_written;
+  }
+
+  void *compressor::operator new(size_t size) TDEFL_NOTHROW
+  {
+#ifdef _WIN32
+    return _aligned_malloc(size, TDEFL_COMPRESSOR_ALIGNMENT);
+#else
+    void *p = NULL; if (posix_memalign(&p, TDEFL_COMPRESSOR_ALIGNMENT, size)) return NULL;
+#ifdef MADV_HUGEPAGE
+    if (TDEFL_COMPRESSOR_ALIGNMENT >= 2 * 1024 * 1024) madvise(p, size, MADV_HUGEPAGE);
+#endif
+    return p;
+#endif
+  }
+
+  void compressor::operator delete(void *p)
+  {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+
+  bool compressor::init(output_stream *pStream, int flags)
+  {
+    if (!pStream) return false;
+    if (!(flags & NONDETERMINISTIC_PARSING_FLAG)) memset(m_hash, 0xFF, sizeof(m_hash));
+    m_lookahead_pos = 0; m_dict_size = 0;
+    return start_stream(pStream, flags, false, 0);
+  }
+
+  bool compressor::set_dictionary(const void *pDict, uint dict_len)
+  {
+    TDEFL_TRACE_SPAN(span, TRACE_DICTIONARY);
+    const uint8 *pSrc = static_cast<const uint8*>(pDict);
+    if ((!m_pStream) || (!m_all_writes_succeeded) || (m_total_in) || (m_total_out) || (m_lookahead_size) || (m_dict_size) || ((dict_len) && (!pSrc))) return false;
+    if (m_flags & WRITE_ZLIB_HEADER)
+    {
+      // Replace the header init() wrote with one that has the FDICT bit and the dictionary's id.
+      if (m_pOutput_buf != m_output_buf + 2) return false;
+      m_pOutput_buf = m_output_buf; TDEFL_PUT_BITS(0x78, 8); TDEFL_PUT_BITS(0x20, 8);
+      uint32 dict_id = adler32(pSrc, dict_len, 1); for (uint i = 0; i < 4; i++) { TDEFL_PUT_BITS((dict_id >> 24) & 0xFF, 8); dict_id <<= 8; }
+    }
+    if (dict_len > LZ_DICT_SIZE) { pSrc += dict_len - LZ_DICT_SIZE; dict_len = LZ_DICT_SIZE; }
+    // Load the window as if the dictionary had been compressed, and hash every position that has the following two bytes in the dictionary too
+    // (compress_lz() hashes the last two once the first input bytes arrive).
+    for (uint i = 0; i < dict_len; i++)
+    {
+      uint pos = (m_lookahead_pos + i) & LZ_DICT_SIZE_MASK;
+      m_dict[pos] = pSrc[i]; if (pos < (MAX_MATCH_LEN - 1)) m_dict[LZ_DICT_SIZE + pos] = pSrc[i];
+    }
+    for (uint i = 0; i + MIN_MATCH_LEN <= dict_len; i++)
+    {
+      uint ins_pos = (m_lookahead_pos + i) & LZ_DICT_SIZE_MASK;
+      uint hash = ((m_dict[ins_pos] << 8) ^ (m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK] << 4) ^ m_dict[(ins_pos + 2) & LZ_DICT_SIZE_MASK]) & (LZ_HASH_SIZE - 1);
+      m_next[ins_pos] = m_hash[hash]; m_hash[hash] = TDEFL_CHAIN_ENTRY(ins_pos, m_dict[ins_pos] | (m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK] << 8));
+    }
+    m_lookahead_pos = (m_lookahead_pos + dict_len) & LZ_DICT_SIZE_MASK; m_dict_size = TDEFL_MIN(dict_len, m_max_dict_size);
+    return true;
+  }
+
+  bool compressor::reinit_with_dictionary(output_stream *pStream, int flags, uint dict_len, uint32 dict_id)
+  {
+    // The previous stream must be finished (so the lookahead is empty), and its window must still reach dict_len bytes back.
+    if ((!pStream) || (m_pStream) || (!m_all_writes_succeeded) || (m_parse_only) || (m_lookahead_size) || (dict_len > m_dict_size)) return false;
+    m_dict_size = dict_len;
+    return start_stream(pStream, flags, dict_len != 0, dict_id);
+  }
+
+  // Resets everything but the window and its hash chains, and writes the zlib header.
+  bool compressor::start_stream(output_stream *pStream, int flags, bool has_dict, uint32 dict_id)
+  {
+    m_pStream = pStream; m_flags = static_cast<uint>(flags); m_block_max_probes = m_max_probes = ((flags & 0xFFF) + 2) / 3; m_work_left = WORK_BUDGET_SLACK; m_greedy_parsing = (flags & GREEDY_PARSING_FLAG) != 0;
+    m_lookahead_size = 0; m_max_dict_size = LZ_DICT_SIZE; m_parse_only = false;
+    m_pLZ_code_buf = m_lz_code_buf + 1; m_pLZ_flags = m_lz_code_buf; m_num_flags_left = 8;
+    m_pOutput_buf = m_output_buf; m_bits_in = 0; m_bit_buffer = 0; m_all_writes_succeeded = true; m_total_out = 0;
+    m_saved_match_dist = 0, m_saved_match_len = 0, m_saved_lit = 0, m_num_misses = 0; m_adler32 = 1;
+    m_deadline_ticks = m_start_ticks = m_level_start_ticks = 0; m_expected_total_len = m_total_in = m_level_start_total_in = 0; m_degrade_level = DEGRADE_NONE;
+    m_strategy = STRATEGY_LZ; m_region_bytes_left = 0;
+    m_rep_dists[0] = m_rep_dists[1] = m_rep_dists[2] = 0; m_num_stride_hints = 0;
+    if (m_flags & WRITE_ZLIB_HEADER)
+    {
+      TDEFL_PUT_BITS(0x78, 8); TDEFL_PUT_BITS(has_dict ? 0x20 : 1, 8);
+      if (has_dict) { for (uint i = 0; i < 4; i++) { TDEFL_PUT_BITS((dict_id >> 24) & 0xFF, 8); dict_id <<= 8; } }
+    }
+    return m_all_writes_succeeded;
+  }
+
+  // ------------------- High-level helpers (only the below methods use the heap in any way).
+  void expandable_malloc_output_stream::init(size_t initial_capacity)
+  {
+    clear();
+    if (initial_capacity)
+    {
+      m_pBuf = TDEFL_MALLOC(initial_capacity);
+      m_capacity = m_pBuf ? initial_capacity : 0; 
+    }
+  }
+    
+  void expandable_malloc_output_stream::clear() 
+  { 
+    TDEFL_FREE(m_pBuf); m_pBuf = 0; m_size = m_capacity = 0; 
+  }
+
+  bool expandable_malloc_output_stream::put_buf(const void* pBuf, int len)
+  {
+    size_t new_size = m_size + len;
+    if (new_size > m_capacity)
+    {
+      size_t new_capacity = m_capacity; do { new_capacity = TDEFL_MAX(128U, new_capacity << 1U); } while (new_size > new_capacity);
+      void *pNew_buf = TDEFL_REALLOC(m_pBuf, new_capacity); if (!pNew_buf) return false;
+      m_pBuf = pNew_buf; m_capacity = new_capacity;
+    }
+    memcpy((uint8*)m_pBuf + m_size, pBuf, len); m_size = new_size;
+    return true;
+  }
+
+  int buffer_input_stream::get_buf(void *pBuf, int max_len)
+  {
+    size_t n = TDEFL_MIN(m_size - m_ofs, static_cast<size_t>(TDEFL_MAX(max_len, 0)));
+    memcpy(pBuf, static_cast<const uint8*>(m_pBuf) + m_ofs, n); m_ofs += n;
+    return static_cast<int>(n);
+  }
+
+  bool buffer_output_stream::put_buf(const void* pBuf, int len)
+  {
+    size_t new_size = m_size + len; if (new_size > m_capacity) return false;
+    memcpy((uint8*)m_pBuf + m_size, pBuf, len); m_size = new_size;
+    return true;
+  }
+
+  static bool compress_mem_to_output_stream_internal(const void *pBuf, size_t buf_len, output_stream *pStream, int flags, uint64 deadline_ticks)
+  {
+    if ((buf_len) && (!pBuf)) return false;
+    compressor *pComp = TDEFL_NEW compressor;
+    if (!pComp) return false;
+    bool succeeded = pComp->init(pStream, flags);
+    if (deadline_ticks) pComp->set_deadline(deadline_ticks, buf_len);
+    while (buf_len)
+    {
+      uint n = static_cast<uint>(TDEFL_MIN(16U * 1024U * 1024U, buf_len)); succeeded = succeeded && pComp->compress_data(pBuf, n); if (!succeeded) break;
+      pBuf = static_cast<const uint8*>(pBuf) + n; buf_len -= n;
+    }
+    succeeded = succeeded && pComp->compress_data(NULL, 0);
+    TDEFL_DELETE pComp; return succeeded;
+  }
+
+  bool compress_mem_to_output_stream(const void *pBuf, size_t buf_len, output_stream *pStream, int flags)
+  {
+    return compress_mem_to_output_stream_internal(pBuf, buf_len, pStream, flags, 0);
+  }
+   
+  void *compress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags)
+  {
+    if (!pOut_len) return NULL; else *pOut_len = 0;
+    expandable_malloc_output_stream out_stream(TDEFL_MAX(32U, src_buf_len >> 1U));
+    if (!compress_mem_to_output_stream(pSrc_buf, src_buf_len, &out_stream, flags)) return NULL;
+    *pOut_len = out_stream.get_size();
+    void *p = out_stream.assume_buf_ownership();
+    return p;
+  }
+
+  void *compress_mem_to_heap_with_deadline(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, uint time_budget_usecs, int flags)
+  {
+    uint64 deadline_ticks = get_ticks() + TDEFL_MAX(1ULL, (static_cast<uint64>(time_budget_usecs) * get_ticks_per_second()) / 1000000ULL);
+    if (!pOut_len) return NULL; else *pOut_len = 0;
+    expandable_malloc_output_stream out_stream(TDEFL_MAX(32U, src_buf_len >> 1U));
+    if (!compress_mem_to_output_stream_internal(pSrc_buf, src_buf_len, &out_stream, flags, deadline_ticks)) return NULL;
+    *pOut_len = out_stream.get_size();
+    return out_stream.assume_buf_ownership();
+  }
+
+  lz_token *parse_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pNum_tokens, int flags)
+  {
+    if (!pNum_tokens) return NULL; else *pNum_tokens = 0;
+    if ((src_buf_len) && (!pSrc_buf)) return NULL;
+    expandable_malloc_output_stream out_stream(TDEFL_MAX(64U, src_buf_len) * sizeof(lz_token) / 2U);
+    compressor *pComp = TDEFL_NEW compressor;
+    bool succeeded = (pComp) && (pComp->init_parser(&out_stream, flags));
+    const uint8 *pSrc = static_cast<const uint8*>(pSrc_buf);
+    while ((succeeded) && (src_buf_len))
+    {
+      uint n = static_cast<uint>(TDEFL_MIN(16U * 1024U * 1024U, src_buf_len)); succeeded = pComp->compress_data(pSrc, n);
+      pSrc += n; src_buf_len -= n;
+    }
+    succeeded = succeeded && pComp->compress_data(NULL, 0);
+    TDEFL_DELETE pComp;
+    if (!succeeded) return NULL;
+    *pNum_tokens = out_stream.get_size() / sizeof(lz_token);
+    return static_cast<lz_token*>(out_stream.assume_buf_ownership());
+  }
+
+  size_t compress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len, int flags)
+  {
+    buffer_output_stream out_stream(pOut_buf, out_buf_len);
+    if (!compress_mem_to_output_stream(pSrc_buf, src_buf_len, &out_stream, flags)) return 0;
+    return out_stream.get_size();
+  }
+  
+  size_t compress_mem_to_fit(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t *pSrc_buf_len, int flags)
+  {
+    if ((!pSrc_buf_len) || ((*pSrc_buf_len) && (!pSrc_buf))) return 0;
+    buffer_output_stream out_stream(pOut_buf, out_buf_len);
+    compressor *pComp = TDEFL_NEW compressor;
+    size_t num_consumed = 0; bool succeeded = (pComp) && (pComp->init(&out_stream, flags));
+    if (succeeded) { num_consumed = pComp->compress_to_fit(pSrc_buf, *pSrc_buf_len, out_buf_len); succeeded = pComp->get_all_writes_succeeded(); }
+    TDEFL_DELETE pComp;
+    if (!succeeded) return 0;
+    *pSrc_buf_len = num_consumed; return out_stream.get_size();
+  }
+
+  enum { IN_PLACE_CHUNK_SIZE = 256U * 1024U, IN_PLACE_STORED_BLOCK_SIZE = 65535U };
+
+  // Output side of compress_mem_in_place(): bytes go into the buffer up to the end of the input consumed so far, and the rest waits in the carry buffer.
+  struct in_place_writer
+  {
+    uint8 *m_pBuf, *m_pCarry; size_t m_ofs, m_limit, m_carry_size, m_carry_capacity;
+
+    void set_limit(size_t limit)
+    {
+      m_limit = limit; size_t n = TDEFL_MIN(m_carry_size, m_limit - m_ofs);
+      memcpy(m_pBuf + m_ofs, m_pCarry, n); m_ofs += n; m_carry_size -= n; memmove(m_pCarry, m_pCarry + n, m_carry_size);
+    }
+    bool put(const void *pData, size_t len)
+    {
+      const uint8 *p = static_cast<const uint8*>(pData);
+      if (!m_carry_size) { size_t n = TDEFL_MIN(len, m_limit - m_ofs); memcpy(m_pBuf + m_ofs, p, n); m_ofs += n; p += n; len -= n; }
+      if (m_carry_size + len > m_carry_capacity) return false;
+      memcpy(m_pCarry + m_carry_size, p, len); m_carry_size += len;
+      return true;
+    }
+  };
+
+  size_t compress_mem_in_place_bound(size_t buf_len)
+  {
+    // zlib header and trailer, and a stored block header per 64KB of input, per chunk (where a run of stored blocks is cut short), and for an empty final block.
+    return buf_len + 2 + 4 + 5 * (buf_len / IN_PLACE_STORED_BLOCK_SIZE + buf_len / IN_PLACE_CHUNK_SIZE + 3);
+  }
+
+  // The input is compressed a chunk at a time into a staging buffer, ending each chunk with a sync flush. Once a chunk is compressed it's in the
+  // compressor's dictionary, so its output can go over it. A chunk whose output would be larger than storing it is written as stored blocks instead:
+  // the sync flush left the compressor byte aligned after a whole block, and the decompressor ends up with the same window either way.
+  size_t compress_mem_in_place(void *pBuf, size_t buf_len, int flags)
+  {
+    if (!pBuf) return 0;
+    uint8 *pData = static_cast<uint8*>(pBuf), *pRaw = NULL;
+    size_t carry_capacity = compress_mem_in_place_bound(buf_len) - buf_len;
+    in_place_writer out = { pData, static_cast<uint8*>(TDEFL_MALLOC(carry_capacity)), 0, 0, 0, carry_capacity };
+    expandable_malloc_output_stream staging(IN_PLACE_CHUNK_SIZE + IN_PLACE_CHUNK_SIZE / 8);
+    compressor *pComp = TDEFL_NEW compressor;
+    bool succeeded = (pComp) && (out.m_pCarry) && (pComp->init(&staging, flags & ~WRITE_ZLIB_HEADER));
+    uint32 adler = 1;
+    if ((succeeded) && (flags & WRITE_ZLIB_HEADER)) { static const uint8 s_zlib_header[2] = { 0x78, 0x01 }; succeeded = out.put(s_zlib_header, 2); }
+    for (size_t ofs = 0; succeeded; )
+    {
+      uint len = static_cast<uint>(TDEFL_MIN(buf_len - ofs, static_cast<size_t>(IN_PLACE_CHUNK_SIZE))); bool last_chunk = (ofs + len == buf_len);
+      if (flags & WRITE_ZLIB_HEADER) adler = adler32(pData + ofs, len, adler);
+      staging.reset();
+      succeeded = (pComp->compress_data(pData + ofs, len)) && (last_chunk ? pComp->compress_data(NULL, 0) : pComp->flush(compressor::SYNC_FLUSH));
+      if (!succeeded) break;
+      uint num_stored_blocks = TDEFL_MAX(1U, (len + IN_PLACE_STORED_BLOCK_SIZE - 1) / IN_PLACE_STORED_BLOCK_SIZE);
+      if (staging.get_size() <= len + 5U * num_stored_blocks)
+      {
+        out.set_limit(ofs + len); succeeded = out.put(staging.get_buf(), staging.get_size());
+      }
+      else
+      {
+        // Copy the chunk aside before any output goes over it.
+        if ((!pRaw) && ((pRaw = static_cast<uint8*>(TDEFL_MALLOC(IN_PLACE_CHUNK_SIZE))) == NULL)) { succeeded = false; break; }
+        memcpy(pRaw, pData + ofs, len); out.set_limit(ofs + len);
+        for (uint i = 0; (succeeded) && (i < num_stored_blocks); i++)
+        {
+          uint n = TDEFL_MIN(len - i * IN_PLACE_STORED_BLOCK_SIZE, (uint)IN_PLACE_STORED_BLOCK_SIZE);
+          uint8 hdr[5] = { static_cast<uint8>((last_chunk) && (i == num_stored_blocks - 1)), static_cast<uint8>(n & 0xFF), static_cast<uint8>(n >> 8), static_cast<uint8>(~n & 0xFF), static_cast<uint8>((~n >> 8) & 0xFF) };
+          succeeded = (out.put(hdr, 5)) && (out.put(pRaw + i * IN_PLACE_STORED_BLOCK_SIZE, n));
+        }
+      }
+      ofs += len; if (last_chunk) break;
+    }
+    if ((succeeded) && (flags & WRITE_ZLIB_HEADER))
+    {
+      uint8 trailer[4] = { static_cast<uint8>(adler >> 24), static_cast<uint8>(adler >> 16), static_cast<uint8>(adler >> 8), static_cast<uint8>(adler) };
+      succeeded = out.put(trailer, 4);
+    }
+    // What's left of the carry goes into the room after the input.
+    if (succeeded) out.set_limit(buf_len + carry_capacity);
+    TDEFL_DELETE pComp; TDEFL_FREE(out.m_pCarry); TDEFL_FREE(pRaw);
+    return succeeded ? out.m_ofs : 0;
+  }
+
+  void *write_image_to_png_file_in_memory(const void *pImage, int w, int h, int num_chans, uint32 *pLen_out) 
+  {
+    *pLen_out = 0; const int bpl = w * num_chans; compressor *pComp = TDEFL_NEW compressor; expandable_malloc_output_stream out_stream(57+TDEFL_MAX(64U, (1+bpl)*h)); 
+    if (!pComp) return NULL;
+    // write dummy header
+    int z; for (z = 41; z; --z) out_stream.put_buf(&z, 1);
+    // compress image data
+    pComp->init(&out_stream, tinydeflate::DEFAULT_MAX_PROBES | tinydeflate::WRITE_ZLIB_HEADER);
+    for (int y = 0; y < h; ++y) { pComp->compress_data(&z, 1); pComp->compress_data((uint8*)pImage + y * bpl, bpl); }
+    pComp->compress_data(NULL, 0); if (!pComp->get_all_writes_succeeded()) { TDEFL_DELETE pComp; return NULL; }
+    // write real header
+    *pLen_out = (uint32)(out_stream.get_size()-41);
+    uint8 pnghdr[41]={0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,0x00,0x00,0x00,0x0d,0x49,0x48,0x44,0x52,
+      0,0,(uint8)(w>>8),(uint8)w,0,0,(uint8)(h>>8),(uint8)h,8,"\0\0\04\02\06"[num_chans],0,0,0,0,0,0,0,
+      (uint8)(*pLen_out>>24),(uint8)(*pLen_out>>16),(uint8)(*pLen_out>>8),(uint8)*pLen_out,0x49,0x44,0x41,0x54};
+    uint32 c=crc32(pnghdr+12,17); for (int i=0; i<4; ++i, c<<=8) ((uint8*)(pnghdr+29))[i]=(uint8)(c>>24);
+    memcpy(out_stream.get_buf(), pnghdr, 41); 
+    // write footer (IDAT CRC-32, followed by IEND chunk)
+    if (!out_stream.put_buf("\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", 16)) { *pLen_out = 0; TDEFL_DELETE pComp; return NULL; }
+    c = crc32(out_stream.get_buf()+41-4, *pLen_out+4); for (int i=0; i<4; ++i, c<<=8) (out_stream.get_buf()+out_stream.get_size()-16)[i] = (uint8)(c >> 24);
+    // compute final size of file, grab compressed data buffer and return
+    *pLen_out += 57; void *pBuf = out_stream.assume_buf_ownership(); TDEFL_DELETE pComp; return pBuf;
+  }
+
+  // ------------------- incremental_compressor
+  incremental_compressor::incremental_compressor() : m_pComp(NULL), m_flags(0), m_min_seg_size(0), m_max_seg_size(0), m_num_reused_segs(0), m_cur(0), m_boundary_mask(0), m_pSeg_index(NULL), m_seg_index_size(0)
+  {
+    for (uint i = 0; i < 256; i++) m_gear[i] = murmur3_fmix64(0x9E3779B97F4A7C15ULL * (i + 1));
+    for (uint i = 0; i < 2; i++) { m_pSegs[i] = NULL; m_num_segs[i] = m_seg_capacity[i] = 0; }
+  }
+
+  incremental_compressor::~incremental_compressor()
+  {
+    TDEFL_DELETE m_pComp; TDEFL_FREE(m_pSegs[0]); TDEFL_FREE(m_pSegs[1]); TDEFL_FREE(m_pSeg_index);
+  }
+
+  bool incremental_compressor::init(int flags, uint avg_segment_size)
+  {
+    if (!m_pComp) { m_pComp = TDEFL_NEW compressor; if (!m_pComp) return false; }
+    // Capped so the largest segment (4 times the average) still fits in a uint.
+    uint bits = 10; while ((bits < 28) && ((2U << bits) <= avg_segment_size)) bits++;
+    m_flags = flags; m_min_seg_size = (1U << bits) >> 2; m_max_seg_size = (1U << bits) << 2;
+    // The top bits of the gear hash depend on the last 64 bytes, the bottom ones on the last few only.
+    m_boundary_mask = ((1ULL << bits) - 1) << (64 - bits);
+    m_num_segs[0] = m_num_segs[1] = 0; m_num_reused_segs = 0; m_cur = 0; m_out[0].reset(); m_out[1].reset();
+    return true;
+  }
+
+  uint incremental_compressor::find_segment_len(const uint8 *pBuf, size_t buf_len) const
+  {
+    uint max_len = static_cast<uint>(TDEFL_MIN(buf_len, static_cast<size_t>(m_max_seg_size)));
+    if (max_len <= m_min_seg_size) return max_len;
+    uint64 h = 0;
+    for (uint i = m_min_seg_size - 64; i < m_min_seg_size; i++) h = (h << 1) + m_gear[pBuf[i]];
+    for (uint i = m_min_seg_size; i < max_len; i++) { h = (h << 1) + m_gear[pBuf[i]]; if (!(h & m_boundary_mask)) return i + 1; }
+    return max_len;
+  }
+
+  bool incremental_compressor::compress(const void *pBuf, size_t buf_len)
+  {
+    if ((!m_pComp) || ((buf_len) && (!pBuf))) return false;
+    const uint prev = m_cur, cur = m_cur ^ 1;
+    const segment *pPrev_segs = m_pSegs[prev]; const uint num_prev_segs = m_num_segs[prev];
+
+    // Index the previous segments by hash (open addressing, 0 = empty slot).
+    uint index_size = 16; while (index_size < num_prev_segs * 2) index_size <<= 1;
+    if (index_size > m_seg_index_size) { TDEFL_FREE(m_pSeg_index); m_pSeg_index = static_cast<uint*>(TDEFL_MALLOC(index_size * sizeof(uint))); m_seg_index_size = m_pSeg_index ? index_size : 0; if (!m_pSeg_index) return false; }
+    memset(m_pSeg_index, 0, index_size * sizeof(uint));
+    for (uint i = 0; i < num_prev_segs; i++) { uint h = static_cast<uint>(pPrev_segs[i].m_hash[0]) & (index_size - 1); while (m_pSeg_index[h]) h = (h + 1) & (index_size - 1); m_pSeg_index[h] = i + 1; }
+
+    expandable_malloc_output_stream &out = m_out[cur]; out.reset();
+    const uint8 *pSrc = static_cast<const uint8*>(pBuf); bool succeeded = true; uint32 adler = 1;
+    if (m_flags & WRITE_ZLIB_HEADER) succeeded = out.put_buf("\x78\x01", 2);
+    m_num_segs[cur] = 0; m_num_reused_segs = 0;
+    for (size_t ofs = 0; (ofs < buf_len) && (succeeded); )
+    {
+      if (m_num_segs[cur] == m_seg_capacity[cur])
+      {
+        uint new_capacity = TDEFL_MAX(16U, m_seg_capacity[cur] << 1U); void *p = TDEFL_REALLOC(m_pSegs[cur], new_capacity * sizeof(segment)); if (!p) return false;
+        m_pSegs[cur] = static_cast<segment*>(p); m_seg_capacity[cur] = new_capacity;
+      }
+      segment &seg = m_pSegs[cur][m_num_segs[cur]++];
+      seg.m_src_len = find_segment_len(pSrc + ofs, buf_len - ofs); murmur3_128(pSrc + ofs, seg.m_src_len, 0, seg.m_hash);
+      seg.m_comp_ofs = out.get_size();
+      const segment *pMatch = NULL;
+      for (uint h = static_cast<uint>(seg.m_hash[0]) & (index_size - 1); m_pSeg_index[h]; h = (h + 1) & (index_size - 1))
+      {
+        const segment &s = pPrev_segs[m_pSeg_index[h] - 1];
+        if ((s.m_hash[0] == seg.m_hash[0]) && (s.m_hash[1] == seg.m_hash[1]) && (s.m_src_len == seg.m_src_len)) { pMatch = &s; break; }
+      }
+      if (pMatch)
+      {
+        seg.m_adler32 = pMatch->m_adler32; seg.m_comp_len = pMatch->m_comp_len; m_num_reused_segs++;
+        succeeded = out.put_buf(m_out[prev].get_buf() + pMatch->m_comp_ofs, static_cast<int>(pMatch->m_comp_len));
+      }
+      else
+      {
+        { TDEFL_TRACE_SPAN(checksum_span, TRACE_CHECKSUM); seg.m_adler32 = adler32(pSrc + ofs, seg.m_src_len, 1); }
+        succeeded = m_pComp->init(&out, m_flags & ~WRITE_ZLIB_HEADER) && m_pComp->compress_data(pSrc + ofs, seg.m_src_len) && m_pComp->flush(compressor::FULL_FLUSH);
+        seg.m_comp_len = out.get_size() - seg.m_comp_ofs;
+      }
+      adler = adler32_combine(adler, seg.m_adler32, seg.m_src_len); ofs += seg.m_src_len;
+    }
+    // Every segment ends byte aligned on a non-final block: terminate the stream with an empty final static block.
+    succeeded = succeeded && out.put_buf("\x03\x00", 2);
+    if (m_flags & WRITE_ZLIB_HEADER) { uint8 trailer[4] = { static_cast<uint8>(adler >> 24), static_cast<uint8>(adler >> 16), static_cast<uint8>(adler >> 8), static_cast<uint8>(adler) }; succeeded = succeeded && out.put_buf(trailer, 4); }
+    if (!succeeded) { m_num_segs[cur] = 0; return false; }
+    m_cur = cur;
+    return true;
+  }
+
+  // ------------------- compression_task
+  compression_task::compression_task() : m_pComp(NULL), m_pSrc(NULL), m_src_len(0), m_src_ofs(0), m_total_in(0), m_last_input(false), m_status(STATUS_FAILED)
+  {
+  }
+
+  compression_task::~compression_task()
+  {
+    TDEFL_DELETE m_pComp;
+  }
+
+  bool compression_task::init(output_stream *pOut, int flags)
+  {
+    m_pSrc = NULL; m_src_len = m_src_ofs = 0; m_total_in = 0; m_last_input = false; m_status = STATUS_FAILED;
+    if ((!m_pComp) && ((m_pComp = TDEFL_NEW compressor) == NULL)) return false;
+    if (!m_pComp->init(pOut, flags)) return false;
+    m_status = STATUS_NEED_INPUT;
+    return true;
+  }
+
+  bool compression_task::set_input(const void *pSrc, size_t src_len, bool last_input)
+  {
+    if ((m_status != STATUS_NEED_INPUT) || ((src_len) && (!pSrc))) return false;
+    m_pSrc = static_cast<const uint8*>(pSrc); m_src_len = src_len; m_src_ofs = 0; m_last_input = last_input;
+    m_status = STATUS_IN_PROGRESS;
+    return true;
+  }
+
+  compression_task::status compression_task::step(uint max_usecs, size_t max_bytes)
+  {
+    if (m_status != STATUS_IN_PROGRESS) return m_status;
+    const uint64 deadline_ticks = max_usecs ? (get_ticks() + (static_cast<uint64>(max_usecs) * get_ticks_per_second()) / 1000000U) : 0;
+    const size_t end_ofs = ((max_bytes) && (max_bytes < m_src_len - m_src_ofs)) ? (m_src_ofs + max_bytes) : m_src_len;
+    while (m_src_ofs < end_ofs)
+    {
+      uint n = static_cast<uint>(TDEFL_MIN(end_ofs - m_src_ofs, static_cast<size_t>(STEP_GRANULE)));
+      if (!m_pComp->compress_data(m_pSrc + m_src_ofs, n)) return m_status = STATUS_FAILED;
+      m_src_ofs += n; m_total_in += n;
+      if ((deadline_ticks) && (m_src_ofs < m_src_len) && (get_ticks() >= deadline_ticks)) return m_status;
+    }
+    if (m_src_ofs < m_src_len) return m_status;
+    // Finishing only flushes the last block, which is bounded like any other block flush.
+    if (!m_last_input) return m_status = STATUS_NEED_INPUT;
+    return m_status = (m_pComp->compress_data(NULL, 0) ? STATUS_DONE : STATUS_FAILED);
+  }
+
+  // ------------------- permessage_deflate_encoder
+  permessage_deflate_encoder::permessage_deflate_encoder() : m_pComp(NULL), m_payload_size(0), m_no_context_takeover(false)
+  {
+  }
+
+  permessage_deflate_encoder::~permessage_deflate_encoder()
+  {
+    TDEFL_DELETE m_pComp;
+  }
+
+  bool permessage_deflate_encoder::init(int flags, uint max_window_bits, bool no_context_takeover)
+  {
+    if (flags & WRITE_ZLIB_HEADER) return false;
+    if (!m_pComp) { m_pComp = TDEFL_NEW compressor; if (!m_pComp) return false; }
+    m_out.reset(); m_payload_size = 0; m_no_context_takeover = no_context_takeover;
+    return m_pComp->init(&m_out, flags) && m_pComp->set_window_bits(max_window_bits);
+  }
+
+  bool permessage_deflate_encoder::compress_message(const void *pMsg, size_t msg_len)
+  {
+    m_out.reset(); m_payload_size = 0;
+    if ((!m_pComp) || ((msg_len) && (!pMsg))) return false;
+    const uint8 *pSrc = static_cast<const uint8*>(pMsg);
+    while (msg_len)
+    {
+      uint n = static_cast<uint>(TDEFL_MIN(16U * 1024U * 1024U, msg_len)); if (!m_pComp->compress_data(pSrc, n)) return false;
+      pSrc += n; msg_len -= n;
+    }
+    if (!m_pComp->flush(m_no_context_takeover ? compressor::FULL_FLUSH : compressor::SYNC_FLUSH)) return false;
+    // The flush's empty stored block always ends the output with its LEN and NLEN fields.
+    TDEFL_ASSERT((m_out.get_size() >= 4) && (!memcmp(m_out.get_buf() + m_out.get_size() - 4, "\0\0\xFF\xFF", 4)));
+    m_payload_size = m_out.get_size() - 4;
+    return true;
+  }
+
+  // ------------------- decompressor
+  static const uint16 s_length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+  static const uint8 s_length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+  static const uint16 s_dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+  static const uint8 s_dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+  // Refills the input buffer, keeping its last few bytes so end_body() can give back what the bit buffer read past the end of the deflate data.
+  void decompressor::refill()
+  {
+    if (m_in_eof) return;
+    uint keep = TDEFL_MIN(m_in_size, (uint)IN_BUF_KEEP); uint64 keep_pos = m_in_base + m_in_size - keep;
+    if ((m_pBody_copy) && (m_copy_pos < keep_pos))
+    {
+      if (!m_pBody_copy->put_buf(m_in_buf + (m_copy_pos - m_in_base), static_cast<int>(keep_pos - m_copy_pos))) m_succeeded = false;
+      m_copy_pos = keep_pos;
+    }
+    memmove(m_in_buf, m_in_buf + m_in_size - keep, keep); m_in_base = keep_pos; m_in_ofs -= m_in_size - keep; m_in_size = keep;
+    int n = m_pIn->get_buf(m_in_buf + keep, IN_BUF_SIZE - keep);
+    if (n <= 0) { m_in_eof = true; if (n < 0) m_succeeded = false; return; }
+    m_in_size += n;
+  }
+
+  // Past the end of the input, returns zeros (so decode_symbol() can always look ahead) and counts them; end_body() checks none were used.
+  inline uint decompressor::get_byte()
+  {
+    if (m_in_ofs == m_in_size) refill();
+    if (m_in_ofs < m_in_size) return m_in_buf[m_in_ofs++];
+    if (++m_num_pad > IN_BUF_KEEP) m_succeeded = false;
+    return 0;
+  }
+
+  inline uint decompressor::get_bits(uint num_bits)
+  {
+    while (m_num_bits < num_bits) { m_bit_buf |= get_byte() << m_num_bits; m_num_bits += 8; }
+    uint bits = m_bit_buf & ((1U << num_bits) - 1); m_bit_buf >>= num_bits; m_num_bits -= num_bits;
+    return bits;
+  }
+
+  inline int decompressor::decode_symbol(const huff_table &table)
+  {
+    while (m_num_bits < 15) { m_bit_buf |= get_byte() << m_num_bits; m_num_bits += 8; }
+    int entry = table.m_fast[m_bit_buf & ((1 << FAST_BITS) - 1)];
+    if (entry >= 0) { m_bit_buf >>= (entry >> 9); m_num_bits -= (entry >> 9); return entry & 511; }
+    int code = 0, first = 0, index = 0;
+    for (uint len = 1; len <= 15; len++)
+    {
+      code |= (m_bit_buf >> (len - 1)) & 1; int count = table.m_count[len];
+      if (code - first < count) { m_bit_buf >>= len; m_num_bits -= len; return table.m_symbols[index + code - first]; }
+      index += count; first = (first + count) << 1; code <<= 1;
+    }
+    return -1;
+  }
+
+  inline bool decompressor::put_byte(uint c)
+  {
+    m_window[m_window_ofs] = static_cast<uint8>(c); m_window_ofs = (m_window_ofs + 1) & (WINDOW_SIZE - 1);
+    // The window holds two halves: write out each one as it fills, while the other keeps the last 32KB for matches.
+    return (m_window_ofs & (WINDOW_SIZE / 2 - 1)) || (write_window((m_window_ofs - WINDOW_SIZE / 2) & (WINDOW_SIZE - 1), WINDOW_SIZE / 2));
+  }
+
+  bool decompressor::write_window(uint ofs, uint len)
+  {
+    if (m_format == FORMAT_ZLIB) m_checksum = adler32(m_window + ofs, len, m_checksum); else if (m_format == FORMAT_GZIP) m_checksum = crc32(m_window + ofs, len, m_checksum);
+    if ((m_succeeded) && (len) && (!m_pOut->put_buf(m_window + ofs, static_cast<int>(len)))) m_succeeded = false;
+    m_total_out += len;
+    return m_succeeded;
+  }
+
+  bool decompressor::build_table(huff_table &table, const uint8 *pCode_sizes, uint num_syms)
+  {
+    uint16 offsets[16]; uint next_code[16];
+    memset(table.m_count, 0, sizeof(table.m_count));
+    for (uint i = 0; i < num_syms; i++) table.m_count[pCode_sizes[i]]++;
+    table.m_count[0] = 0;
+    // Over-subscribed codes are invalid. Incomplete ones are allowed: their unused codes fail in decode_symbol().
+    int left = 1; for (uint len = 1; len <= 15; len++) { left = (left << 1) - table.m_count[len]; if (left < 0) return false; }
+    offsets[1] = 0; next_code[1] = 0;
+    for (uint len = 1; len < 15; len++) { offsets[len + 1] = static_cast<uint16>(offsets[len] + table.m_count[len]); next_code[len + 1] = (next_code[len] + table.m_count[len]) << 1; }
+    memset(table.m_fast, 0xFF, sizeof(table.m_fast));
+    for (uint sym = 0; sym < num_syms; sym++)
+    {
+      uint len = pCode_sizes[sym]; if (!len) continue;
+      table.m_symbols[offsets[len]++] = static_cast<uint16>(sym);
+      uint code = next_code[len]++, rev_code = 0; if (len > FAST_BITS) continue;
+      for (uint i = 0; i < len; i++, code >>= 1) rev_code = (rev_code << 1) | (code & 1);
+      for ( ; rev_code < (1U << FAST_BITS); rev_code += (1U << len)) table.m_fast[rev_code] = static_cast<int16>((len << 9) | sym);
+    }
+    return true;
+  }
+
+  bool decompressor::read_dynamic_tables()
+  {
+    uint8 code_sizes[MAX_HUFF_SYMBOLS_0 + MAX_HUFF_SYMBOLS_1];
+    uint num_lit_codes = get_bits(5) + 257, num_dist_codes = get_bits(5) + 1, num_bit_lengths = get_bits(4) + 4;
+    if ((num_lit_codes > 286) || (num_dist_codes > 30)) return false;
+    memset(code_sizes, 0, MAX_HUFF_SYMBOLS_2);
+    for (uint i = 0; i < num_bit_lengths; i++) code_sizes[s_packed_code_size_syms_swizzle[i]] = static_cast<uint8>(get_bits(3));
+    if (!build_table(m_tables[2], code_sizes, MAX_HUFF_SYMBOLS_2)) return false;
+    for (uint i = 0; i < num_lit_codes + num_dist_codes; )
+    {
+      int sym = decode_symbol(m_tables[2]); if (sym < 0) return false;
+      if (sym < 16) { code_sizes[i++] = static_cast<uint8>(sym); continue; }
+      if ((sym == 16) && (!i)) return false;
+      uint8 size = (sym == 16) ? code_sizes[i - 1] : 0; uint n = (sym == 16) ? (3 + get_bits(2)) : ((sym == 17) ? (3 + get_bits(3)) : (11 + get_bits(7)));
+      if (i + n > num_lit_codes + num_dist_codes) return false;
+      memset(code_sizes + i, size, n); i += n;
+    }
+    if (!code_sizes[256]) return false;
+    uint8 dist_code_sizes[MAX_HUFF_SYMBOLS_1]; memset(dist_code_sizes, 0, sizeof(dist_code_sizes)); memcpy(dist_code_sizes, code_sizes + num_lit_codes, num_dist_codes);
+    memset(code_sizes + num_lit_codes, 0, MAX_HUFF_SYMBOLS_0 - num_lit_codes);
+    return build_table(m_tables[0], code_sizes, MAX_HUFF_SYMBOLS_0) && build_table(m_tables[1], dist_code_sizes, MAX_HUFF_SYMBOLS_1);
+  }
+
+  // Decodes the current block's codes, up to and including its end of block code.
+  bool decompressor::decode_block()
+  {
+    for ( ; ; )
+    {
+      int sym = decode_symbol(m_tables[0]);
+      if (sym < 256) { if ((sym < 0) || (!put_byte(sym))) return false; continue; }
+      if (sym == 256) return m_succeeded;
+      if ((sym -= 257) >= 29) return false;
+      uint len = s_length_base[sym] + get_bits(s_length_extra[sym]);
+      int dist_sym = decode_symbol(m_tables[1]); if ((dist_sym < 0) || (dist_sym >= 30)) return false;
+      uint dist = s_dist_base[dist_sym] + get_bits(s_dist_extra[dist_sym]);
+      if (dist > m_total_out + (m_window_ofs & (WINDOW_SIZE / 2 - 1)) + m_dict_avail) return false;
+      for (uint src_ofs = m_window_ofs - dist; len; len--, src_ofs++) if (!put_byte(m_window[src_ofs & (WINDOW_SIZE - 1)])) return false;
+    }
+  }
+
+  // Gives back the whole bytes the bit buffer read past the end of the deflate data, and copies the rest of it to the body copy stream.
+  void decompressor::end_body()
+  {
+    m_bit_buf = 0; m_num_bits &= ~7U;
+    uint n = m_num_bits >> 3, num_pad = TDEFL_MIN(n, m_num_pad); m_num_pad -= num_pad; n -= num_pad; m_num_bits = 0;
+    m_in_ofs -= n;
+    uint64 end_pos = m_in_base + m_in_ofs;
+    if ((m_pBody_copy) && (m_copy_pos < end_pos) && (!m_pBody_copy->put_buf(m_in_buf + (m_copy_pos - m_in_base), static_cast<int>(end_pos - m_copy_pos)))) m_succeeded = false;
+    m_copy_pos = ~0ULL;
+  }
+
+  void decompressor::set_dictionary(const void *pDict, uint dict_len, uint32 dict_id)
+  {
+    m_pDict = static_cast<const uint8*>(pDict); m_dict_len = m_pDict ? dict_len : 0;
+    m_dict_id = ((m_pDict) && (!dict_id)) ? adler32(m_pDict, m_dict_len, 1) : dict_id;
+  }
+
+  bool decompressor::decompress(input_stream *pIn, output_stream *pOut, uint format, output_stream *pBody_copy)
+  {
+    m_pIn = pIn; m_pOut = pOut; m_pBody_copy = pBody_copy; m_format = FORMAT_RAW;
+    m_in_ofs = m_in_size = m_num_pad = m_bit_buf = m_num_bits = m_window_ofs = 0; m_in_base = m_total_out = 0; m_copy_pos = ~0ULL;
+    m_in_eof = false; m_succeeded = (pIn) && (pOut) && (format <= FORMAT_AUTO); m_dict_avail = 0;
+    if (!m_succeeded) return false;
+    bool use_dict = false;
+
+    while ((m_in_size < 2) && (!m_in_eof)) refill();
+    if (format == FORMAT_AUTO)
+    {
+      format = FORMAT_RAW;
+      if ((m_in_size >= 2) && (m_in_buf[0] == 0x1F) && (m_in_buf[1] == 0x8B)) format = FORMAT_GZIP;
+      else if ((m_in_size >= 2) && ((m_in_buf[0] & 15) == 8) && ((m_in_buf[0] >> 4) <= 7) && (!(((m_in_buf[0] << 8) | m_in_buf[1]) % 31))) format = FORMAT_ZLIB;
+    }
+    m_format = format;
+    if (format == FORMAT_ZLIB)
+    {
+      uint cmf = get_byte(), flg = get_byte();
+      if (((cmf & 15) != 8) || ((cmf >> 4) > 7) || (((cmf << 8) | flg) % 31)) return false;
+      if (flg & 32)
+      {
+        // Streams needing a preset dictionary can't be decompressed without the right one.
+        uint32 dict_id = 0; for (uint i = 0; i < 4; i++) dict_id = (dict_id << 8) | get_byte();
+        if ((!m_pDict) || (dict_id != m_dict_id)) return false;
+        use_dict = true;
+      }
+      m_checksum = 1;
+    }
+    else if (format == FORMAT_GZIP)
+    {
+      if ((get_byte() != 0x1F) || (get_byte() != 0x8B) || (get_byte() != 8)) return false;
+      uint flg = get_byte(); if (flg & 0xE0) return false;
+      for (uint i = 0; i < 6; i++) get_byte();
+      if (flg & 4) { uint extra_len = get_byte(); extra_len |= get_byte() << 8; while ((extra_len--) && (!m_num_pad)) get_byte(); }
+      if (flg & 8) while ((get_byte()) && (!m_num_pad)) { }
+      if (flg & 16) while ((get_byte()) && (!m_num_pad)) { }
+      if (flg & 2) { get_byte(); get_byte(); }
+      m_checksum = 0;
+    }
+    if (m_num_pad) return false;
+    m_copy_pos = m_in_base + m_in_ofs;
+    // The dictionary goes at the end of the window, just before the first byte written.
+    if ((use_dict) || ((format == FORMAT_RAW) && (m_pDict)))
+    {
+      m_dict_avail = TDEFL_MIN(m_dict_len, static_cast<uint>(WINDOW_SIZE / 2));
+      memcpy(m_window + WINDOW_SIZE - m_dict_avail, m_pDict + m_dict_len - m_dict_avail, m_dict_avail);
+    }
+
+    for (uint last_block = 0; !last_block; )
+    {
+      last_block = get_bits(1);
+      uint block_type = get_bits(2);
+      if (block_type == 0)
+      {
+        get_bits(m_num_bits & 7);
+        uint len = get_bits(16), nlen = get_bits(16); if (len != (~nlen & 0xFFFF)) return false;
+        while ((len--) && (m_succeeded)) if (!put_byte(get_bits(8))) return false;
+      }
+      else if (block_type == 1)
+      {
+        uint8 code_sizes[MAX_HUFF_SYMBOLS_0];
+        for (uint i = 0; i < MAX_HUFF_SYMBOLS_0; i++) code_sizes[i] = static_cast<uint8>(fixed_lit_code_size(i));
+        build_table(m_tables[0], code_sizes, MAX_HUFF_SYMBOLS_0);
+        memset(code_sizes, 5, MAX_HUFF_SYMBOLS_1); build_table(m_tables[1], code_sizes, MAX_HUFF_SYMBOLS_1);
+        if (!decode_block()) return false;
+      }
+      else if ((block_type == 3) || (!read_dynamic_tables()) || (!decode_block()))
+        return false;
+      if (!m_succeeded) return false;
+    }
+    end_body();
+    if (!write_window(m_window_ofs & ~(WINDOW_SIZE / 2 - 1), m_window_ofs & (WINDOW_SIZE / 2 - 1))) return false;
+
+    if (format == FORMAT_ZLIB)
+    {
+      uint32 adler = 0; for (uint i = 0; i < 4; i++) adler = (adler << 8) | get_byte();
+      if (adler != m_checksum) return false;
+    }
+    else if (format == FORMAT_GZIP)
+    {
+      uint32 crc = 0, size = 0; for (uint i = 0; i < 4; i++) crc |= get_byte() << (i * 8);
+      for (uint i = 0; i < 4; i++) size |= get_byte() << (i * 8);
+      if ((crc != m_checksum) || (size != static_cast<uint32>(m_total_out))) return false;
+    }
+    return (m_succeeded) && (!m_num_pad);
+  }
+
+  // ------------------- Preconditioning filters
+  bool precondition_params::is_valid() const
+  {
+    if ((!m_elem_size) || (m_elem_size > MAX_ELEM_SIZE) || (m_delta > DELTA_XOR) || (m_layout > LAYOUT_TRANSPOSE) || (m_num_fields > MAX_FIELDS)) return false;
+    uint total = 0; for (uint i = 0; i < m_num_fields; i++) { if (!m_field_sizes[i]) return false; total += m_field_sizes[i]; }
+    return (!m_num_fields) || (total == m_elem_size);
+  }
+
+  // Values are assembled from bytes byte_step apart (1, or the number of elements in a byte plane), in little endian order so filtered data is portable.
+  template<typename T> static inline T precondition_load(const uint8 *p, size_t byte_step)
+  {
+    T v = 0; for (uint i = 0; i < sizeof(T); i++) v |= static_cast<T>(static_cast<T>(p[i * byte_step]) << (i * 8)); return v;
+  }
+
+  template<typename T> static inline void precondition_store(uint8 *p, size_t byte_step, T v)
+  {
+    for (uint i = 0; i < sizeof(T); i++) p[i * byte_step] = static_cast<uint8>(v >> (i * 8));
+  }
+
+  // Filters (or unfilters) one lane: a field, or a byte of a field, of each of n elements. prev carries the lane's last element between calls.
+  // The loops are branch free past the delta switch, and with byte_step == 1 the byte loops above compile to plain loads and stores.
+  template<typename T> static void precondition_lane(uint8 *pDst, size_t dst_stride, size_t dst_byte_step, const uint8 *pSrc, size_t src_stride, size_t src_byte_step, size_t n, uint delta, bool unfilter, uint64 &prev_elem)
+  {
+    T prev = static_cast<T>(prev_elem);
+    switch ((delta == precondition_params::DELTA_NONE) ? 0 : ((delta == precondition_params::DELTA_XOR) ? 1 : (unfilter ? 3 : 2)))
+    {
+      case 0: for (size_t i = 0; i < n; i++) precondition_store<T>(pDst + i * dst_stride, dst_byte_step, precondition_load<T>(pSrc + i * src_stride, src_byte_step)); break;
+      case 1: for (size_t i = 0; i < n; i++) { T v = precondition_load<T>(pSrc + i * src_stride, src_byte_step); precondition_store<T>(pDst + i * dst_stride, dst_byte_step, static_cast<T>(v ^ prev)); prev = unfilter ? static_cast<T>(v ^ prev) : v; } break;
+      case 2: for (size_t i = 0; i < n; i++) { T v = precondition_load<T>(pSrc + i * src_stride, src_byte_step); precondition_store<T>(pDst + i * dst_stride, dst_byte_step, static_cast<T>(v - prev)); prev = v; } break;
+      case 3: for (size_t i = 0; i < n; i++) { prev = static_cast<T>(prev + precondition_load<T>(pSrc + i * src_stride, src_byte_step)); precondition_store<T>(pDst + i * dst_stride, dst_byte_step, prev); } break;
+    }
+    prev_elem = prev;
+  }
+
+  enum { PRECONDITION_BLOCK_SIZE = 16384 };
+
+  static bool precondition_filter(uint8 *pDst, const uint8 *pSrc, size_t len, const precondition_params &params, bool unfilter)
+  {
+    if ((!params.is_valid()) || ((len) && ((!pDst) || (!pSrc)))) return false;
+    const size_t elem_size = params.m_elem_size, n = len / elem_size;
+    const uint8 whole_elem = static_cast<uint8>(elem_size);
+    const uint8 *pField_sizes = params.m_num_fields ? params.m_field_sizes : &whole_elem;
+    const uint num_fields = params.m_num_fields ? params.m_num_fields : 1;
+    // All the lanes are run over a block of elements at a time, so the block stays in the cache instead of every lane streaming the whole buffer.
+    const size_t block_elems = TDEFL_MAX(static_cast<size_t>(1U), static_cast<size_t>(PRECONDITION_BLOCK_SIZE) / elem_size);
+    uint64 prev_elems[precondition_params::MAX_ELEM_SIZE]; memset(prev_elems, 0, sizeof(prev_elems));
+    for (size_t first = 0; first < n; first += block_elems)
+    {
+      const size_t num = TDEFL_MIN(block_elems, n - first);
+      for (size_t f = 0, ofs = 0; f < num_fields; ofs += pField_sizes[f++])
+      {
+        // Integer sized fields are one lane, others are filtered a byte at a time.
+        const size_t field_size = pField_sizes[f], lane_size = ((field_size == 2) || (field_size == 4) || (field_size == 8)) ? field_size : 1;
+        for (size_t b = 0; b < field_size; b += lane_size)
+        {
+          // Where the lane's bytes go in the filtered data.
+          size_t filtered_ofs = first * elem_size + ofs + b, filtered_stride = elem_size, filtered_byte_step = 1;
+          if (params.m_layout == precondition_params::LAYOUT_SHUFFLE) { filtered_ofs = (ofs + b) * n + first; filtered_stride = 1; filtered_byte_step = n; }
+          else if (params.m_layout == precondition_params::LAYOUT_TRANSPOSE) { filtered_ofs = ofs * n + first * field_size + b; filtered_stride = field_size; }
+
+          const size_t elem_ofs = first * elem_size + ofs + b;
+          uint8 *pD = pDst + (unfilter ? elem_ofs : filtered_ofs); const uint8 *pS = pSrc + (unfilter ? filtered_ofs : elem_ofs);
+          const size_t dst_stride = unfilter ? elem_size : filtered_stride, dst_byte_step = unfilter ? 1 : filtered_byte_step;
+          const size_t src_stride = unfilter ? filtered_stride : elem_size, src_byte_step = unfilter ? filtered_byte_step : 1;
+          uint64 &prev = prev_elems[ofs + b];
+          switch (lane_size)
+          {
+            case 1: precondition_lane<uint8>(pD, dst_stride, dst_byte_step, pS, src_stride, src_byte_step, num, params.m_delta, unfilter, prev); break;
+            case 2: precondition_lane<uint16>(pD, dst_stride, dst_byte_step, pS, src_stride, src_byte_step, num, params.m_delta, unfilter, prev); break;
+            case 4: precondition_lane<uint32>(pD, dst_stride, dst_byte_step, pS, src_stride, src_byte_step, num, params.m_delta, unfilter, prev); break;
+            default: precondition_lane<uint64>(pD, dst_stride, dst_byte_step, pS, src_stride, src_byte_step, num, params.m_delta, unfilter, prev); break;
+          }
+        }
+      }
+    }
+    if (len > n * elem_size) memcpy(pDst + n * elem_size, pSrc + n * elem_size, len - n * elem_size);
+    return true;
+  }
+
+  bool precondition_mem(void *pDst, const void *pSrc, size_t len, const precondition_params &params)
+  {
+    return precondition_filter(static_cast<uint8*>(pDst), static_cast<const uint8*>(pSrc), len, params, false);
+  }
+
+  bool unprecondition_mem(void *pDst, const void *pSrc, size_t len, const precondition_params &params)
+  {
+    return precondition_filter(static_cast<uint8*>(pDst), static_cast<const uint8*>(pSrc), len, params, true);
+  }
+
+  // Header: 'P', delta | layout << 4 (bit 7 set if a zlib stream follows, else raw deflate), element size, number of fields, then the field sizes.
+  enum { PRECONDITION_MAGIC = 'P', PRECONDITION_ZLIB_BIT = 0x80 };
+
+  void *compress_preconditioned_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, const precondition_params &params, int flags)
+  {
+    if (!pOut_len) return NULL; else *pOut_len = 0;
+    if ((!params.is_valid()) || ((src_buf_len) && (!pSrc_buf))) return NULL;
+    uint8 hdr[4 + precondition_params::MAX_FIELDS] = { PRECONDITION_MAGIC, static_cast<uint8>(params.m_delta | (params.m_layout << 4) | ((flags & WRITE_ZLIB_HEADER) ? PRECONDITION_ZLIB_BIT : 0)),
+      static_cast<uint8>(params.m_elem_size), static_cast<uint8>(params.m_num_fields) };
+    for (uint i = 0; i < params.m_num_fields; i++) hdr[4 + i] = params.m_field_sizes[i];
+
+    uint8 *pFiltered = static_cast<uint8*>(TDEFL_MALLOC(TDEFL_MAX(src_buf_len, static_cast<size_t>(1U)))); if (!pFiltered) return NULL;
+    precondition_mem(pFiltered, pSrc_buf, src_buf_len, params);
+    expandable_malloc_output_stream out_stream(TDEFL_MAX(32U, src_buf_len >> 1U));
+    bool succeeded = (out_stream.put_buf(hdr, 4 + params.m_num_fields)) && (compress_mem_to_output_stream(pFiltered, src_buf_len, &out_stream, flags));
+    TDEFL_FREE(pFiltered);
+    if (!succeeded) return NULL;
+    *pOut_len = out_stream.get_size();
+    return out_stream.assume_buf_ownership();
+  }
+
+  void *decompress_preconditioned_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len)
+  {
+    if (!pOut_len) return NULL; else *pOut_len = 0;
+    const uint8 *pSrc = static_cast<const uint8*>(pSrc_buf);
+    if ((!pSrc) || (src_buf_len < 4) || (pSrc[0] != PRECONDITION_MAGIC) || (src_buf_len < 4U + pSrc[3])) return NULL;
+    precondition_params params(pSrc[2], pSrc[1] & 15, (pSrc[1] >> 4) & 7);
+    for (uint i = 0; i < pSrc[3]; i++) if (!params.add_field(pSrc[4 + i])) return NULL;
+    if (!params.is_valid()) return NULL;
+
+    const size_t hdr_size = 4 + params.m_num_fields;
+    buffer_input_stream in_stream(pSrc + hdr_size, src_buf_len - hdr_size);
+    expandable_malloc_output_stream filtered(TDEFL_MAX(64U, src_buf_len * 2U));
+    decompressor *pDecomp = TDEFL_NEW decompressor; if (!pDecomp) return NULL;
+    bool succeeded = pDecomp->decompress(&in_stream, &filtered, (pSrc[1] & PRECONDITION_ZLIB_BIT) ? decompressor::FORMAT_ZLIB : decompressor::FORMAT_RAW);
+    TDEFL_DELETE pDecomp;
+    if (!succeeded) return NULL;
+
+    void *pBuf = TDEFL_MALLOC(TDEFL_MAX(filtered.get_size(), static_cast<size_t>(1U))); if (!pBuf) return NULL;
+    unprecondition_mem(pBuf, filtered.get_buf(), filtered.get_size(), params);
+    *pOut_len = filtered.get_size();
+    return pBuf;
+  }
+
+  // ------------------- channel_context
+  channel_context::channel_context() : m_pComp(NULL), m_pDecomp(NULL), m_pBuf(NULL), m_max_hist_len(0), m_hist_ofs(0), m_hist_len(0), m_dict_id(1), m_version(0), m_flags(0), m_comp_primed(false)
+  {
+  }
+
+  channel_context::~channel_context()
+  {
+    TDEFL_DELETE m_pComp; TDEFL_DELETE m_pDecomp; TDEFL_FREE(m_pBuf);
+  }
+
+  bool channel_context::init(int flags, uint history_size)
+  {
+    if ((history_size < MIN_HISTORY_SIZE) || (history_size > MAX_HISTORY_SIZE)) return false;
+    if ((!m_pBuf) || (history_size != m_max_hist_len))
+    {
+      TDEFL_FREE(m_pBuf); m_pBuf = static_cast<uint8*>(TDEFL_MALLOC(history_size * 2U));
+      m_max_hist_len = m_pBuf ? history_size : 0; if (!m_pBuf) return false;
+    }
+    m_hist_ofs = m_hist_len = 0; m_dict_id = 1; m_version = 0; m_flags = flags & ~AUTO_STRATEGY_FLAG; m_comp_primed = false;
+    return true;
+  }
+
+  // Updates the Adler-32 of the window_len byte buffer at pFront for its first num bytes being dropped (the inverse of adding bytes at the end), so the
+  // history's id costs O(bytes appended) to keep up to date rather than O(history size).
+  static uint32 adler32_drop_front(uint32 adler, const uint8 *pFront, size_t num, size_t window_len)
+  {
+    const uint32 ADLER_MOD = 65521U; uint32 s1 = adler & 0xFFFF, s2 = adler >> 16;
+    for (size_t i = 0; i < num; i++, window_len--)
+    {
+      uint32 c = pFront[i];
+      s1 = (s1 + ADLER_MOD - c) % ADLER_MOD;
+      s2 = static_cast<uint32>((s2 + 2ULL * ADLER_MOD - 1U - ((window_len % ADLER_MOD) * c) % ADLER_MOD) % ADLER_MOD);
+    }
+    return (s2 << 16) | s1;
+  }
+
+  void channel_context::append_history(const uint8 *pSrc, size_t len)
+  {
+    m_version++;
+    if (len >= m_max_hist_len)
+    {
+      m_hist_ofs = 0; m_hist_len = m_max_hist_len; memcpy(m_pBuf, pSrc + len - m_max_hist_len, m_max_hist_len);
+      m_dict_id = adler32(m_pBuf, m_hist_len, 1);
+      return;
+    }
+    uint num_dropped = (m_hist_len + len > m_max_hist_len) ? static_cast<uint>(m_hist_len + len - m_max_hist_len) : 0;
+    m_dict_id = adler32_drop_front(m_dict_id, m_pBuf + m_hist_ofs, num_dropped, m_hist_len); m_hist_ofs += num_dropped; m_hist_len -= num_dropped;
+    if (m_hist_ofs + m_hist_len + len > m_max_hist_len * 2U) { memmove(m_pBuf, m_pBuf + m_hist_ofs, m_hist_len); m_hist_ofs = 0; }
+    memcpy(m_pBuf + m_hist_ofs + m_hist_len, pSrc, len); m_hist_len += static_cast<uint>(len);
+    m_dict_id = adler32(pSrc, len, m_dict_id);
+  }
+
+  bool channel_context::append(const void *pBuf, size_t len)
+  {
+    if ((!m_pBuf) || ((len) && (!pBuf))) return false;
+    append_history(static_cast<const uint8*>(pBuf), len); m_comp_primed = false;
+    return true;
+  }
+
+  bool channel_context::compress_message(const void *pMsg, size_t msg_len, output_stream *pOut, uint64 *pVersion)
+  {
+    if (pVersion) *pVersion = m_version;
+    if ((!m_pBuf) || (!pOut) || ((msg_len) && (!pMsg))) return false;
+    if (!m_pComp) { m_pComp = TDEFL_NEW compressor; if (!m_pComp) return false; }
+    // If the compressor compressed the last message, its window ends with the history, so it can go on from there. Otherwise load the history.
+    bool succeeded = (m_comp_primed) && (m_hist_len) && (m_pComp->reinit_with_dictionary(pOut, m_flags, m_hist_len, m_dict_id));
+    if (!succeeded) succeeded = (m_pComp->init(pOut, m_flags)) && ((!m_hist_len) || (m_pComp->set_dictionary(get_history(), m_hist_len)));
+    m_comp_primed = false;
+    const uint8 *pSrc = static_cast<const uint8*>(pMsg);
+    for (size_t ofs = 0; (succeeded) && (ofs < msg_len); )
+    {
+      uint n = static_cast<uint>(TDEFL_MIN(16U * 1024U * 1024U, msg_len - ofs)); succeeded = m_pComp->compress_data(pSrc + ofs, n); ofs += n;
+    }
+    if ((!succeeded) || (!m_pComp->compress_data(NULL, 0))) return false;
+    append_history(pSrc, msg_len); m_comp_primed = true;
+    return true;
+  }
+
+  bool channel_context::decompress_message(input_stream *pIn, output_stream *pOut, uint64 expected_version)
+  {
+    if ((!m_pBuf) || (!pOut) || ((expected_version != ~0ULL) && (expected_version != m_version))) return false;
+    if (!m_pDecomp) { m_pDecomp = TDEFL_NEW decompressor; if (!m_pDecomp) return false; }
+    // Decompress to a staging buffer, so the history is only touched once the whole message checks out.
+    m_message.reset();
+    m_pDecomp->set_dictionary(m_hist_len ? get_history() : NULL, m_hist_len, m_dict_id);
+    bool succeeded = m_pDecomp->decompress(pIn, &m_message, (m_flags & WRITE_ZLIB_HEADER) ? decompressor::FORMAT_ZLIB : decompressor::FORMAT_RAW);
+    m_pDecomp->set_dictionary(NULL, 0);
+    if ((!succeeded) || ((m_message.get_size()) && (!pOut->put_buf(m_message.get_buf(), static_cast<int>(m_message.get_size()))))) return false;
+    append_history(m_message.get_buf(), m_message.get_size()); m_comp_primed = false;
+    return true;
+  }
+
+  // ------------------- record_batch_writer/reader
+  enum { RECORD_BATCH_MAGIC = 0x42524454, RECORD_BATCH_REORDERED = 1, RECORD_BATCH_ZLIB_FRAMES = 2 };
+
+  static inline void write_le32(uint8 *p, uint32 v) { p[0] = static_cast<uint8>(v); p[1] = static_cast<uint8>(v >> 8); p[2] = static_cast<uint8>(v >> 16); p[3] = static_cast<uint8>(v >> 24); }
+  static inline uint32 read_le32(const uint8 *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32>(p[3]) << 24); }
+  static inline bool put_le32(output_stream &stream, uint32 v) { uint8 buf[4]; write_le32(buf, v); return stream.put_buf(buf, 4); }
+
+  record_batch_writer::record_batch_writer() : m_pStream(NULL), m_flags(0), m_frame_size(0), m_num_records(0), m_num_frames(0), m_window_first_record(0), m_reorder(false), m_all_writes_succeeded(false), m_out_ofs(0)
+  {
+  }
+
+  record_batch_writer::~record_batch_writer()
+  {
+  }
+
+  bool record_batch_writer::init(output_stream *pStream, int flags, uint frame_size, bool reorder)
+  {
+    if ((!pStream) || (!frame_size) || (frame_size > 0x10000000U)) return false;
+    m_pStream = pStream; m_flags = flags; m_frame_size = frame_size; m_reorder = reorder; m_all_writes_succeeded = true;
+    m_num_records = m_num_frames = m_window_first_record = 0; m_out_ofs = 0;
+    m_window.reset(); m_window_ofs.reset(); m_dir_frames.reset(); m_dir_sizes.reset(); m_dir_slots.reset();
+    return put_le32(m_window_ofs, 0);
+  }
+
+  bool record_batch_writer::add_record(const void *pRecord, uint len)
+  {
+    if ((!m_pStream) || (!m_all_writes_succeeded) || ((len) && (!pRecord)) || (m_num_records == 0xFFFFFFFFU) || (len > 0x7FFFFFFFU)) return false;
+    const uint64 window_limit = static_cast<uint64>(m_frame_size) * (m_reorder ? static_cast<uint>(REORDER_WINDOW_FRAMES) : 1U);
+    if ((m_window.get_size()) && (m_window.get_size() + len > window_limit) && (!flush_window())) return false;
+    if ((len) && (!m_window.put_buf(pRecord, static_cast<int>(len)))) return false;
+    m_num_records++;
+    return put_le32(m_window_ofs, static_cast<uint32>(m_window.get_size()));
+  }
+
+  // MinHash signature of a record's 4 byte shingles, under two hash functions: the more of their shingles two records share, the likelier their signatures
+  // are equal. Sorting by it groups similar records (the second half orders records whose first minimum matched).
+  static uint64 record_similarity_key(const uint8 *p, uint len)
+  {
+    if (len < 4) return len;
+    uint32 min1 = 0xFFFFFFFFU, min2 = 0xFFFFFFFFU;
+    for (uint i = 0; i + 4 <= len; i++)
+    {
+      uint32 shingle = read_le32(p + i);
+      uint32 h1 = shingle * 0x9E3779B1U; h1 ^= h1 >> 15; uint32 h2 = (shingle ^ 0x5BD1E995U) * 0x85EBCA77U; h2 ^= h2 >> 13;
+      min1 = TDEFL_MIN(min1, h1); min2 = TDEFL_MIN(min2, h2);
+    }
+    return (static_cast<uint64>(min1) << 32) | min2;
+  }
+
+  struct record_sort_entry { uint64 m_key; uint m_index; };
+
+  static int compare_record_sort_entries(const void *pA, const void *pB)
+  {
+    const record_sort_entry &a = *static_cast<const record_sort_entry*>(pA), &b = *static_cast<const record_sort_entry*>(pB);
+    if (a.m_key != b.m_key) return (a.m_key < b.m_key) ? -1 : 1;
+    return (a.m_index < b.m_index) ? -1 : ((a.m_index > b.m_index) ? 1 : 0);
+  }
+
+  // Compresses the window's records (reordered or not) into frames, and adds them to the directory.
+  bool record_batch_writer::flush_window()
+  {
+    const uint num = static_cast<uint>(m_window_ofs.get_size() / 4U) - 1U; if (!num) return true;
+    const uint8 *pRecords = m_window.get_buf(), *pOfs = m_window_ofs.get_buf();
+    record_sort_entry *pOrder = static_cast<record_sort_entry*>(TDEFL_MALLOC(num * sizeof(record_sort_entry))); if (!pOrder) return false;
+    for (uint i = 0; i < num; i++)
+    {
+      pOrder[i].m_index = i; pOrder[i].m_key = 0;
+      if (m_reorder) pOrder[i].m_key = record_similarity_key(pRecords + read_le32(pOfs + i * 4), read_le32(pOfs + i * 4 + 4) - read_le32(pOfs + i * 4));
+    }
+    if (m_reorder) qsort(pOrder, num, sizeof(record_sort_entry), compare_record_sort_entries);
+
+    // The slots of this window's records, by record index, for the directory.
+    uint *pSlots = m_reorder ? static_cast<uint*>(TDEFL_MALLOC(num * sizeof(uint))) : NULL;
+    bool succeeded = (!m_reorder) || (pSlots);
+    uint first_slot = m_window_first_record;
+    m_frame.reset();
+    for (uint i = 0, frame_records = 0; (succeeded) && (i < num); i++)
+    {
+      uint ofs = read_le32(pOfs + pOrder[i].m_index * 4), len = read_le32(pOfs + pOrder[i].m_index * 4 + 4) - ofs;
+      if ((frame_records) && (m_frame.get_size() + len > m_frame_size)) { succeeded = flush_frame(frame_records); frame_records = 0; }
+      if (pSlots) pSlots[pOrder[i].m_index] = first_slot + i;
+      succeeded = (succeeded) && ((!len) || (m_frame.put_buf(pRecords + ofs, static_cast<int>(len)))) && (put_le32(m_dir_sizes, len));
+      frame_records++;
+      if ((succeeded) && (i == num - 1)) succeeded = flush_frame(frame_records);
+    }
+    for (uint i = 0; (succeeded) && (pSlots) && (i < num); i++) succeeded = put_le32(m_dir_slots, pSlots[i]);
+    TDEFL_FREE(pOrder); TDEFL_FREE(pSlots);
+
+    m_window_first_record += num; m_window.reset(); m_window_ofs.reset();
+    return (succeeded) && (put_le32(m_window_ofs, 0));
+  }
+
+  bool record_batch_writer::flush_frame(uint num_records)
+  {
+    m_comp.reset();
+    bool succeeded = compress_mem_to_output_stream(m_frame.get_buf(), m_frame.get_size(), &m_comp, m_flags) && (m_pStream->put_buf(m_comp.get_buf(), static_cast<int>(m_comp.get_size())));
+    succeeded = succeeded && put_le32(m_dir_frames, static_cast<uint32>(m_comp.get_size())) && put_le32(m_dir_frames, static_cast<uint32>(m_frame.get_size())) && put_le32(m_dir_frames, num_records);
+    m_out_ofs += m_comp.get_size(); m_num_frames++; m_frame.reset();
+    if (!succeeded) m_all_writes_succeeded = false;
+    return succeeded;
+  }
+
+  bool record_batch_writer::finish()
+  {
+    if ((!m_pStream) || (!m_all_writes_succeeded) || (!flush_window())) return false;
+    // Record sizes compress well next to each other, so the directory is compressed as one stream, fields grouped by kind.
+    m_frame.reset();
+    bool succeeded = (!m_dir_frames.get_size() || m_frame.put_buf(m_dir_frames.get_buf(), static_cast<int>(m_dir_frames.get_size()))) &&
+      (!m_dir_sizes.get_size() || m_frame.put_buf(m_dir_sizes.get_buf(), static_cast<int>(m_dir_sizes.get_size()))) &&
+      (!m_dir_slots.get_size() || m_frame.put_buf(m_dir_slots.get_buf(), static_cast<int>(m_dir_slots.get_size())));
+    m_comp.reset();
+    succeeded = succeeded && compress_mem_to_output_stream(m_frame.get_buf(), m_frame.get_size(), &m_comp, DEFAULT_MAX_PROBES | WRITE_ZLIB_HEADER) && (m_pStream->put_buf(m_comp.get_buf(), static_cast<int>(m_comp.get_size())));
+    uint8 trailer[TRAILER_SIZE];
+    write_le32(trailer, static_cast<uint32>(m_out_ofs)); write_le32(trailer + 4, static_cast<uint32>(m_out_ofs >> 32)); write_le32(trailer + 8, static_cast<uint32>(m_comp.get_size()));
+    write_le32(trailer + 12, static_cast<uint32>(m_frame.get_size())); write_le32(trailer + 16, m_num_frames); write_le32(trailer + 20, m_num_records);
+    write_le32(trailer + 24, (m_reorder ? RECORD_BATCH_REORDERED : 0) | ((m_flags & WRITE_ZLIB_HEADER) ? RECORD_BATCH_ZLIB_FRAMES : 0)); write_le32(trailer + 28, RECORD_BATCH_MAGIC);
+    succeeded = succeeded && m_pStream->put_buf(trailer, TRAILER_SIZE);
+    m_pStream = NULL; m_window.clear(); m_window_ofs.clear(); m_frame.clear(); m_comp.clear(); m_dir_frames.clear(); m_dir_sizes.clear(); m_dir_slots.clear();
+    return succeeded;
+  }
+
+  record_batch_reader::record_batch_reader() : m_pBuf(NULL), m_num_records(0), m_num_frames(0), m_cur_frame(0), m_zlib_frames(false), m_num_frames_decompressed(0), m_pFrames(NULL), m_pSlot_ofs(NULL), m_pRecord_slots(NULL), m_pFrame_buf(NULL), m_pDecomp(NULL)
+  {
+  }
+
+  record_batch_reader::~record_batch_reader()
+  {
+    clear(); TDEFL_DELETE m_pDecomp;
+  }
+
+  void record_batch_reader::clear()
+  {
+    TDEFL_FREE(m_pFrames); TDEFL_FREE(m_pSlot_ofs); TDEFL_FREE(m_pRecord_slots); TDEFL_FREE(m_pFrame_buf);
+    m_pFrames = NULL; m_pSlot_ofs = m_pRecord_slots = NULL; m_pFrame_buf = NULL; m_pBuf = NULL; m_num_records = m_num_frames = 0; m_cur_frame = 0xFFFFFFFFU; m_num_frames_decompressed = 0;
+  }
+
+  bool record_batch_reader::init(const void *pBuf, size_t buf_len)
+  {
+    clear();
+    const uint8 *pSrc = static_cast<const uint8*>(pBuf);
+    if ((!pSrc) || (buf_len < record_batch_writer::TRAILER_SIZE)) return false;
+    const uint8 *pTrailer = pSrc + buf_len - record_batch_writer::TRAILER_SIZE;
+    const uint64 dir_ofs = read_le32(pTrailer) | (static_cast<uint64>(read_le32(pTrailer + 4)) << 32);
+    const uint dir_comp_size = read_le32(pTrailer + 8), dir_size = read_le32(pTrailer + 12), num_frames = read_le32(pTrailer + 16), num_records = read_le32(pTrailer + 20), flags = read_le32(pTrailer + 24);
+    const bool reordered = (flags & RECORD_BATCH_REORDERED) != 0;
+    // The directory must sit right before the trailer. Checked term by term, so a crafted dir_ofs can't wrap the sum around.
+    const size_t dir_end = buf_len - record_batch_writer::TRAILER_SIZE;
+    if ((read_le32(pTrailer + 28) != RECORD_BATCH_MAGIC) || (dir_ofs > dir_end) || (dir_comp_size != dir_end - dir_ofs)) return false;
+    if (dir_size != (num_frames * 3ULL + num_records * (reordered ? 2ULL : 1ULL)) * 4U) return false;
+
+    if ((!m_pDecomp) && ((m_pDecomp = TDEFL_NEW decompressor) == NULL)) return false;
+    expandable_malloc_output_stream dir(dir_size);
+    buffer_input_stream dir_in(pSrc + dir_ofs, dir_comp_size);
+    if ((!m_pDecomp->decompress(&dir_in, &dir, decompressor::FORMAT_ZLIB)) || (dir.get_size() != dir_size)) return false;
+    const uint8 *pDir_frames = dir.get_buf(), *pDir_sizes = pDir_frames + num_frames * 12U, *pDir_slots = pDir_sizes + num_records * 4U;
+
+    m_pFrames = static_cast<frame*>(TDEFL_MALLOC(TDEFL_MAX(num_frames, 1U) * sizeof(frame)));
+    m_pSlot_ofs = static_cast<uint*>(TDEFL_MALLOC(TDEFL_MAX(num_records, 1U) * sizeof(uint)));
+    m_pRecord_slots = reordered ? static_cast<uint*>(TDEFL_MALLOC(TDEFL_MAX(num_records, 1U) * sizeof(uint))) : NULL;
+    if ((!m_pFrames) || (!m_pSlot_ofs) || ((reordered) && (!m_pRecord_slots))) { clear(); return false; }
+    // Check the directory adds up, so get_record() can trust it.
+    uint64 ofs = 0; uint slot = 0, max_frame_size = 1;
+    for (uint i = 0; i < num_frames; i++)
+    {
+      frame &f = m_pFrames[i]; f.m_ofs = ofs; f.m_comp_size = read_le32(pDir_frames + i * 12); f.m_size = read_le32(pDir_frames + i * 12 + 4); f.m_first_slot = slot;
+      uint frame_records = read_le32(pDir_frames + i * 12 + 8), frame_ofs = 0;
+      if ((!frame_records) || (frame_records > num_records - slot)) { clear(); return false; }
+      for (uint j = 0; j < frame_records; j++, slot++)
+      {
+        uint len = read_le32(pDir_sizes + slot * 4U);
+        if (len > f.m_size - frame_ofs) { clear(); return false; }
+        m_pSlot_ofs[slot] = frame_ofs; frame_ofs += len;
+      }
+      if (frame_ofs != f.m_size) { clear(); return false; }
+      ofs += f.m_comp_size; max_frame_size = TDEFL_MAX(max_frame_size, f.m_size);
+    }
+    if ((slot != num_records) || (ofs != dir_ofs)) { clear(); return false; }
+    for (uint i = 0; (reordered) && (i < num_records); i++) if ((m_pRecord_slots[i] = read_le32(pDir_slots + i * 4U)) >= num_records) { clear(); return false; }
+    if ((m_pFrame_buf = static_cast<uint8*>(TDEFL_MALLOC(max_frame_size))) == NULL) { clear(); return false; }
+
+    m_pBuf = pSrc; m_num_frames = num_frames; m_num_records = num_records; m_zlib_frames = (flags & RECORD_BATCH_ZLIB_FRAMES) != 0;
+    return true;
+  }
+
+  const void *record_batch_reader::get_record(uint index, uint *pLen)
+  {
+    if (pLen) *pLen = 0;
+    if (index >= m_num_records) return NULL;
+    const uint slot = m_pRecord_slots ? m_pRecord_slots[index] : index;
+    // The last frame whose first slot is <= slot.
+    uint lo = 0, hi = m_num_frames - 1;
+    while (lo < hi) { uint mid = (lo + hi + 1) >> 1; if (m_pFrames[mid].m_first_slot <= slot) lo = mid; else hi = mid - 1; }
+    const frame &f = m_pFrames[lo];
+    if (m_cur_frame != lo)
+    {
+      m_cur_frame = 0xFFFFFFFFU;
+      buffer_input_stream in(m_pBuf + f.m_ofs, f.m_comp_size); buffer_output_stream out(m_pFrame_buf, f.m_size);
+      if ((!m_pDecomp->decompress(&in, &out, m_zlib_frames ? decompressor::FORMAT_ZLIB : decompressor::FORMAT_RAW)) || (out.get_size() != f.m_size)) return NULL;
+      m_cur_frame = lo; m_num_frames_decompressed++;
+    }
+    const uint next_frame_slot = (lo + 1 < m_num_frames) ? m_pFrames[lo + 1].m_first_slot : m_num_records;
+    const uint ofs = m_pSlot_ofs[slot], end = (slot + 1 < next_frame_slot) ? m_pSlot_ofs[slot + 1] : f.m_size;
+    if (pLen) *pLen = end - ofs;
+    return m_pFrame_buf + ofs;
+  }
+
+#if TDEFL_CPP11
+  // ------------------- compressed_cache
+  // Entries are immutable once published. Writers (serialized by the shard mutex) link new entries at the head of a bucket and unlink evicted ones,
+  // while readers walk the bucket chains without locking. Unlinked entries are retired and freed after a grace period: each lookup registers on the reader
+  // count of the shard's current epoch, and a writer flips the epoch (once the other count has drained) to start a grace period for everything retired so
+  // far. Those entries are freed when the old epoch's count drains, which only takes the lookups already in flight, since new ones register on the new epoch.
+  // Retired bytes count against the shard's budget until then.
+  struct compressed_cache_entry
+  {
+    std::atomic<compressed_cache_entry*> m_pNext;
+    compressed_cache_entry *m_pClock_prev, *m_pClock_next, *m_pRetired_next;
+    std::atomic<bool> m_referenced;
+    uint64 m_hash[2];
+    size_t m_src_len, m_comp_len;
+    int m_flags;
+    uint8 m_data[1];
+  };
+
+  struct compressed_cache::shard
+  {
+    std::mutex m_mutex;
+    std::atomic<compressed_cache_entry*> *m_pBuckets;
+    uint m_bucket_mask;
+    compressed_cache_entry *m_pClock_hand, *m_pRetired, *m_pGrace_retired;
+    size_t m_size, m_retired_size, m_grace_retired_size;
+    std::atomic<uint> m_epoch, m_num_readers[2];
+    std::atomic<uint64> m_num_hits, m_num_misses;
+
+    shard() : m_pBuckets(NULL), m_bucket_mask(0), m_pClock_hand(NULL), m_pRetired(NULL), m_pGrace_retired(NULL), m_size(0), m_retired_size(0), m_grace_retired_size(0), m_epoch(0), m_num_hits(0), m_num_misses(0)
+    {
+      m_num_readers[0].store(0); m_num_readers[1].store(0);
+    }
+
+    // Returns the epoch to pass to end_read(). A lookup that registers just as the epoch flips retries on the new one, so the writer never misses it.
+    uint begin_read()
+    {
+      for ( ; ; )
+      {
+        uint epoch = m_epoch.load(); m_num_readers[epoch]++;
+        if (m_epoch.load() == epoch) return epoch;
+        m_num_readers[epoch]--;
+      }
+    }
+    void end_read(uint epoch) { m_num_readers[epoch]--; }
+
+    void unlink(compressed_cache_entry *pEntry)
+    {
+      std::atomic<compressed_cache_entry*> *pLink = &m_pBuckets[pEntry->m_hash[1] & m_bucket_mask];
+      while (pLink->load() != pEntry) pLink = &pLink->load()->m_pNext;
+      pLink->store(pEntry->m_pNext.load());
+      if (pEntry->m_pClock_next == pEntry) m_pClock_hand = NULL;
+      else
+      {
+        pEntry->m_pClock_prev->m_pClock_next = pEntry->m_pClock_next; pEntry->m_pClock_next->m_pClock_prev = pEntry->m_pClock_prev;
+        if (m_pClock_hand == pEntry) m_pClock_hand = pEntry->m_pClock_next;
+      }
+      m_size -= sizeof(compressed_cache_entry) + pEntry->m_comp_len; m_retired_size += sizeof(compressed_cache_entry) + pEntry->m_comp_len;
+      pEntry->m_pRetired_next = m_pRetired; m_pRetired = pEntry;
+    }
+
+    // Called with the mutex held. Frees the entries whose grace period is over, then starts one for the newly retired entries.
+    void free_retired()
+    {
+      const uint epoch = m_epoch.load();
+      if (m_num_readers[epoch ^ 1].load()) return;
+      while (m_pGrace_retired) { compressed_cache_entry *pNext = m_pGrace_retired->m_pRetired_next; m_pGrace_retired->~compressed_cache_entry(); TDEFL_FREE(m_pGrace_retired); m_pGrace_retired = pNext; }
+      m_grace_retired_size = 0;
+      if (!m_pRetired) return;
+      // Every lookup that can still see these entries registered on this epoch.
+      m_pGrace_retired = m_pRetired; m_grace_retired_size = m_retired_size; m_pRetired = NULL; m_retired_size = 0;
+      m_epoch.store(epoch ^ 1);
+    }
+    size_t get_total_size() const { return m_size + m_retired_size + m_grace_retired_size; }
+  };
+
+  compressed_cache::compressed_cache(size_t max_bytes, uint num_shards)
+  {
+    m_num_shards = TDEFL_MAX(1U, num_shards); m_max_shard_bytes = max_bytes / m_num_shards;
+    // Size the bucket arrays for ~1KB entries, they never grow.
+    uint num_buckets = 64; while ((num_buckets < 65536) && (num_buckets * 1024U < m_max_shard_bytes)) num_buckets <<= 1;
+    m_pShards = TDEFL_NEW shard[m_num_shards];
+    for (uint i = 0; i < m_num_shards; i++)
+    {
+      m_pShards[i].m_pBuckets = TDEFL_NEW std::atomic<compressed_cache_entry*>[num_buckets]; m_pShards[i].m_bucket_mask = num_buckets - 1;
+      for (uint j = 0; j < num_buckets; j++) m_pShards[i].m_pBuckets[j].store(NULL);
+    }
+  }
+
+  compressed_cache::~compressed_cache()
+  {
+    clear();
+    for (uint i = 0; i < m_num_shards; i++) TDEFL_DELETE [] m_pShards[i].m_pBuckets;
+    TDEFL_DELETE [] m_pShards;
+  }
+
+  void compressed_cache::clear()
+  {
+    for (uint i = 0; i < m_num_shards; i++)
+    {
+      shard &s = m_pShards[i]; std::lock_guard<std::mutex> lock(s.m_mutex);
+      while (s.m_pClock_hand) s.unlink(s.m_pClock_hand);
+      for (s.free_retired(); (s.m_pRetired) || (s.m_pGrace_retired); s.free_retired()) std::this_thread::yield();
+    }
+  }
+
+  void *compressed_cache::compress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags)
+  {
+    if (!pOut_len) return NULL; else *pOut_len = 0;
+    if ((src_buf_len) && (!pSrc_buf)) return NULL;
+    uint64 hash[2]; murmur3_128(pSrc_buf, src_buf_len, static_cast<uint32>(flags), hash);
+    shard &s = m_pShards[hash[0] % m_num_shards];
+
+    const uint epoch = s.begin_read();
+    for (compressed_cache_entry *pEntry = s.m_pBuckets[hash[1] & s.m_bucket_mask].load(); pEntry; pEntry = pEntry->m_pNext.load())
+    {
+      if ((pEntry->m_hash[0] != hash[0]) || (pEntry->m_hash[1] != hash[1]) || (pEntry->m_src_len != src_buf_len) || (pEntry->m_flags != flags)) continue;
+      pEntry->m_referenced.store(true, std::memory_order_relaxed);
+      void *pBuf = TDEFL_MALLOC(TDEFL_MAX(pEntry->m_comp_len, 1U));
+      if (pBuf) { memcpy(pBuf, pEntry->m_data, pEntry->m_comp_len); *pOut_len = pEntry->m_comp_len; }
+      s.end_read(epoch); s.m_num_hits.fetch_add(1, std::memory_order_relaxed);
+      return pBuf;
+    }
+    s.end_read(epoch); s.m_num_misses.fetch_add(1, std::memory_order_relaxed);
+
+    void *pComp_buf = tinydeflate::compress_mem_to_heap(pSrc_buf, src_buf_len, pOut_len, flags);
+    size_t entry_size = sizeof(compressed_cache_entry) + *pOut_len;
+    if ((!pComp_buf) || (entry_size > m_max_shard_bytes)) return pComp_buf;
+    compressed_cache_entry *pNew_entry = static_cast<compressed_cache_entry*>(TDEFL_MALLOC(entry_size));
+    if (!pNew_entry) return pComp_buf;
+    new (pNew_entry) compressed_cache_entry;
+    pNew_entry->m_referenced.store(false); pNew_entry->m_hash[0] = hash[0]; pNew_entry->m_hash[1] = hash[1];
+    pNew_entry->m_src_len = src_buf_len; pNew_entry->m_comp_len = *pOut_len; pNew_entry->m_flags = flags; memcpy(pNew_entry->m_data, pComp_buf, *pOut_len);
+
+    std::lock_guard<std::mutex> lock(s.m_mutex);
+    std::atomic<compressed_cache_entry*> &bucket = s.m_pBuckets[hash[1] & s.m_bucket_mask];
+    for (compressed_cache_entry *pEntry = bucket.load(); pEntry; pEntry = pEntry->m_pNext.load())
+    {
+      // Another thread cached the same input while we were compressing.
+      if ((pEntry->m_hash[0] == hash[0]) && (pEntry->m_hash[1] == hash[1]) && (pEntry->m_src_len == src_buf_len) && (pEntry->m_flags == flags)) { pNew_entry->~compressed_cache_entry(); TDEFL_FREE(pNew_entry); return pComp_buf; }
+    }
+    // CLOCK sweep: give referenced entries a second chance, evict the first unreferenced one, until the new entry fits.
+    while ((s.m_pClock_hand) && (s.m_size + entry_size > m_max_shard_bytes))
+    {
+      compressed_cache_entry *pVictim = s.m_pClock_hand;
+      if (pVictim->m_referenced.exchange(false, std::memory_order_relaxed)) s.m_pClock_hand = pVictim->m_pClock_next; else s.unlink(pVictim);
+    }
+    if (!s.m_pClock_hand) { pNew_entry->m_pClock_prev = pNew_entry->m_pClock_next = pNew_entry; s.m_pClock_hand = pNew_entry; }
+    else
+    {
+      // Insert just behind the hand, so the new entry is the last one the sweep reaches.
+      pNew_entry->m_pClock_next = s.m_pClock_hand; pNew_entry->m_pClock_prev = s.m_pClock_hand->m_pClock_prev;
+      pNew_entry->m_pClock_prev->m_pClock_next = pNew_entry; s.m_pClock_hand->m_pClock_prev = pNew_entry;
+    }
+    pNew_entry->m_pNext.store(bucket.load()); bucket.store(pNew_entry);
+    s.m_size += entry_size;
+    // Rather than go over budget, wait out the lookups that may still be using retired entries (they don't block on anything).
+    for (s.free_retired(); ((s.m_pRetired) || (s.m_pGrace_retired)) && (s.get_total_size() > m_max_shard_bytes); s.free_retired()) std::this_thread::yield();
+    return pComp_buf;
+  }
+
+  uint64 compressed_cache::get_num_hits() const { uint64 n = 0; for (uint i = 0; i < m_num_shards; i++) n += m_pShards[i].m_num_hits.load(std::memory_order_relaxed); return n; }
+  uint64 compressed_cache::get_num_misses() const { uint64 n = 0; for (uint i = 0; i < m_num_shards; i++) n += m_pShards[i].m_num_misses.load(std::memory_order_relaxed); return n; }
+  size_t compressed_cache::get_size_in_bytes() const
+  {
+    size_t n = 0; for (uint i = 0; i < m_num_shards; i++) { std::lock_guard<std::mutex> lock(m_pShards[i].m_mutex); n += m_pShards[i].get_total_size(); }
+    return n;
+  }
+
+  struct log_ring_slot
+  {
+    enum { PAYLOAD_SIZE = 56 };
+    // Set to the record's position + 1 (in slots, truncated to 32 bits) when it's published, in the record's first slot only.
+    std::atomic<uint32> m_seq;
+    uint32 m_len;
+    uint8 m_data[PAYLOAD_SIZE];
+  };
+
+  struct log_compressor::state
+  {
+    enum { BATCH_SIZE = 16U * 1024U };
+    log_ring_slot *m_pSlots;
+    uint m_slot_mask, m_flush_bytes, m_flush_interval_ms;
+    compressor *m_pComp;
+    uint8 *m_pBatch;
+    bool m_all_writes_succeeded;
+    std::thread m_thread;
+    std::atomic<uint64> m_num_dropped, m_num_flushes;
+    std::atomic<bool> m_closing, m_stop;
+    std::atomic<uint> m_num_appending;
+    // Padded so producers and the consumer each get a cache line to themselves (without needing an over-aligned new).
+    uint8 m_pad0[TDEFL_CACHE_LINE_SIZE]; std::atomic<uint64> m_head;
+    uint8 m_pad1[TDEFL_CACHE_LINE_SIZE]; std::atomic<uint64> m_tail;
+    uint8 m_pad2[TDEFL_CACHE_LINE_SIZE];
+
+    state() : m_pSlots(NULL), m_slot_mask(0), m_flush_bytes(0), m_flush_interval_ms(0), m_pComp(NULL), m_pBatch(NULL), m_all_writes_succeeded(true), m_num_dropped(0), m_num_flushes(0), m_closing(false), m_stop(false), m_num_appending(0), m_head(0), m_tail(0) { }
+    ~state() { TDEFL_DELETE [] m_pSlots; TDEFL_DELETE m_pComp; TDEFL_FREE(m_pBatch); }
+
+    bool append(const void *pRecord, uint len);
+    void run();
+  };
+
+  void log_compressor::state::run()
+  {
+    const uint64 flush_interval_ticks = (get_ticks_per_second() * m_flush_interval_ms) / 1000U;
+    const uint poll_ms = TDEFL_MIN(TDEFL_MAX(m_flush_interval_ms / 8U, 1U), 20U);
+    TDEFL_TRACE_THREAD_NAME("log_compressor");
+    uint64 tail = m_tail.load(std::memory_order_relaxed), oldest_pending_ticks = 0;
+    size_t batch_size = 0, num_pending = 0;
+    for ( ; ; )
+    {
+      // close() only sets the flag once every record is published, so the pass below drains them all.
+      bool stopping = m_stop.load(std::memory_order_acquire), drained_any = false;
+      for ( ; ; )
+      {
+        log_ring_slot &first = m_pSlots[tail & m_slot_mask];
+        if (first.m_seq.load(std::memory_order_acquire) != static_cast<uint32>(tail + 1)) break;
+        uint len = first.m_len, num_slots = TDEFL_MAX(1U, (len + log_ring_slot::PAYLOAD_SIZE - 1) / log_ring_slot::PAYLOAD_SIZE);
+        first.m_seq.store(0, std::memory_order_relaxed);
+        if (!num_pending) oldest_pending_ticks = get_ticks();
+        num_pending += len;
+        for (uint i = 0; i < num_slots; i++)
+        {
+          uint n = TDEFL_MIN(len, (uint)log_ring_slot::PAYLOAD_SIZE); len -= n;
+          if (batch_size + n > BATCH_SIZE) { m_tail.store(tail + i, std::memory_order_release); m_all_writes_succeeded = m_pComp->compress_data(m_pBatch, static_cast<uint>(batch_size)) && m_all_writes_succeeded; batch_size = 0; }
+          memcpy(m_pBatch + batch_size, m_pSlots[(tail + i) & m_slot_mask].m_data, n); batch_size += n;
+        }
+        tail += num_slots; drained_any = true;
+      }
+      // Freeing slots a batch at a time keeps the tail's cache line from bouncing between the consumer and the producers on every record.
+      m_tail.store(tail, std::memory_order_release);
+      if (batch_size) { m_all_writes_succeeded = m_pComp->compress_data(m_pBatch, static_cast<uint>(batch_size)) && m_all_writes_succeeded; batch_size = 0; }
+      if (stopping) break;
+      if ((num_pending) && ((num_pending >= m_flush_bytes) || (get_ticks() - oldest_pending_ticks >= flush_interval_ticks)))
+      {
+        m_all_writes_succeeded = m_pComp->flush(compressor::SYNC_FLUSH) && m_all_writes_succeeded;
+        m_num_flushes.fetch_add(1, std::memory_order_relaxed); num_pending = 0;
+      }
+      if (!drained_any) { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms)); }
+    }
+    m_all_writes_succeeded = m_pComp->compress_data(NULL, 0) && m_all_writes_succeeded;
+  }
+
+  log_compressor::log_compressor() : m_pState(NULL) { }
+  log_compressor::~log_compressor() { close(); TDEFL_DELETE m_pState; }
+
+  bool log_compressor::init(output_stream *pStream, int flags, uint ring_size, uint flush_bytes, uint flush_interval_ms)
+  {
+    close(); TDEFL_DELETE m_pState; m_pState = NULL;
+    uint num_slots = 1; while ((num_slots * sizeof(log_ring_slot) < ring_size) && (num_slots < 0x40000000U)) num_slots <<= 1;
+    state *pState = TDEFL_NEW state;
+    pState->m_pSlots = TDEFL_NEW log_ring_slot[num_slots]; pState->m_slot_mask = num_slots - 1;
+    pState->m_pComp = TDEFL_NEW compressor; pState->m_pBatch = static_cast<uint8*>(TDEFL_MALLOC(state::BATCH_SIZE));
+    pState->m_flush_bytes = flush_bytes; pState->m_flush_interval_ms = flush_interval_ms;
+    if ((!pState->m_pSlots) || (!pState->m_pComp) || (!pState->m_pBatch) || (!pState->m_pComp->init(pStream, flags))) { TDEFL_DELETE pState; return false; }
+    for (uint i = 0; i < num_slots; i++) pState->m_pSlots[i].m_seq.store(0, std::memory_order_relaxed);
+    pState->m_thread = std::thread(&state::run, pState);
+    m_pState = pState;
+    return true;
+  }
+
+  bool log_compressor::state::append(const void *pRecord, uint len)
+  {
+    uint num_slots = TDEFL_MAX(1U, (len + log_ring_slot::PAYLOAD_SIZE - 1) / log_ring_slot::PAYLOAD_SIZE);
+    if (num_slots > m_slot_mask + 1) return false;
+    uint64 pos = m_head.load(std::memory_order_relaxed);
+    do
+    {
+      // The acquire pairs with the consumer's release of the tail, so the slots it has freed are really free before they're written.
+      if (pos + num_slots - m_tail.load(std::memory_order_acquire) > m_slot_mask + 1) return false;
+    } while (!m_head.compare_exchange_weak(pos, pos + num_slots, std::memory_order_relaxed));
+    const uint8 *p = static_cast<const uint8*>(pRecord);
+    for (uint i = 0, left = len; i < num_slots; i++)
+    {
+      uint n = TDEFL_MIN(left, (uint)log_ring_slot::PAYLOAD_SIZE);
+      memcpy(m_pSlots[(pos + i) & m_slot_mask].m_data, p, n); p += n; left -= n;
+    }
+    log_ring_slot &first = m_pSlots[pos & m_slot_mask];
+    first.m_len = len; first.m_seq.store(static_cast<uint32>(pos + 1), std::memory_order_release);
+    return true;
+  }
+
+  bool log_compressor::append(const void *pRecord, uint len)
+  {
+    state *pState = m_pState; if (!pState) return false;
+    // Appends are counted while in flight, and close() waits for the ones that got past the m_closing check. The increment and the check are
+    // sequentially consistent, so either close() sees the count or the append sees the flag.
+    pState->m_num_appending.fetch_add(1);
+    const bool appended = (!pState->m_closing.load()) && (pState->append(pRecord, len));
+    if (!appended) pState->m_num_dropped.fetch_add(1, std::memory_order_relaxed);
+    pState->m_num_appending.fetch_sub(1, std::memory_order_release);
+    return appended;
+  }
+
+  // The state outlives close(), so late appends still find it (and are dropped).
+  bool log_compressor::close()
+  {
+    state *pState = m_pState; if (!pState) return true;
+    if (pState->m_thread.joinable())
+    {
+      pState->m_closing.store(true);
+      while (pState->m_num_appending.load(std::memory_order_acquire)) std::this_thread::yield();
+      pState->m_stop.store(true, std::memory_order_release); pState->m_thread.join();
+    }
+    return pState->m_all_writes_succeeded;
+  }
+
+  uint64 log_compressor::get_num_dropped() const { return m_pState ? m_pState->m_num_dropped.load(std::memory_order_relaxed) : 0; }
+  uint64 log_compressor::get_num_flushes() const { return m_pState ? m_pState->m_num_flushes.load(std::memory_order_relaxed) : 0; }
+
+  // ------------------- transcode_stream
+  enum { TRANSCODE_SAMPLE_SIZE = 256U * 1024U, TRANSCODE_MAX_SAMPLE_OUT_SIZE = 1024U * 1024U, TRANSCODE_PIPE_SIZE = 1024U * 1024U, TRANSCODE_CHUNK_SIZE = 64U * 1024U };
+
+  // Bounded buffer between the decompressor's thread (the writer) and the compressor's. Either side can abort, which wakes the other.
+  struct transcode_pipe : public output_stream
+  {
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty, m_not_full;
+    uint8 *m_pBuf;
+    size_t m_head, m_size;
+    bool m_closed, m_aborted;
+
+    transcode_pipe() : m_pBuf(static_cast<uint8*>(TDEFL_MALLOC(TRANSCODE_PIPE_SIZE))), m_head(0), m_size(0), m_closed(false), m_aborted(m_pBuf == NULL) { }
+    virtual ~transcode_pipe() { TDEFL_FREE(m_pBuf); }
+
+    virtual bool put_buf(const void *pBuf, int len)
+    {
+      const uint8 *pSrc = static_cast<const uint8*>(pBuf);
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (len > 0)
+      {
+        while ((!m_aborted) && (m_size == TRANSCODE_PIPE_SIZE)) { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); m_not_full.wait(lock); }
+        if (m_aborted) return false;
+        size_t tail = (m_head + m_size) % TRANSCODE_PIPE_SIZE, n = TDEFL_MIN(TDEFL_MIN(static_cast<size_t>(len), TRANSCODE_PIPE_SIZE - m_size), TRANSCODE_PIPE_SIZE - tail);
+        memcpy(m_pBuf + tail, pSrc, n); pSrc += n; len -= static_cast<int>(n); m_size += n;
+        m_not_empty.notify_one();
+      }
+      return true;
+    }
+
+    // Returns 0 once the writer has closed the pipe and it's drained, or when either side aborted.
+    size_t get_buf(uint8 *pDst, size_t max_len)
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while ((!m_aborted) && (!m_closed) && (!m_size)) { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); m_not_empty.wait(lock); }
+      if (m_aborted) return 0;
+      size_t n = TDEFL_MIN(TDEFL_MIN(max_len, m_size), TRANSCODE_PIPE_SIZE - m_head);
+      memcpy(pDst, m_pBuf + m_head, n); m_head = (m_head + n) % TRANSCODE_PIPE_SIZE; m_size -= n;
+      m_not_full.notify_one();
+      return n;
+    }
+
+    void close(bool aborted) { std::lock_guard<std::mutex> lock(m_mutex); m_closed = true; m_aborted = m_aborted || aborted; m_not_empty.notify_all(); m_not_full.notify_all(); }
+  };
+
+  // Serves the sample read ahead of time, then the rest of the input.
+  struct transcode_input_stream : public input_stream
+  {
+    buffer_input_stream m_sample;
+    input_stream *m_pRest;
+    transcode_input_stream(const void *pSample, size_t sample_len, input_stream *pRest) : m_sample(pSample, sample_len), m_pRest(pRest) { }
+    virtual int get_buf(void *pBuf, int max_len) { int n = m_sample.get_buf(pBuf, max_len); return n ? n : m_pRest->get_buf(pBuf, max_len); }
+  };
+
+  // Keeps the first max_size bytes written to it, then fails, which stops the decompressor.
+  struct transcode_sample_stream : public output_stream
+  {
+    expandable_malloc_output_stream m_buf;
+    virtual bool put_buf(const void *pBuf, int len)
+    {
+      size_t n = TDEFL_MIN(static_cast<size_t>(len), TRANSCODE_MAX_SAMPLE_OUT_SIZE - m_buf.get_size());
+      return (m_buf.put_buf(pBuf, static_cast<int>(n))) && (n == static_cast<size_t>(len));
+    }
+  };
+
+  // Discards the data written to it, keeping its size and checksums.
+  struct transcode_checksum_stream : public output_stream
+  {
+    uint m_format; uint32 m_checksum; uint64 m_size;
+    transcode_checksum_stream(uint format) : m_format(format), m_checksum((format == decompressor::FORMAT_ZLIB) ? 1 : 0), m_size(0) { }
+    virtual bool put_buf(const void *pBuf, int len)
+    {
+      const uint8 *p = static_cast<const uint8*>(pBuf);
+      if (m_format == decompressor::FORMAT_ZLIB) m_checksum = adler32(p, len, m_checksum); else if (m_format == decompressor::FORMAT_GZIP) m_checksum = crc32(p, len, m_checksum);
+      m_size += len; return true;
+    }
+  };
+
+  struct transcode_decode_job
+  {
+    decompressor *m_pDecomp; input_stream *m_pIn; transcode_pipe *m_pPipe; uint m_format; bool m_succeeded;
+    void run() { TDEFL_TRACE_THREAD_NAME("transcode_stream decoder"); m_succeeded = m_pDecomp->decompress(m_pIn, m_pPipe, m_format); m_pPipe->close(!m_succeeded); }
+  };
+
+  static bool transcode_write_header(output_stream *pOut, uint format)
+  {
+    if (format == decompressor::FORMAT_ZLIB) return pOut->put_buf("\x78\x01", 2);
+    if (format == decompressor::FORMAT_GZIP) return write_gzip_header(pOut);
+    return true;
+  }
+
+  static bool transcode_write_trailer(output_stream *pOut, uint format, uint32 checksum, uint64 size)
+  {
+    uint8 trailer[8];
+    if (format == decompressor::FORMAT_ZLIB) { for (uint i = 0; i < 4; i++) trailer[i] = static_cast<uint8>(checksum >> (24 - i * 8)); return pOut->put_buf(trailer, 4); }
+    if (format == decompressor::FORMAT_GZIP) return write_gzip_trailer(pOut, checksum, size);
+    return true;
+  }
+
+  struct transcode_count_stream : public output_stream { uint64 m_size; transcode_count_stream() : m_size(0) { } virtual bool put_buf(const void *, int len) { m_size += len; return true; } };
+
+  bool transcode_stream(input_stream *pIn, output_stream *pOut, uint in_format, uint out_format, int flags, uint min_gain_percent, bool *pRecompressed)
+  {
+    if (pRecompressed) *pRecompressed = false;
+    if ((!pIn) || (!pOut) || (in_format > decompressor::FORMAT_AUTO) || (out_format > decompressor::FORMAT_GZIP)) return false;
+    flags &= ~WRITE_ZLIB_HEADER;
+
+    // Estimate the gain from the sample: its decompressed data recompressed, against the input it took.
+    uint8 *pSample = static_cast<uint8*>(TDEFL_MALLOC(TRANSCODE_SAMPLE_SIZE)); decompressor *pDecomp = TDEFL_NEW decompressor;
+    if ((!pSample) || (!pDecomp)) { TDEFL_FREE(pSample); TDEFL_DELETE pDecomp; return false; }
+    size_t sample_len = 0; int n = 0;
+    while ((sample_len < TRANSCODE_SAMPLE_SIZE) && ((n = pIn->get_buf(pSample + sample_len, static_cast<int>(TRANSCODE_SAMPLE_SIZE - sample_len))) > 0)) sample_len += n;
+    bool succeeded = (n >= 0), recompress = true;
+    if (succeeded)
+    {
+      buffer_input_stream sample_in(pSample, sample_len); transcode_sample_stream sample_out;
+      pDecomp->decompress(&sample_in, &sample_out, in_format); in_format = pDecomp->get_format();
+      if (sample_out.m_buf.get_size())
+      {
+        transcode_count_stream count_stream;
+        compress_mem_to_output_stream(sample_out.m_buf.get_buf(), sample_out.m_buf.get_size(), &count_stream, flags);
+        recompress = count_stream.m_size * 100U < pDecomp->get_total_in() * (100U - TDEFL_MIN(min_gain_percent, 100U));
+      }
+    }
+
+    transcode_input_stream in(pSample, sample_len, pIn);
+    if ((succeeded) && (!recompress) && (in_format == out_format))
+    {
+      // Same container: copy the input as is.
+      succeeded = pOut->put_buf(pSample, static_cast<int>(sample_len));
+      while ((succeeded) && ((n = pIn->get_buf(pSample, TRANSCODE_SAMPLE_SIZE)) > 0)) succeeded = pOut->put_buf(pSample, n);
+      succeeded = (succeeded) && (n == 0);
+    }
+    else if ((succeeded) && (!recompress))
+    {
+      // Rewrap the deflate data, which still has to be decompressed for the new container's checksum.
+      transcode_checksum_stream checksum_stream(out_format);
+      succeeded = (transcode_write_header(pOut, out_format)) && (pDecomp->decompress(&in, &checksum_stream, in_format, pOut)) &&
+        (transcode_write_trailer(pOut, out_format, checksum_stream.m_checksum, checksum_stream.m_size));
+    }
+    else if (succeeded)
+    {
+      if (pRecompressed) *pRecompressed = true;
+      transcode_pipe pipe; transcode_decode_job job = { pDecomp, &in, &pipe, in_format, false };
+      compressor *pComp = TDEFL_NEW compressor; uint8 *pChunk = static_cast<uint8*>(TDEFL_MALLOC(TRANSCODE_CHUNK_SIZE));
+      // The compressor writes the zlib header and trailer itself.
+      succeeded = (pComp) && (pChunk) && (!pipe.m_aborted) && ((out_format != decompressor::FORMAT_GZIP) || (transcode_write_header(pOut, out_format))) &&
+        (pComp->init(pOut, flags | ((out_format == decompressor::FORMAT_ZLIB) ? static_cast<int>(WRITE_ZLIB_HEADER) : 0)));
+      if (succeeded)
+      {
+        std::thread decode_thread(&transcode_decode_job::run, &job);
+        uint32 crc = 0; uint64 size = 0;
+        for (size_t chunk_len; (chunk_len = pipe.get_buf(pChunk, TRANSCODE_CHUNK_SIZE)) != 0; size += chunk_len)
+        {
+          if (out_format == decompressor::FORMAT_GZIP) { TDEFL_TRACE_SPAN(checksum_span, TRACE_CHECKSUM); crc = crc32(pChunk, chunk_len, crc); }
+          if (!pComp->compress_data(pChunk, static_cast<uint>(chunk_len))) { pipe.close(true); break; }
+        }
+        decode_thread.join();
+        succeeded = (job.m_succeeded) && (pComp->compress_data(NULL, 0)) && ((out_format != decompressor::FORMAT_GZIP) || (transcode_write_trailer(pOut, out_format, crc, size)));
+      }
+      TDEFL_DELETE pComp; TDEFL_FREE(pChunk);
+    }
+    TDEFL_FREE(pSample); TDEFL_DELETE pDecomp;
+    return succeeded;
+  }
+  // ------------------- compressed_arena
+  // Pages hold their objects back to back, each behind an 8 byte header (its index in the object table and its length) and padded to 8 bytes, so
+  // compaction can walk a page. A hot page's m_pComp copy is kept while it's clean, so evicting it again costs nothing.
+  struct arena_page
+  {
+    uint8 *m_pHot, *m_pComp;
+    uint m_size, m_used, m_live_bytes, m_comp_len, m_pin_count, m_lru_prev, m_lru_next;
+    bool m_in_use, m_dirty, m_stored;
+  };
+
+  // Free entries are chained through m_ofs. m_gen is bumped on release, so stale handles don't match.
+  struct arena_object { uint m_page, m_ofs, m_len, m_gen; };
+
+  struct compressed_arena::state
+  {
+    enum { NONE = 0xFFFFFFFFU, OBJECT_HEADER_SIZE = 8, COMPACT_MAX_LIVE_PERCENT = 50 };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::thread m_thread;
+    bool m_stop;
+    uint m_page_size, m_max_hot_pages, m_compaction_interval_ms;
+    int m_flags;
+    // Free pages are chained through m_lru_next.
+    arena_page *m_pPages;
+    uint m_num_pages, m_free_page, m_open_page, m_lru_head, m_lru_tail, m_num_hot;
+    arena_object *m_pObjects;
+    uint m_num_objects, m_free_object;
+    compressor *m_pComp;
+    decompressor *m_pDecomp;
+    uint8 *m_pComp_buf, *m_pCompact_buf;
+    uint m_comp_buf_size, m_compact_buf_size;
+    stats m_stats;
+
+    state() : m_stop(false), m_page_size(0), m_max_hot_pages(0), m_compaction_interval_ms(0), m_flags(0), m_pPages(NULL), m_num_pages(0), m_free_page(NONE), m_open_page(NONE), m_lru_head(NONE), m_lru_tail(NONE), m_num_hot(0),
+      m_pObjects(NULL), m_num_objects(0), m_free_object(NONE), m_pComp(NULL), m_pDecomp(NULL), m_pComp_buf(NULL), m_pCompact_buf(NULL), m_comp_buf_size(0), m_compact_buf_size(0) { memset(&m_stats, 0, sizeof(m_stats)); }
+    ~state()
+    {
+      for (uint i = 0; i < m_num_pages; i++) { TDEFL_FREE(m_pPages[i].m_pHot); TDEFL_FREE(m_pPages[i].m_pComp); }
+      TDEFL_FREE(m_pPages); TDEFL_FREE(m_pObjects); TDEFL_DELETE m_pComp; TDEFL_DELETE m_pDecomp; TDEFL_FREE(m_pComp_buf); TDEFL_FREE(m_pCompact_buf);
+    }
+
+    static inline uint padded_size(uint len) { return OBJECT_HEADER_SIZE + ((len + 7U) & ~7U); }
+    static bool reserve(uint8 *&pBuf, uint &size, uint needed)
+    {
+      if (needed <= size) return true;
+      uint8 *pNew = static_cast<uint8*>(TDEFL_REALLOC(pBuf, needed)); if (!pNew) return false;
+      pBuf = pNew; size = needed; return true;
+    }
+
+    uint lookup(handle h) const
+    {
+      uint obj = static_cast<uint>(h & 0xFFFFFFFFU) - 1U;
+      return ((obj < m_num_objects) && (m_pObjects[obj].m_page != NONE) && (m_pObjects[obj].m_gen == static_cast<uint>(h >> 32))) ? obj : NONE;
+    }
+
+    void lru_unlink(uint index)
+    {
+      arena_page &p = m_pPages[index];
+      if (p.m_lru_prev != NONE) m_pPages[p.m_lru_prev].m_lru_next = p.m_lru_next; else m_lru_head = p.m_lru_next;
+      if (p.m_lru_next != NONE) m_pPages[p.m_lru_next].m_lru_prev = p.m_lru_prev; else m_lru_tail = p.m_lru_prev;
+    }
+
+    void lru_link_front(uint index)
+    {
+      arena_page &p = m_pPages[index]; p.m_lru_prev = NONE; p.m_lru_next = m_lru_head;
+      if (m_lru_head != NONE) m_pPages[m_lru_head].m_lru_prev = index; else m_lru_tail = index;
+      m_lru_head = index;
+    }
+
+    uint alloc_object()
+    {
+      if (m_free_object == NONE)
+      {
+        uint new_num = TDEFL_MAX(256U, m_num_objects * 2U); if (new_num <= m_num_objects) return NONE;
+        arena_object *pNew = static_cast<arena_object*>(TDEFL_REALLOC(m_pObjects, new_num * sizeof(arena_object))); if (!pNew) return NONE;
+        m_pObjects = pNew;
+        for (uint i = new_num; i > m_num_objects; i--) { arena_object &o = m_pObjects[i - 1]; o.m_page = NONE; o.m_len = 0; o.m_gen = 1; o.m_ofs = m_free_object; m_free_object = i - 1; }
+        m_num_objects = new_num;
+      }
+      uint obj = m_free_object; m_free_object = m_pObjects[obj].m_ofs;
+      return obj;
+    }
+
+    void free_object(uint obj)
+    {
+      arena_object &o = m_pObjects[obj]; o.m_page = NONE; o.m_gen++; o.m_ofs = m_free_object; m_free_object = obj;
+    }
+
+    // New pages start hot and dirty, at the front of the LRU.
+    uint alloc_page(uint size)
+    {
+      if (m_free_page == NONE)
+      {
+        uint new_num = TDEFL_MAX(16U, m_num_pages * 2U);
+        arena_page *pNew = static_cast<arena_page*>(TDEFL_REALLOC(m_pPages, new_num * sizeof(arena_page))); if (!pNew) return NONE;
+        m_pPages = pNew;
+        for (uint i = new_num; i > m_num_pages; i--) { arena_page &p = m_pPages[i - 1]; memset(&p, 0, sizeof(p)); p.m_lru_next = m_free_page; m_free_page = i - 1; }
+        m_num_pages = new_num;
+      }
+      uint8 *pHot = static_cast<uint8*>(TDEFL_MALLOC(size)); if (!pHot) return NONE;
+      uint index = m_free_page; arena_page &p = m_pPages[index]; m_free_page = p.m_lru_next;
+      memset(&p, 0, sizeof(p)); p.m_pHot = pHot; p.m_size = size; p.m_in_use = true; p.m_dirty = true;
+      lru_link_front(index); m_num_hot++; m_stats.m_hot_bytes += size;
+      return index;
+    }
+
+    void free_page(uint index)
+    {
+      arena_page &p = m_pPages[index];
+      if (p.m_pHot) { lru_unlink(index); TDEFL_FREE(p.m_pHot); m_num_hot--; m_stats.m_hot_bytes -= p.m_size; }
+      TDEFL_FREE(p.m_pComp); m_stats.m_compressed_bytes -= p.m_comp_len;
+      if (m_open_page == index) m_open_page = NONE;
+      memset(&p, 0, sizeof(p)); p.m_lru_next = m_free_page; m_free_page = index;
+    }
+
+    // Brings a page's compressed copy up to date. Pages that don't compress are kept as is.
+    bool compress_page(arena_page &p)
+    {
+      if ((!p.m_dirty) && (p.m_pComp)) return true;
+      if ((!reserve(m_pComp_buf, m_comp_buf_size, p.m_used)) || ((!m_pComp) && ((m_pComp = TDEFL_NEW compressor) == NULL))) return false;
+      buffer_output_stream out(m_pComp_buf, p.m_used);
+      bool stored = (!m_pComp->init(&out, m_flags & ~WRITE_ZLIB_HEADER)) || (!m_pComp->compress_data(p.m_pHot, p.m_used)) || (!m_pComp->compress_data(NULL, 0));
+      uint comp_len = stored ? p.m_used : static_cast<uint>(out.get_size());
+      uint8 *pComp = static_cast<uint8*>(TDEFL_MALLOC(TDEFL_MAX(comp_len, 1U))); if (!pComp) return false;
+      memcpy(pComp, stored ? p.m_pHot : m_pComp_buf, comp_len);
+      TDEFL_FREE(p.m_pComp); m_stats.m_compressed_bytes += comp_len; m_stats.m_compressed_bytes -= p.m_comp_len;
+      p.m_pComp = pComp; p.m_comp_len = comp_len; p.m_stored = stored; p.m_dirty = false;
+      return true;
+    }
+
+    bool decompress_page(const arena_page &p, uint8 *pDst)
+    {
+      if (p.m_stored) { memcpy(pDst, p.m_pComp, p.m_used); return true; }
+      if ((!m_pDecomp) && ((m_pDecomp = TDEFL_NEW decompressor) == NULL)) return false;
+      buffer_input_stream in(p.m_pComp, p.m_comp_len); buffer_output_stream out(pDst, p.m_used);
+      return (m_pDecomp->decompress(&in, &out, decompressor::FORMAT_RAW)) && (out.get_size() == p.m_used);
+    }
+
+    // Compresses the least recently used pages out of the hot set until it's back to its size. Pinned pages, the open page and keep stay.
+    void evict_excess(uint keep)
+    {
+      for (uint index = m_lru_tail; (m_num_hot > m_max_hot_pages) && (index != NONE); )
+      {
+        arena_page &p = m_pPages[index]; uint prev = p.m_lru_prev;
+        if ((!p.m_pin_count) && (index != m_open_page) && (index != keep) && (compress_page(p)))
+        {
+          lru_unlink(index); TDEFL_FREE(p.m_pHot); p.m_pHot = NULL; m_num_hot--; m_stats.m_hot_bytes -= p.m_size; m_stats.m_num_evictions++;
+        }
+        index = prev;
+      }
+    }
+
+    uint8 *make_hot(uint index)
+    {
+      arena_page &p = m_pPages[index];
+      if (p.m_pHot) { lru_unlink(index); lru_link_front(index); m_stats.m_num_hits++; return p.m_pHot; }
+      uint8 *pHot = static_cast<uint8*>(TDEFL_MALLOC(p.m_size)); if (!pHot) return NULL;
+      if (!decompress_page(p, pHot)) { TDEFL_FREE(pHot); return NULL; }
+      p.m_pHot = pHot; lru_link_front(index); m_num_hot++; m_stats.m_hot_bytes += p.m_size; m_stats.m_num_misses++;
+      evict_excess(index);
+      return pHot;
+    }
+
+    // Appends an object to the open page (or to a page of its own, if it doesn't fit in one), and points its table entry there.
+    bool place_object(uint obj, const void *pData, uint len)
+    {
+      uint size = padded_size(len), index;
+      if (size > m_page_size) { if ((index = alloc_page(size)) == NONE) return false; }
+      else
+      {
+        if ((m_open_page == NONE) || (m_pPages[m_open_page].m_used + size > m_page_size)) { m_open_page = NONE; if ((m_open_page = alloc_page(m_page_size)) == NONE) return false; }
+        index = m_open_page;
+      }
+      arena_page &p = m_pPages[index];
+      uint8 *pDst = p.m_pHot + p.m_used; uint32 hdr[2] = { obj, len };
+      memcpy(pDst, hdr, OBJECT_HEADER_SIZE); memcpy(pDst + OBJECT_HEADER_SIZE, pData, len); memset(pDst + OBJECT_HEADER_SIZE + len, 0, size - OBJECT_HEADER_SIZE - len);
+      arena_object &o = m_pObjects[obj]; o.m_page = index; o.m_ofs = p.m_used + OBJECT_HEADER_SIZE; o.m_len = len;
+      p.m_used += size; p.m_live_bytes += size; p.m_dirty = true;
+      evict_excess(index);
+      return true;
+    }
+
+    // Drops an object's bytes from its page, freeing the page once nothing in it is live or pinned (the open page is just emptied).
+    void remove_from_page(uint index, uint size)
+    {
+      arena_page &p = m_pPages[index]; p.m_live_bytes -= size;
+      if ((p.m_live_bytes) || (p.m_pin_count)) return;
+      if (index == m_open_page) p.m_used = 0; else free_page(index);
+    }
+
+    void compact()
+    {
+      for (uint index = 0; ; index++)
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (index >= m_num_pages) break;
+        // Only cold pages: hot ones may be pinned, and cost no compressed memory.
+        const arena_page &p = m_pPages[index];
+        if ((!p.m_in_use) || (p.m_pHot) || (p.m_live_bytes * 100ULL >= p.m_used * static_cast<uint64>(COMPACT_MAX_LIVE_PERCENT))) continue;
+        const uint used = p.m_used;
+        if ((!reserve(m_pCompact_buf, m_compact_buf_size, used)) || (!decompress_page(p, m_pCompact_buf))) continue;
+        // place_object() may grow the page array, so p isn't used past here.
+        for (uint ofs = 0; ofs < used; )
+        {
+          uint32 hdr[2]; memcpy(hdr, m_pCompact_buf + ofs, OBJECT_HEADER_SIZE);
+          const uint obj = hdr[0], len = hdr[1], size = padded_size(len);
+          if ((obj < m_num_objects) && (m_pObjects[obj].m_page == index) && (m_pObjects[obj].m_ofs == ofs + OBJECT_HEADER_SIZE))
+          {
+            if (!place_object(obj, m_pCompact_buf + ofs + OBJECT_HEADER_SIZE, len)) break;
+            remove_from_page(index, size);
+            // Freed with its last live object: stop before the index can be reused.
+            if (!m_pPages[index].m_in_use) break;
+          }
+          ofs += size;
+        }
+        m_stats.m_num_compacted_pages++;
+      }
+    }
+
+    void run()
+    {
+      TDEFL_TRACE_THREAD_NAME("compressed_arena compactor");
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (!m_stop)
       {
-        TDEFL_RLE_ZERO_CODE_SIZE();
-        if (code_size != prev_code_size)
+        { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); m_wake.wait_for(lock, std::chrono::milliseconds(m_compaction_interval_ms)); }
+        if (m_stop) break;
+        lock.unlock(); compact(); lock.lock();
+      }
+    }
+  };
+
+  compressed_arena::compressed_arena() : m_pState(NULL) { }
+  compressed_arena::~compressed_arena() { deinit(); }
+
+  bool compressed_arena::init(uint page_size, uint max_hot_pages, int flags, uint compaction_interval_ms)
+  {
+    deinit();
+    if ((page_size < MIN_PAGE_SIZE) || (page_size > MAX_PAGE_SIZE)) return false;
+    state *pState = TDEFL_NEW state; if (!pState) return false;
+    pState->m_page_size = page_size; pState->m_max_hot_pages = TDEFL_MAX(max_hot_pages, 1U); pState->m_flags = flags; pState->m_compaction_interval_ms = compaction_interval_ms;
+    if (compaction_interval_ms) pState->m_thread = std::thread(&state::run, pState);
+    m_pState = pState;
+    return true;
+  }
+
+  void compressed_arena::deinit()
+  {
+    state *pState = m_pState; if (!pState) return;
+    if (pState->m_thread.joinable())
+    {
+      { std::lock_guard<std::mutex> lock(pState->m_mutex); pState->m_stop = true; pState->m_wake.notify_all(); }
+      pState->m_thread.join();
+    }
+    TDEFL_DELETE pState; m_pState = NULL;
+  }
+
+  compressed_arena::handle compressed_arena::store(const void *pBuf, size_t len)
+  {
+    state *pState = m_pState;
+    if ((!pState) || ((len) && (!pBuf)) || (len > 0x7FFFFFF0U)) return 0;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->alloc_object(); if (obj == state::NONE) return 0;
+    if (!pState->place_object(obj, pBuf, static_cast<uint>(len))) { pState->free_object(obj); return 0; }
+    pState->m_stats.m_num_objects++; pState->m_stats.m_object_bytes += len;
+    return (static_cast<uint64>(pState->m_pObjects[obj].m_gen) << 32) | (obj + 1U);
+  }
+
+  bool compressed_arena::release(handle h)
+  {
+    state *pState = m_pState; if (!pState) return false;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->lookup(h); if (obj == state::NONE) return false;
+    const arena_object &o = pState->m_pObjects[obj];
+    pState->m_stats.m_num_objects--; pState->m_stats.m_object_bytes -= o.m_len;
+    pState->remove_from_page(o.m_page, state::padded_size(o.m_len));
+    pState->free_object(obj);
+    return true;
+  }
+
+  size_t compressed_arena::get_size(handle h)
+  {
+    state *pState = m_pState; if (!pState) return 0;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->lookup(h);
+    return (obj == state::NONE) ? 0 : pState->m_pObjects[obj].m_len;
+  }
+
+  bool compressed_arena::read(handle h, void *pDst, size_t dst_len)
+  {
+    state *pState = m_pState; if (!pState) return false;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->lookup(h); if ((obj == state::NONE) || (dst_len < pState->m_pObjects[obj].m_len)) return false;
+    const arena_object &o = pState->m_pObjects[obj];
+    const uint8 *pHot = pState->make_hot(o.m_page); if (!pHot) return false;
+    memcpy(pDst, pHot + o.m_ofs, o.m_len);
+    return true;
+  }
+
+  void *compressed_arena::lock(handle h, size_t *pLen)
+  {
+    if (pLen) *pLen = 0;
+    state *pState = m_pState; if (!pState) return NULL;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->lookup(h); if (obj == state::NONE) return NULL;
+    const arena_object &o = pState->m_pObjects[obj];
+    uint8 *pHot = pState->make_hot(o.m_page); if (!pHot) return NULL;
+    pState->m_pPages[o.m_page].m_pin_count++;
+    if (pLen) *pLen = o.m_len;
+    return pHot + o.m_ofs;
+  }
+
+  void compressed_arena::unlock(handle h, bool modified)
+  {
+    state *pState = m_pState; if (!pState) return;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->lookup(h); if (obj == state::NONE) return;
+    const uint index = pState->m_pObjects[obj].m_page; arena_page &p = pState->m_pPages[index];
+    if (p.m_pin_count) p.m_pin_count--;
+    // A stale compressed copy is only dead weight until the page is evicted and compressed again.
+    if (modified) { p.m_dirty = true; TDEFL_FREE(p.m_pComp); p.m_pComp = NULL; pState->m_stats.m_compressed_bytes -= p.m_comp_len; p.m_comp_len = 0; }
+    if (!p.m_pin_count) pState->evict_excess(state::NONE);
+  }
+
+  void compressed_arena::compact()
+  {
+    if (m_pState) m_pState->compact();
+  }
+
+  compressed_arena::stats compressed_arena::get_stats()
+  {
+    stats s; memset(&s, 0, sizeof(s));
+    state *pState = m_pState; if (!pState) return s;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    return pState->m_stats;
+  }
+
+  // ------------------- tiered_store
+  static void lower_thread_priority()
+  {
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(SCHED_IDLE)
+    sched_param param; memset(&param, 0, sizeof(param)); pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+  }
+
+  static uint64 get_thread_cpu_usecs()
+  {
+#ifdef _WIN32
+    FILETIME c, e, k, u; if (!GetThreadTimes(GetCurrentThread(), &c, &e, &k, &u)) return 0;
+    return (((static_cast<uint64>(k.dwHighDateTime) << 32) | k.dwLowDateTime) + ((static_cast<uint64>(u.dwHighDateTime) << 32) | u.dwLowDateTime)) / 10U;
+#else
+    timespec t; if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t)) return 0;
+    return static_cast<uint64>(t.tv_sec) * 1000000ULL + static_cast<uint64>(t.tv_nsec) / 1000U;
+#endif
+  }
+
+  // A compressed stream. Readers and the background threads hold a reference while they use it outside the lock, so it can be swapped out meanwhile.
+  struct tiered_blob { uint m_refs; uint m_len; uint8 *m_pData; };
+
+  // Free entries are chained through m_next_free. m_gen is bumped on remove, so stale handles don't match.
+  struct tiered_object { tiered_blob *m_pBlob; size_t m_size; uint m_gen, m_next_free; };
+
+  struct tiered_store::state
+  {
+    enum { NONE = 0xFFFFFFFFU };
+
+    std::mutex m_mutex;
+    std::condition_variable m_work, m_idle;
+    std::thread *m_pThreads;
+    uint m_num_threads, m_busy;
+    bool m_stop;
+    int m_fast_flags, m_slow_flags;
+    uint m_min_gain_percent, m_min_savings_per_cpu_ms;
+    tiered_object *m_pObjects;
+    uint m_num_objects, m_free_object;
+    // Circular queue of handles to recompress. Removed objects are skipped when they come up.
+    handle *m_pQueue;
+    uint m_queue_size, m_queue_head, m_queue_count;
+    uint64 m_window_cpu_usecs, m_window_saved, m_num_probed;
+    stats m_stats;
+
+    state() : m_pThreads(NULL), m_num_threads(0), m_busy(0), m_stop(false), m_fast_flags(0), m_slow_flags(0), m_min_gain_percent(0), m_min_savings_per_cpu_ms(0), m_pObjects(NULL), m_num_objects(0), m_free_object(NONE),
+      m_pQueue(NULL), m_queue_size(0), m_queue_head(0), m_queue_count(0), m_window_cpu_usecs(0), m_window_saved(0), m_num_probed(0) { memset(&m_stats, 0, sizeof(m_stats)); }
+    ~state()
+    {
+      for (uint i = 0; i < m_num_objects; i++) if (m_pObjects[i].m_pBlob) release_blob(m_pObjects[i].m_pBlob);
+      TDEFL_FREE(m_pObjects); TDEFL_FREE(m_pQueue);
+    }
+
+    static tiered_blob *new_blob(void *pData, size_t len)
+    {
+      tiered_blob *pBlob = static_cast<tiered_blob*>(TDEFL_MALLOC(sizeof(tiered_blob))); if (!pBlob) return NULL;
+      // Output streams grow by doubling, so give back the slack before the stream is kept for a long time.
+      void *pShrunk = TDEFL_REALLOC(pData, TDEFL_MAX(len, 1U));
+      pBlob->m_refs = 1; pBlob->m_len = static_cast<uint>(len); pBlob->m_pData = static_cast<uint8*>(pShrunk ? pShrunk : pData);
+      return pBlob;
+    }
+    static void release_blob(tiered_blob *pBlob) { if (!--pBlob->m_refs) { TDEFL_FREE(pBlob->m_pData); TDEFL_FREE(pBlob); } }
+
+    uint lookup(handle h) const
+    {
+      uint obj = static_cast<uint>(h & 0xFFFFFFFFU) - 1U;
+      return ((obj < m_num_objects) && (m_pObjects[obj].m_pBlob) && (m_pObjects[obj].m_gen == static_cast<uint>(h >> 32))) ? obj : NONE;
+    }
+
+    uint alloc_object()
+    {
+      if (m_free_object == NONE)
+      {
+        uint new_num = TDEFL_MAX(256U, m_num_objects * 2U); if (new_num <= m_num_objects) return NONE;
+        tiered_object *pNew = static_cast<tiered_object*>(TDEFL_REALLOC(m_pObjects, new_num * sizeof(tiered_object))); if (!pNew) return NONE;
+        m_pObjects = pNew;
+        for (uint i = new_num; i > m_num_objects; i--) { tiered_object &o = m_pObjects[i - 1]; o.m_pBlob = NULL; o.m_size = 0; o.m_gen = 1; o.m_next_free = m_free_object; m_free_object = i - 1; }
+        m_num_objects = new_num;
+      }
+      uint obj = m_free_object; m_free_object = m_pObjects[obj].m_next_free;
+      return obj;
+    }
+
+    void free_object(uint obj)
+    {
+      tiered_object &o = m_pObjects[obj]; release_blob(o.m_pBlob); o.m_pBlob = NULL; o.m_gen++; o.m_next_free = m_free_object; m_free_object = obj;
+    }
+
+    bool push_queue(handle h)
+    {
+      if (m_queue_count == m_queue_size)
+      {
+        uint new_size = TDEFL_MAX(256U, m_queue_size * 2U); if (new_size <= m_queue_size) return false;
+        handle *pNew = static_cast<handle*>(TDEFL_MALLOC(new_size * sizeof(handle))); if (!pNew) return false;
+        for (uint i = 0; i < m_queue_count; i++) pNew[i] = m_pQueue[(m_queue_head + i) & (m_queue_size - 1U)];
+        TDEFL_FREE(m_pQueue); m_pQueue = pNew; m_queue_size = new_size; m_queue_head = 0;
+      }
+      m_pQueue[(m_queue_head + m_queue_count) & (m_queue_size - 1U)] = h; m_queue_count++;
+      return true;
+    }
+
+    // Called with the lock held, after each recompression.
+    void update_policy(uint64 cpu_usecs, uint64 saved)
+    {
+      m_stats.m_cpu_usecs += cpu_usecs; m_window_cpu_usecs += cpu_usecs; m_window_saved += saved;
+      if (m_window_cpu_usecs < POLICY_WINDOW_USECS) return;
+      m_stats.m_paused = (m_window_saved * 1000U) < (static_cast<uint64>(m_min_savings_per_cpu_ms) * m_window_cpu_usecs);
+      m_window_cpu_usecs = m_window_saved = 0;
+    }
+
+    void run()
+    {
+      lower_thread_priority(); TDEFL_TRACE_THREAD_NAME("tiered_store worker");
+      compressor *pComp = TDEFL_NEW compressor; decompressor *pDecomp = TDEFL_NEW decompressor;
+      uint8 *pRaw = NULL, *pOut = NULL; size_t raw_capacity = 0, out_capacity = 0;
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (!m_stop)
+      {
+        if (!m_queue_count) { if (!m_busy) m_idle.notify_all(); TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); m_work.wait(lock); continue; }
+        handle h = m_pQueue[m_queue_head]; m_queue_head = (m_queue_head + 1U) & (m_queue_size - 1U); m_queue_count--;
+        uint obj = lookup(h); if (obj == NONE) continue;
+        if ((m_stats.m_paused) && ((m_num_probed++ % PROBE_INTERVAL) != 0)) { m_stats.m_num_skipped++; continue; }
+        tiered_blob *pBlob = m_pObjects[obj].m_pBlob; const size_t size = m_pObjects[obj].m_size;
+        pBlob->m_refs++; m_busy++;
+        lock.unlock();
+
+        uint64 cpu_start = get_thread_cpu_usecs();
+        // The slow stream is only of use if it's smaller, so it gets a buffer the size of the fast one.
+        bool succeeded = (pComp) && (pDecomp);
+        if ((succeeded) && (raw_capacity < size)) { uint8 *p = static_cast<uint8*>(TDEFL_REALLOC(pRaw, size)); if (p) { pRaw = p; raw_capacity = size; } else succeeded = false; }
+        if ((succeeded) && (out_capacity < pBlob->m_len)) { uint8 *p = static_cast<uint8*>(TDEFL_REALLOC(pOut, pBlob->m_len)); if (p) { pOut = p; out_capacity = pBlob->m_len; } else succeeded = false; }
+        buffer_input_stream in(pBlob->m_pData, pBlob->m_len); buffer_output_stream raw(pRaw, size), out(pOut, pBlob->m_len);
+        succeeded = succeeded && (pDecomp->decompress(&in, &raw, decompressor::FORMAT_ZLIB)) && (raw.get_size() == size);
+        succeeded = succeeded && (pComp->init(&out, m_slow_flags | WRITE_ZLIB_HEADER)) && (pComp->compress_data(pRaw, size)) && (pComp->compress_data(NULL, 0));
+        const size_t new_len = out.get_size();
+        succeeded = succeeded && (new_len * 100U <= static_cast<uint64>(pBlob->m_len) * (100U - TDEFL_MIN(m_min_gain_percent, 100U)));
+        uint8 *pNew_data = succeeded ? static_cast<uint8*>(TDEFL_MALLOC(TDEFL_MAX(new_len, 1U))) : NULL;
+        if (pNew_data) memcpy(pNew_data, pOut, new_len);
+        tiered_blob *pNew_blob = pNew_data ? new_blob(pNew_data, new_len) : NULL;
+        if ((pNew_data) && (!pNew_blob)) TDEFL_FREE(pNew_data);
+        uint64 cpu_usecs = get_thread_cpu_usecs() - cpu_start;
+
+        lock.lock();
+        m_busy--;
+        // Swap only if the object is still the one that was recompressed.
+        uint64 saved = 0;
+        if ((pNew_blob) && (lookup(h) == obj) && (m_pObjects[obj].m_pBlob == pBlob))
         {
-          TDEFL_RLE_PREV_CODE_SIZE();
-          m_huff_count[2][code_size] = (uint16)(m_huff_count[2][code_size] + 1); packed_code_sizes[num_packed_code_sizes++] = code_size;
+          saved = pBlob->m_len - pNew_blob->m_len; m_stats.m_stored_bytes -= saved; m_stats.m_bytes_saved += saved; m_stats.m_num_recompressed++;
+          // This thread's reference keeps the old stream alive until the release below.
+          m_pObjects[obj].m_pBlob = pNew_blob; pBlob->m_refs--;
         }
-        else if (++rle_repeat_count == 6)
+        else
         {
-          TDEFL_RLE_PREV_CODE_SIZE();
+          if (pNew_blob) release_blob(pNew_blob); else m_stats.m_num_rejected++;
         }
+        release_blob(pBlob);
+        update_policy(cpu_usecs, saved);
       }
-      prev_code_size = code_size;
+      if (!m_busy) m_idle.notify_all();
+      lock.unlock();
+      TDEFL_DELETE pComp; TDEFL_DELETE pDecomp; TDEFL_FREE(pRaw); TDEFL_FREE(pOut);
     }
-    if (rle_repeat_count) { TDEFL_RLE_PREV_CODE_SIZE(); } else { TDEFL_RLE_ZERO_CODE_SIZE(); }
 
-    optimize_huffman_table(2, MAX_HUFF_SYMBOLS_2, 7);
-            
-    TDEFL_PUT_BITS(last_block, 1); TDEFL_PUT_BITS(2, 2); TDEFL_PUT_BITS(num_lit_codes - 257, 5); TDEFL_PUT_BITS(num_dist_codes - 1, 5);
+    // Takes a reference to an object's current stream, or returns NULL.
+    tiered_blob *acquire(handle h, size_t *pSize)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      uint obj = lookup(h); if (obj == NONE) return NULL;
+      tiered_blob *pBlob = m_pObjects[obj].m_pBlob; pBlob->m_refs++;
+      if (pSize) *pSize = m_pObjects[obj].m_size;
+      return pBlob;
+    }
+    void release(tiered_blob *pBlob) { std::lock_guard<std::mutex> lock(m_mutex); release_blob(pBlob); }
+  };
 
-    static const uint8 s_packed_code_size_syms_swizzle[] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-    int num_bit_lengths; for (num_bit_lengths = 18; num_bit_lengths >= 0; num_bit_lengths--) if (m_huff_code_sizes[2][s_packed_code_size_syms_swizzle[num_bit_lengths]]) break;
-    num_bit_lengths = TDEFL_MAX(4, (num_bit_lengths + 1)); TDEFL_PUT_BITS(num_bit_lengths - 4, 4);
-    for (int i = 0; i < num_bit_lengths; i++) TDEFL_PUT_BITS(m_huff_code_sizes[2][s_packed_code_size_syms_swizzle[i]], 3);
+  tiered_store::tiered_store() : m_pState(NULL) { }
+  tiered_store::~tiered_store() { deinit(); }
 
-    for (uint packed_code_sizes_index = 0; packed_code_sizes_index < num_packed_code_sizes; )
+  bool tiered_store::init(int fast_flags, int slow_flags, uint num_threads, uint min_gain_percent, uint min_savings_per_cpu_ms)
+  {
+    deinit();
+    state *pState = TDEFL_NEW state; if (!pState) return false;
+    pState->m_fast_flags = fast_flags | WRITE_ZLIB_HEADER; pState->m_slow_flags = slow_flags | WRITE_ZLIB_HEADER;
+    pState->m_min_gain_percent = min_gain_percent; pState->m_min_savings_per_cpu_ms = min_savings_per_cpu_ms;
+    num_threads = TDEFL_MAX(num_threads, 1U);
+    if ((pState->m_pThreads = TDEFL_NEW std::thread[num_threads]) == NULL) { TDEFL_DELETE pState; return false; }
+    m_pState = pState;
+    for (uint i = 0; i < num_threads; i++, pState->m_num_threads++) pState->m_pThreads[i] = std::thread(&state::run, pState);
+    return true;
+  }
+
+  void tiered_store::deinit()
+  {
+    state *pState = m_pState; if (!pState) return;
+    { std::lock_guard<std::mutex> lock(pState->m_mutex); pState->m_stop = true; pState->m_work.notify_all(); }
+    for (uint i = 0; i < pState->m_num_threads; i++) pState->m_pThreads[i].join();
+    TDEFL_DELETE [] pState->m_pThreads;
+    TDEFL_DELETE pState; m_pState = NULL;
+  }
+
+  tiered_store::handle tiered_store::put(const void *pBuf, size_t len)
+  {
+    state *pState = m_pState;
+    if ((!pState) || ((len) && (!pBuf)) || (len > 0x7FFFFFF0U)) return 0;
+    size_t comp_len = 0;
+    void *pComp = compress_mem_to_heap(pBuf, len, &comp_len, pState->m_fast_flags); if (!pComp) return 0;
+    tiered_blob *pBlob = state::new_blob(pComp, comp_len); if (!pBlob) { TDEFL_FREE(pComp); return 0; }
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->alloc_object(); if (obj == state::NONE) { state::release_blob(pBlob); return 0; }
+    tiered_object &o = pState->m_pObjects[obj]; o.m_pBlob = pBlob; o.m_size = len;
+    handle h = (static_cast<uint64>(o.m_gen) << 32) | (obj + 1U);
+    pState->m_stats.m_num_objects++; pState->m_stats.m_object_bytes += len; pState->m_stats.m_stored_bytes += comp_len;
+    // An object that couldn't be queued just keeps its fast stream.
+    if (pState->push_queue(h)) pState->m_work.notify_one();
+    return h;
+  }
+
+  bool tiered_store::remove(handle h)
+  {
+    state *pState = m_pState; if (!pState) return false;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->lookup(h); if (obj == state::NONE) return false;
+    const tiered_object &o = pState->m_pObjects[obj];
+    pState->m_stats.m_num_objects--; pState->m_stats.m_object_bytes -= o.m_size; pState->m_stats.m_stored_bytes -= o.m_pBlob->m_len;
+    pState->free_object(obj);
+    return true;
+  }
+
+  size_t tiered_store::get_size(handle h)
+  {
+    state *pState = m_pState; if (!pState) return 0;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    uint obj = pState->lookup(h);
+    return (obj == state::NONE) ? 0 : pState->m_pObjects[obj].m_size;
+  }
+
+  bool tiered_store::read(handle h, void *pDst, size_t dst_len)
+  {
+    state *pState = m_pState; if (!pState) return false;
+    size_t size = 0; tiered_blob *pBlob = pState->acquire(h, &size); if (!pBlob) return false;
+    bool succeeded = false;
+    if (dst_len >= size)
     {
-      uint code = packed_code_sizes[packed_code_sizes_index++]; TDEFL_ASSERT(code < MAX_HUFF_SYMBOLS_2);
-      TDEFL_PUT_BITS(m_huff_codes[2][code], m_huff_code_sizes[2][code]);
-      if (code >= 16) TDEFL_PUT_BITS(packed_code_sizes[packed_code_sizes_index++], "\02\03\07"[code - 16]);
+      decompressor *pDecomp = TDEFL_NEW decompressor;
+      buffer_input_stream in(pBlob->m_pData, pBlob->m_len); buffer_output_stream out(pDst, size);
+      succeeded = (pDecomp) && (pDecomp->decompress(&in, &out, decompressor::FORMAT_ZLIB)) && (out.get_size() == size);
+      TDEFL_DELETE pDecomp;
     }
+    pState->release(pBlob);
+    return succeeded;
   }
 
-  void compressor::flush_block(bool last_block)
+  void *tiered_store::get_compressed(handle h, size_t *pLen)
   {
-    *m_pLZ_flags = static_cast<uint8>(*m_pLZ_flags >> m_num_flags_left); m_pLZ_code_buf -= (m_num_flags_left == 8);
+    if (pLen) *pLen = 0;
+    state *pState = m_pState; if (!pState) return NULL;
+    tiered_blob *pBlob = pState->acquire(h, NULL); if (!pBlob) return NULL;
+    void *p = TDEFL_MALLOC(TDEFL_MAX(pBlob->m_len, 1U));
+    if (p) { memcpy(p, pBlob->m_pData, pBlob->m_len); if (pLen) *pLen = pBlob->m_len; }
+    pState->release(pBlob);
+    return p;
+  }
 
-    memset(&m_huff_count[0][0], 0, sizeof(m_huff_count[0][0]) * MAX_HUFF_SYMBOLS_0); memset(&m_huff_count[1][0], 0, sizeof(m_huff_count[1][0]) * MAX_HUFF_SYMBOLS_1);
-    for (uint pass = 0; pass < 2; pass++)
+  void tiered_store::wait_idle()
+  {
+    state *pState = m_pState; if (!pState) return;
+    std::unique_lock<std::mutex> lock(pState->m_mutex);
+    while ((pState->m_queue_count) || (pState->m_busy)) { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); pState->m_idle.wait(lock); }
+  }
+
+  tiered_store::stats tiered_store::get_stats()
+  {
+    stats s; memset(&s, 0, sizeof(s));
+    state *pState = m_pState; if (!pState) return s;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    s = pState->m_stats; s.m_queued = pState->m_queue_count;
+    return s;
+  }
+
+  // ------------------- compression_scheduler
+  struct compression_scheduler::job
+  {
+    job *m_pNext;
+    uint m_class;
+    int m_flags;
+    const uint8 *m_pSrc;
+    size_t m_src_len, m_src_ofs;
+    output_stream *m_pOut;
+    // Bulk jobs keep their compressor between slices, so another worker can carry on with it.
+    compressor *m_pComp;
+    uint64 m_enqueue_ticks, m_delay_ticks;
+    // Each job wakes only its own waiter: on a loaded machine, waking every waiter can delay the one that matters by a whole time slice. The waiter
+    // only takes the job's mutex, never the scheduler's, so deinit() can free the scheduler while jobs are still being waited for.
+    std::mutex m_done_mutex;
+    std::condition_variable m_done_cv;
+    bool m_done, m_succeeded;
+
+    job(uint qos_class, const void *pSrc, size_t src_len, output_stream *pOut, int flags) : m_pNext(NULL), m_class(qos_class), m_flags(flags), m_pSrc(static_cast<const uint8*>(pSrc)), m_src_len(src_len), m_src_ofs(0), m_pOut(pOut),
+      m_pComp(NULL), m_enqueue_ticks(0), m_delay_ticks(0), m_done(false), m_succeeded(false) { }
+  };
+
+  struct compression_scheduler::state
+  {
+    struct job_queue
     {
-      uint flags = 1; 
-      for (uint8 *pLZ_codes = m_lz_code_buf; pLZ_codes < m_pLZ_code_buf; flags >>= 1)
+      job *m_pHead, *m_pTail; size_t m_count;
+      job_queue() : m_pHead(NULL), m_pTail(NULL), m_count(0) { }
+      void push_back(job *pJob) { pJob->m_pNext = NULL; if (m_pTail) m_pTail->m_pNext = pJob; else m_pHead = pJob; m_pTail = pJob; m_count++; }
+      void push_front(job *pJob) { pJob->m_pNext = m_pHead; m_pHead = pJob; if (!m_pTail) m_pTail = pJob; m_count++; }
+      job *pop_front() { job *pJob = m_pHead; if (pJob) { m_pHead = pJob->m_pNext; if (!m_pHead) m_pTail = NULL; m_count--; } return pJob; }
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_work;
+    std::thread *m_pThreads;
+    uint m_num_threads, m_num_reserved, m_idle_reserved, m_slice_size, m_num_cores, m_running[NUM_CLASSES], m_num_throttled;
+    bool m_stop;
+    // Latency class jobs queued or running, so bulk jobs can check for them at slice boundaries without taking the lock.
+    std::atomic<uint> m_latency_jobs;
+    job_queue m_queues[NUM_CLASSES];
+    class_stats m_stats[NUM_CLASSES];
+
+    state() : m_pThreads(NULL), m_num_threads(0), m_num_reserved(0), m_idle_reserved(0), m_slice_size(0), m_num_cores(0), m_num_throttled(0), m_stop(false), m_latency_jobs(0) { memset(m_running, 0, sizeof(m_running)); memset(m_stats, 0, sizeof(m_stats)); }
+
+    // Called with the lock held.
+    void finish_job(job *pJob, bool succeeded)
+    {
+      class_stats &s = m_stats[pJob->m_class];
+      uint64 delay_usecs = (pJob->m_delay_ticks * 1000000ULL) / get_ticks_per_second();
+      uint bucket = 0; while ((bucket < DELAY_HISTOGRAM_BUCKETS - 1) && (delay_usecs >= (1ULL << bucket))) bucket++;
+      s.m_num_jobs++; s.m_num_failed += succeeded ? 0 : 1; s.m_total_delay_usecs += delay_usecs; s.m_max_delay_usecs = TDEFL_MAX(s.m_max_delay_usecs, delay_usecs); s.m_delay_histogram[bucket]++;
+      TDEFL_DELETE pJob->m_pComp; pJob->m_pComp = NULL;
+      if (pJob->m_class == CLASS_LATENCY) m_latency_jobs--;
+      // Notified under the job's lock: once the waiter sees m_done it deletes the job.
+      std::lock_guard<std::mutex> done_lock(pJob->m_done_mutex);
+      pJob->m_succeeded = succeeded; pJob->m_done = true;
+      pJob->m_done_cv.notify_one();
+    }
+
+    void run(bool reserved)
+    {
+      TDEFL_TRACE_THREAD_NAME(reserved ? "compression_scheduler reserved worker" : "compression_scheduler worker");
+      compressor *pComp = TDEFL_NEW compressor;
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (!m_stop)
       {
-        if (flags == 1) flags = *pLZ_codes++ | 0x100;
-        if (flags & 1)
+        job *pJob = m_queues[CLASS_LATENCY].pop_front();
+        if ((!pJob) && (!reserved)) pJob = m_queues[CLASS_BULK].pop_front();
+        if (!pJob)
         {
-          uint match_len = pLZ_codes[0], match_dist = (pLZ_codes[1] | (pLZ_codes[2] << 8)); pLZ_codes += 3;
-          if (!pass)
-          {
-            m_huff_count[0][s_len_sym[match_len]]++;
-            if (match_dist < 512)
-              m_huff_count[1][s_small_dist_sym[match_dist]]++;
-            else
-              m_huff_count[1][s_large_dist_sym[match_dist >> 8]]++;
-          }
-          else
+          if (reserved) m_idle_reserved++;
+          { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); m_work.wait(lock); }
+          if (reserved) m_idle_reserved--;
+          continue;
+        }
+        pJob->m_delay_ticks += get_ticks() - pJob->m_enqueue_ticks; m_running[pJob->m_class]++;
+        lock.unlock();
+
+        bool finished = true, succeeded = false;
+        if (pJob->m_class == CLASS_LATENCY)
+          succeeded = run_latency_job(pComp, pJob);
+        else
+        {
+          succeeded = ((pJob->m_pComp) || (((pJob->m_pComp = TDEFL_NEW compressor) != NULL) && (pJob->m_pComp->init(pJob->m_pOut, pJob->m_flags))));
+          while ((succeeded) && (pJob->m_src_ofs < pJob->m_src_len))
           {
-            TDEFL_PUT_BITS(m_huff_codes[0][s_len_sym[match_len]], m_huff_code_sizes[0][s_len_sym[match_len]]); TDEFL_PUT_BITS(match_len & ((1 << s_len_extra[match_len]) - 1), s_len_extra[match_len]);
-            uint sym, num_extra_bits;
-            if (match_dist < 512)
-            {
-              sym = s_small_dist_sym[match_dist]; num_extra_bits = s_small_dist_extra[match_dist];
-            }
-            else
-            {
-              sym = s_large_dist_sym[match_dist >> 8]; num_extra_bits = s_large_dist_extra[match_dist >> 8];
-            }
-            TDEFL_PUT_BITS(m_huff_codes[1][sym], m_huff_code_sizes[1][sym]); TDEFL_PUT_BITS(match_dist & ((1 << num_extra_bits) - 1), num_extra_bits);
+            succeeded = compress_slices(pJob->m_pComp, pJob, m_slice_size);
+            if ((!succeeded) || (pJob->m_src_ofs == pJob->m_src_len)) break;
+            // When there are more busy workers than cores, bulk slices wait for the latency jobs to finish, rather than leave it to the OS to share
+            // the cores between them.
+            if (!m_latency_jobs.load(std::memory_order_relaxed)) continue;
+            std::unique_lock<std::mutex> slice_lock(m_mutex);
+            if ((m_queues[CLASS_LATENCY].m_count) && (!m_idle_reserved) && (!m_stop)) { finished = false; break; }
+            while ((m_running[CLASS_LATENCY]) && (m_running[CLASS_LATENCY] + m_running[CLASS_BULK] > m_num_cores) && (!m_stop)) { m_running[CLASS_BULK]--; m_num_throttled++; { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); m_work.wait(slice_lock); } m_num_throttled--; m_running[CLASS_BULK]++; }
           }
+          succeeded = succeeded && ((!finished) || (pJob->m_pComp->compress_data(NULL, 0)));
         }
+
+        lock.lock();
+        m_running[pJob->m_class]--;
+        const bool latency_job = (pJob->m_class == CLASS_LATENCY);
+        if (finished)
+          finish_job(pJob, succeeded);
         else
         {
-          uint lit = *pLZ_codes++;
-          if (!pass)
-            m_huff_count[0][lit]++;
-          else
-            TDEFL_PUT_BITS(m_huff_codes[0][lit], m_huff_code_sizes[0][lit]);
+          m_stats[CLASS_BULK].m_num_preemptions++;
+          pJob->m_enqueue_ticks = get_ticks(); m_queues[CLASS_BULK].push_front(pJob);
+          // Another worker may already be free to pick it up.
+          m_work.notify_all();
         }
+        // Wakes bulk jobs waiting for the latency jobs, after the waiter of this one.
+        if ((latency_job) && (m_num_throttled)) m_work.notify_all();
       }
-            
-      if (!pass)
+      lock.unlock();
+      TDEFL_DELETE pComp;
+    }
+
+    static bool run_latency_job(compressor *pComp, job *pJob)
+    {
+      return (pComp) && (pComp->init(pJob->m_pOut, pJob->m_flags)) && ((!pJob->m_src_len) || (compress_slices(pComp, pJob, pJob->m_src_len))) && (pComp->compress_data(NULL, 0));
+    }
+
+    // Compresses up to max_len more bytes of a job's source.
+    static bool compress_slices(compressor *pComp, job *pJob, size_t max_len)
+    {
+      for (size_t end = pJob->m_src_ofs + TDEFL_MIN(max_len, pJob->m_src_len - pJob->m_src_ofs); pJob->m_src_ofs < end; )
       {
-        m_huff_count[0][256]++; start_dynamic_block(last_block);
+        uint n = static_cast<uint>(TDEFL_MIN(end - pJob->m_src_ofs, 0x40000000U));
+        if (!pComp->compress_data(pJob->m_pSrc + pJob->m_src_ofs, n)) return false;
+        pJob->m_src_ofs += n;
       }
-      else
-        TDEFL_PUT_BITS(m_huff_codes[0][256], m_huff_code_sizes[0][256]);
+      return true;
+    }
+  };
+
+  compression_scheduler::compression_scheduler() : m_pState(NULL) { }
+  compression_scheduler::~compression_scheduler() { deinit(); }
+
+  bool compression_scheduler::init(uint num_workers, uint num_reserved, uint slice_size)
+  {
+    deinit();
+    num_workers = TDEFL_MAX(num_workers, 1U); num_reserved = TDEFL_MIN(num_reserved, num_workers - 1U);
+    state *pState = TDEFL_NEW state; if (!pState) return false;
+    pState->m_num_reserved = num_reserved; pState->m_slice_size = TDEFL_MAX(slice_size, 4096U);
+    pState->m_num_cores = std::thread::hardware_concurrency(); if (!pState->m_num_cores) pState->m_num_cores = num_workers;
+    if ((pState->m_pThreads = TDEFL_NEW std::thread[num_workers]) == NULL) { TDEFL_DELETE pState; return false; }
+    m_pState = pState;
+    for (uint i = 0; i < num_workers; i++, pState->m_num_threads++) pState->m_pThreads[i] = std::thread(&state::run, pState, i < num_reserved);
+    return true;
+  }
+
+  void compression_scheduler::deinit()
+  {
+    state *pState = m_pState; if (!pState) return;
+    { std::lock_guard<std::mutex> lock(pState->m_mutex); pState->m_stop = true; pState->m_work.notify_all(); }
+    for (uint i = 0; i < pState->m_num_threads; i++) pState->m_pThreads[i].join();
+    TDEFL_DELETE [] pState->m_pThreads;
+    {
+      std::lock_guard<std::mutex> lock(pState->m_mutex);
+      for (uint i = 0; i < NUM_CLASSES; i++) while (job *pJob = pState->m_queues[i].pop_front()) pState->finish_job(pJob, false);
+    }
+    TDEFL_DELETE pState; m_pState = NULL;
+  }
+
+  compression_scheduler::job *compression_scheduler::submit(uint qos_class, const void *pSrc, size_t src_len, output_stream *pOut, int flags)
+  {
+    state *pState = m_pState;
+    if ((!pState) || (qos_class >= NUM_CLASSES) || ((src_len) && (!pSrc)) || (!pOut)) return NULL;
+    job *pJob = TDEFL_NEW job(qos_class, pSrc, src_len, pOut, flags); if (!pJob) return NULL;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    if (pState->m_stop) { TDEFL_DELETE pJob; return NULL; }
+    pJob->m_enqueue_ticks = get_ticks(); pState->m_queues[qos_class].push_back(pJob);
+    if (qos_class == CLASS_LATENCY) pState->m_latency_jobs++;
+    // Reserved workers can't take bulk jobs, so waking just one might wake the wrong kind.
+    pState->m_work.notify_all();
+    return pJob;
+  }
+
+  bool compression_scheduler::wait(job *pJob)
+  {
+    if (!pJob) return false;
+    // Doesn't touch the scheduler, which deinit() may be freeing: deinit() finishes every job first.
+    bool succeeded;
+    {
+      std::unique_lock<std::mutex> lock(pJob->m_done_mutex);
+      while (!pJob->m_done) { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); pJob->m_done_cv.wait(lock); }
+      succeeded = pJob->m_succeeded;
+    }
+    TDEFL_DELETE pJob;
+    return succeeded;
+  }
+
+  bool compression_scheduler::compress(uint qos_class, const void *pSrc, size_t src_len, output_stream *pOut, int flags)
+  {
+    state *pState = m_pState;
+    if ((!pState) || (qos_class != CLASS_LATENCY)) { job *pJob = submit(qos_class, pSrc, src_len, pOut, flags); return (pJob) && (wait(pJob)); }
+    if (((src_len) && (!pSrc)) || (!pOut)) return false;
+    job inline_job(qos_class, pSrc, src_len, pOut, flags);
+    {
+      std::lock_guard<std::mutex> lock(pState->m_mutex);
+      if (pState->m_stop) return false;
+      pState->m_latency_jobs++; pState->m_running[CLASS_LATENCY]++;
+    }
+    compressor *pComp = TDEFL_NEW compressor;
+    bool succeeded = state::run_latency_job(pComp, &inline_job);
+    TDEFL_DELETE pComp;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    pState->m_running[CLASS_LATENCY]--; pState->finish_job(&inline_job, succeeded);
+    // Waking idle workers for nothing lets the OS hand the core to a bulk job before this thread returns.
+    if (pState->m_num_throttled) pState->m_work.notify_all();
+    return succeeded;
+  }
+
+  compression_scheduler::class_stats compression_scheduler::get_stats(uint qos_class)
+  {
+    class_stats s; memset(&s, 0, sizeof(s));
+    state *pState = m_pState; if ((!pState) || (qos_class >= NUM_CLASSES)) return s;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    s = pState->m_stats[qos_class]; s.m_queued = pState->m_queues[qos_class].m_count;
+    return s;
+  }
+
+  uint64 compression_scheduler::get_delay_percentile_usecs(uint qos_class, uint percentile)
+  {
+    class_stats s = get_stats(qos_class);
+    if (!s.m_num_jobs) return 0;
+    const uint64 target = (s.m_num_jobs * TDEFL_MIN(percentile, 100U) + 99U) / 100U;
+    uint64 count = 0;
+    for (uint i = 0; i < DELAY_HISTOGRAM_BUCKETS; i++) if ((count += s.m_delay_histogram[i]) >= TDEFL_MAX(target, 1ULL)) return 1ULL << i;
+    return s.m_max_delay_usecs;
+  }
+
+#ifdef __linux__
+  // ------------------- offload_client/server
+  // Messages are fixed size structs over a SOCK_SEQPACKET socket, so each one arrives whole. The hello carries the memfd. The client seals it against
+  // shrinking, so the daemon can't be made to fault on a mapping that's lost its pages.
+  enum { OFFLOAD_MAGIC = 0x4F464454, OFFLOAD_VERSION = 1, OFFLOAD_OP_COMPRESS = 1, OFFLOAD_STATUS_OK = 0, OFFLOAD_STATUS_UNKNOWN_DICT, OFFLOAD_STATUS_FAILED };
+  struct offload_hello { uint32 m_magic, m_version; uint64 m_shared_size; };
+  struct offload_request { uint32 m_op, m_flags, m_dict_id, m_reserved; uint64 m_in_ofs, m_in_len, m_out_ofs, m_out_capacity; };
+  struct offload_reply { uint32 m_status, m_reserved; uint64 m_out_len; };
+
+  // Resolves TDEFL_OFFLOAD_SOCKET_PATH's NULL default. /tmp/tinydeflate-<uid> may have been created by someone else: it must be a real directory, owned by
+  // the user and closed to everyone else.
+  static bool get_offload_socket_path(const char *pSocket_path, char *pPath, size_t path_size)
+  {
+    if (pSocket_path) return snprintf(pPath, path_size, "%s", pSocket_path) < static_cast<int>(path_size);
+    const char *pRuntime_dir = getenv("XDG_RUNTIME_DIR");
+    if ((pRuntime_dir) && (pRuntime_dir[0] == '/')) return snprintf(pPath, path_size, "%s/tinydeflate.sock", pRuntime_dir) < static_cast<int>(path_size);
+    char dir[64]; snprintf(dir, sizeof(dir), "/tmp/tinydeflate-%u", static_cast<uint>(geteuid()));
+    struct stat st;
+    if ((mkdir(dir, 0700)) && (errno != EEXIST)) return false;
+    if ((lstat(dir, &st)) || (!S_ISDIR(st.st_mode)) || (st.st_uid != geteuid()) || (st.st_mode & 077)) return false;
+    return snprintf(pPath, path_size, "%s/tinydeflate.sock", dir) < static_cast<int>(path_size);
+  }
+
+  // Both ends only trust a peer running as their own user.
+  static bool offload_peer_is_same_user(int fd)
+  {
+    ucred cred; socklen_t len = sizeof(cred);
+    return (!getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) && (len == sizeof(cred)) && (cred.uid == geteuid());
+  }
+
+  static bool compress_with_dictionary(compressor *pComp, output_stream *pOut, int flags, const uint8 *pDict, uint dict_len, const uint8 *pSrc, size_t src_len)
+  {
+    if ((!pComp->init(pOut, flags)) || ((dict_len) && (!pComp->set_dictionary(pDict, dict_len)))) return false;
+    for (size_t ofs = 0; ofs < src_len; )
+    {
+      uint n = static_cast<uint>(TDEFL_MIN(src_len - ofs, static_cast<size_t>(0x40000000U)));
+      if (!pComp->compress_data(pSrc + ofs, n)) return false;
+      ofs += n;
+    }
+    return pComp->compress_data(NULL, 0);
+  }
+
+  offload_client::offload_client() : m_fd(-1), m_pShared(NULL), m_shared_size(0), m_shared_mapped(false), m_pDict(NULL), m_dict_len(0), m_dict_id(0), m_pComp(NULL), m_num_offloaded(0), m_num_local(0)
+  {
+  }
+
+  offload_client::~offload_client()
+  {
+    deinit(); TDEFL_FREE(m_pDict); TDEFL_DELETE m_pComp;
+  }
+
+  bool offload_client::init(const char *pSocket_path, size_t shared_size, uint timeout_ms)
+  {
+    deinit();
+    m_shared_size = (TDEFL_MAX(shared_size, static_cast<size_t>(65536U)) + TDEFL_PAGE_SIZE - 1U) & ~static_cast<size_t>(TDEFL_PAGE_SIZE - 1U);
+    if (((!pSocket_path) || (pSocket_path[0])) && (connect_to_daemon(pSocket_path, timeout_ms))) return true;
+    // No daemon: the same buffer, in private memory.
+    m_pShared = static_cast<uint8*>(TDEFL_MALLOC(m_shared_size));
+    return m_pShared != NULL;
+  }
+
+  bool offload_client::connect_to_daemon(const char *pSocket_path, uint timeout_ms)
+  {
+    sockaddr_un addr; memset(&addr, 0, sizeof(addr)); addr.sun_family = AF_UNIX;
+    if (!get_offload_socket_path(pSocket_path, addr.sun_path, sizeof(addr.sun_path))) return false;
+    int mfd = memfd_create("tinydeflate", MFD_CLOEXEC | MFD_ALLOW_SEALING); if (mfd < 0) return false;
+    uint8 *pShared = NULL;
+    if ((!ftruncate(mfd, static_cast<off_t>(m_shared_size))) && (!fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)))
+    {
+      void *p = mmap(NULL, m_shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+      if (p != MAP_FAILED) pShared = static_cast<uint8*>(p);
+    }
+    int fd = pShared ? socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0) : -1;
+    timeval timeout; timeout.tv_sec = timeout_ms / 1000U; timeout.tv_usec = (timeout_ms % 1000U) * 1000U;
+    bool connected = (fd >= 0) && (!connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) && (offload_peer_is_same_user(fd)) &&
+      ((!timeout_ms) || ((!setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) && (!setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))));
+    if (connected)
+    {
+      offload_hello hello; hello.m_magic = OFFLOAD_MAGIC; hello.m_version = OFFLOAD_VERSION; hello.m_shared_size = m_shared_size;
+      iovec iov; iov.iov_base = &hello; iov.iov_len = sizeof(hello);
+      union { cmsghdr m_hdr; char m_buf[CMSG_SPACE(sizeof(int))]; } control; memset(&control, 0, sizeof(control));
+      msghdr msg; memset(&msg, 0, sizeof(msg)); msg.msg_iov = &iov; msg.msg_iovlen = 1; msg.msg_control = control.m_buf; msg.msg_controllen = sizeof(control.m_buf);
+      cmsghdr *pCmsg = CMSG_FIRSTHDR(&msg); pCmsg->cmsg_level = SOL_SOCKET; pCmsg->cmsg_type = SCM_RIGHTS; pCmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(pCmsg), &mfd, sizeof(int));
+      offload_reply reply;
+      connected = (sendmsg(fd, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(hello))) && (recv(fd, &reply, sizeof(reply), 0) == static_cast<ssize_t>(sizeof(reply))) && (reply.m_status == OFFLOAD_STATUS_OK);
     }
-    
-    if ((last_block) && (m_bits_in & 7)) { TDEFL_PUT_BITS(0, 8 - m_bits_in); }
+    close(mfd);
+    if (!connected)
+    {
+      if (fd >= 0) close(fd);
+      if (pShared) munmap(pShared, m_shared_size);
+      return false;
+    }
+    m_fd = fd; m_pShared = pShared; m_shared_mapped = true;
+    return true;
+  }
 
-    m_pLZ_code_buf = m_lz_code_buf + 1; m_pLZ_flags = m_lz_code_buf; m_num_flags_left = 8;
+  // The mapping stays: it's still the client's input buffer, and its contents are still needed to compress in process.
+  void offload_client::disconnect()
+  {
+    if (m_fd >= 0) { close(m_fd); m_fd = -1; }
   }
 
-  inline void compressor::record_literal(uint8 lit)
+  void offload_client::deinit()
   {
-    *m_pLZ_code_buf++ = lit;
-    *m_pLZ_flags = static_cast<uint8>(*m_pLZ_flags >> 1); if (--m_num_flags_left == 0) { m_num_flags_left = 8; m_pLZ_flags = m_pLZ_code_buf++; }
-    if (m_pLZ_code_buf > &m_lz_code_buf[LZ_CODE_BUF_SIZE - 4]) flush_block(false);
+    disconnect();
+    if (m_shared_mapped) munmap(m_pShared, m_shared_size); else TDEFL_FREE(m_pShared);
+    m_pShared = NULL; m_shared_size = 0; m_shared_mapped = false; m_local_out.clear();
   }
 
-  inline void compressor::record_match(uint match_len, uint match_dist)
+  bool offload_client::set_dictionary(const void *pDict, uint dict_len)
   {
-    TDEFL_ASSERT((match_len >= MIN_MATCH_LEN) && (match_dist >= 1) && (match_dist <= LZ_DICT_SIZE));
-    m_pLZ_code_buf[0] = static_cast<uint8>(match_len - MIN_MATCH_LEN); match_dist -= 1; m_pLZ_code_buf[1] = static_cast<uint8>(match_dist & 0xFF); m_pLZ_code_buf[2] = static_cast<uint8>(match_dist >> 8);
-    m_pLZ_code_buf += 3;
-    *m_pLZ_flags = static_cast<uint8>((*m_pLZ_flags >> 1) | 0x80); if (--m_num_flags_left == 0) { m_num_flags_left = 8; m_pLZ_flags = m_pLZ_code_buf++; }
-    if (m_pLZ_code_buf > &m_lz_code_buf[LZ_CODE_BUF_SIZE - 4]) flush_block(false);
+    TDEFL_FREE(m_pDict); m_pDict = NULL; m_dict_len = 0; m_dict_id = 0;
+    if ((!pDict) || (!dict_len)) return true;
+    // Only the last 32KB can be referenced, so that's all the daemon's copy has to match.
+    const uint len = TDEFL_MIN(dict_len, 32768U);
+    if ((m_pDict = static_cast<uint8*>(TDEFL_MALLOC(len))) == NULL) return false;
+    memcpy(m_pDict, static_cast<const uint8*>(pDict) + dict_len - len, len); m_dict_len = len; m_dict_id = adler32(m_pDict, len, 1);
+    return true;
   }
 
-  inline void compressor::find_match(uint pos, uint max_dist, uint max_match_len, uint &match_dist, uint &match_len)
+  bool offload_client::compress_local(const uint8 *pSrc, size_t src_len, output_stream *pOut, int flags)
   {
-    TDEFL_ASSERT(max_match_len <= MAX_MATCH_LEN); if (max_match_len <= match_len) return;
-    uint probe_len, probe_pos = pos, prev_dist = 0, num_probes_left = m_max_probes, next_probe_pos, dist;
-    const uint8 *r = m_dict + pos;
-    uint8 c0 = m_dict[pos + match_len], c1 = m_dict[pos + match_len - 1];
-    for ( ; ; )
+    m_num_local++;
+    if ((!m_pComp) && ((m_pComp = TDEFL_NEW compressor) == NULL)) return false;
+    return compress_with_dictionary(m_pComp, pOut, flags, m_pDict, m_dict_len, pSrc, src_len);
+  }
+
+  const uint8 *offload_client::compress_shared(size_t len, size_t *pOut_len, int flags)
+  {
+    *pOut_len = 0;
+    if ((!m_pShared) || (len > get_max_input_size())) return NULL;
+    const size_t out_ofs = m_shared_size / 2U;
+    if (m_fd >= 0)
     {
-      for ( ; ; )
-      {
-        if (num_probes_left-- == 0) return;
-        #define TDEFL_PROBE \
-          next_probe_pos = m_next[probe_pos]; if (static_cast<int16>(next_probe_pos) < 0) return; \
-          dist = (pos - next_probe_pos) & LZ_DICT_SIZE_MASK; \
-          if ((dist > max_dist) || (dist <= prev_dist)) { m_next[probe_pos] = 0xFFFF; return; } \
-          prev_dist = dist; probe_pos = next_probe_pos; \
-          if ((m_dict[probe_pos + match_len] == c0) && (m_dict[probe_pos + match_len - 1] == c1)) break;
-        TDEFL_PROBE; TDEFL_PROBE; TDEFL_PROBE;
-      }
-      const uint8 *p = r, *q = m_dict + probe_pos; for (probe_len = 0; probe_len < max_match_len; probe_len++) if (*p++ != *q++) break;
-      if (probe_len > match_len)
+      offload_request req; memset(&req, 0, sizeof(req));
+      req.m_op = OFFLOAD_OP_COMPRESS; req.m_flags = static_cast<uint32>(flags); req.m_dict_id = m_dict_len ? m_dict_id : 0;
+      req.m_in_ofs = 0; req.m_in_len = len; req.m_out_ofs = out_ofs; req.m_out_capacity = m_shared_size - out_ofs;
+      offload_reply reply;
+      // On a timeout the daemon may still be working on the request, so its reply would be out of step with the next one: give up on it.
+      if ((send(m_fd, &req, sizeof(req), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(req))) || (recv(m_fd, &reply, sizeof(reply), 0) != static_cast<ssize_t>(sizeof(reply))))
+        disconnect();
+      else if ((reply.m_status == OFFLOAD_STATUS_OK) && (reply.m_out_len <= req.m_out_capacity))
       {
-        match_dist = prev_dist; if ((match_len = probe_len) == max_match_len) return;
-        c0 = m_dict[pos + match_len]; c1 = m_dict[pos + match_len - 1];
+        m_num_offloaded++; *pOut_len = static_cast<size_t>(reply.m_out_len);
+        return m_pShared + out_ofs;
       }
     }
+    m_local_out.reset();
+    if (!compress_local(m_pShared, len, &m_local_out, flags)) return NULL;
+    *pOut_len = m_local_out.get_size();
+    return m_local_out.get_buf();
   }
 
-  bool compressor::compress_data(const void *pData, uint data_len)
+  bool offload_client::compress(const void *pSrc, size_t src_len, output_stream *pOut, int flags)
   {
-    if ((!m_pStream) || (!m_all_writes_succeeded)) return false;
-    const uint8 *pSrc = static_cast<const uint8*>(pData); if (m_flags & WRITE_ZLIB_HEADER) { m_adler32 = adler32(pSrc, data_len, m_adler32); }
-    while ((data_len) || ((!pSrc) && (m_lookahead_size)))
+    if ((!pOut) || ((src_len) && (!pSrc))) return false;
+    if ((!m_pShared) || (src_len > get_max_input_size())) return compress_local(static_cast<const uint8*>(pSrc), src_len, pOut, flags);
+    if (src_len) memcpy(m_pShared, pSrc, src_len);
+    size_t out_len; const uint8 *pOut_buf = compress_shared(src_len, &out_len, flags);
+    return (pOut_buf) && (pOut->put_buf(pOut_buf, static_cast<int>(out_len)));
+  }
+
+  struct offload_connection
+  {
+    int m_fd;
+    std::thread m_thread;
+    std::atomic<bool> m_done;
+    offload_connection *m_pNext_reaped;
+    offload_connection(int fd) : m_fd(fd), m_done(false), m_pNext_reaped(NULL) { }
+  };
+
+  struct offload_server::state
+  {
+    std::mutex m_mutex;
+    std::thread m_accept_thread;
+    int m_listen_fd;
+    bool m_stop;
+    char m_socket_path[sizeof(sockaddr_un().sun_path)];
+    dev_t m_socket_dev;
+    ino_t m_socket_ino;
+    const dictionary *m_pDicts;
+    uint m_num_dicts;
+    offload_connection **m_pConns;
+    uint m_num_conns, m_conn_capacity;
+    compressor **m_pPool;
+    uint m_pool_size, m_max_pooled;
+    stats m_stats;
+
+    state() : m_listen_fd(-1), m_stop(false), m_socket_dev(0), m_socket_ino(0), m_pDicts(NULL), m_num_dicts(0), m_pConns(NULL), m_num_conns(0), m_conn_capacity(0), m_pPool(NULL), m_pool_size(0), m_max_pooled(0)
     {
-      // Update dictionary and hash chains. Keeps the lookahead size equal to MAX_MATCH_LEN.
-      if (m_lookahead_size >= (MIN_MATCH_LEN - 1))
+      m_socket_path[0] = '\0'; memset(&m_stats, 0, sizeof(m_stats));
+    }
+    ~state()
+    {
+      for (uint i = 0; i < m_pool_size; i++) TDEFL_DELETE m_pPool[i];
+      TDEFL_FREE(m_pPool); TDEFL_FREE(m_pConns);
+    }
+
+    // Compressors are only allocated when the pool is empty, and only max_pooled idle ones are kept.
+    compressor *acquire_compressor()
+    {
+      { std::lock_guard<std::mutex> lock(m_mutex); if (m_pool_size) return m_pPool[--m_pool_size]; }
+      return TDEFL_NEW compressor;
+    }
+    void release_compressor(compressor *pComp)
+    {
+      { std::lock_guard<std::mutex> lock(m_mutex); if (m_pool_size < m_max_pooled) { m_pPool[m_pool_size++] = pComp; return; } }
+      TDEFL_DELETE pComp;
+    }
+
+    // Receives the hello and maps the client's memfd.
+    uint8 *accept_client(int fd, size_t &shared_size)
+    {
+      offload_hello hello; int mfd = -1;
+      iovec iov; iov.iov_base = &hello; iov.iov_len = sizeof(hello);
+      union { cmsghdr m_hdr; char m_buf[CMSG_SPACE(sizeof(int))]; } control; memset(&control, 0, sizeof(control));
+      msghdr msg; memset(&msg, 0, sizeof(msg)); msg.msg_iov = &iov; msg.msg_iovlen = 1; msg.msg_control = control.m_buf; msg.msg_controllen = sizeof(control.m_buf);
+      ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+      cmsghdr *pCmsg = (n == static_cast<ssize_t>(sizeof(hello))) ? CMSG_FIRSTHDR(&msg) : NULL;
+      if ((pCmsg) && (pCmsg->cmsg_level == SOL_SOCKET) && (pCmsg->cmsg_type == SCM_RIGHTS) && (pCmsg->cmsg_len == CMSG_LEN(sizeof(int)))) memcpy(&mfd, CMSG_DATA(pCmsg), sizeof(int));
+      if (mfd < 0) return NULL;
+      struct stat st; uint8 *pShared = NULL;
+      const int seals = fcntl(mfd, F_GET_SEALS);
+      if ((hello.m_magic == OFFLOAD_MAGIC) && (hello.m_version == OFFLOAD_VERSION) && (seals >= 0) && (seals & F_SEAL_SHRINK) && (!fstat(mfd, &st)) &&
+          (hello.m_shared_size) && (static_cast<uint64>(st.st_size) == hello.m_shared_size))
       {
-        // Alternate dictionary update loop (avoids a load hit stores per iteration).
-        uint dst_pos = (m_lookahead_pos + m_lookahead_size) & LZ_DICT_SIZE_MASK;
-        uint ins_pos = (dst_pos - 2) & LZ_DICT_SIZE_MASK;
-        uint hash = (m_dict[ins_pos] << 4) ^ m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK];
-        uint num_bytes_to_process = TDEFL_MIN(data_len, MAX_MATCH_LEN - m_lookahead_size);
-        const uint8 *pSrc_end = pSrc + num_bytes_to_process;
-        data_len -= num_bytes_to_process;  m_lookahead_size += num_bytes_to_process;
-        while (pSrc != pSrc_end)
-        {
-          uint8 c = *pSrc++; m_dict[dst_pos] = c; if (dst_pos < (MAX_MATCH_LEN - 1)) m_dict[LZ_DICT_SIZE + dst_pos] = c;
-          hash = ((hash << 4) ^ c) & (LZ_HASH_SIZE - 1);
-          m_next[ins_pos] = m_hash[hash]; m_hash[hash] = static_cast<uint16>(ins_pos);
-          dst_pos = (dst_pos + 1) & LZ_DICT_SIZE_MASK; ins_pos = (ins_pos + 1) & LZ_DICT_SIZE_MASK;
-        }
+        void *p = mmap(NULL, static_cast<size_t>(hello.m_shared_size), PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+        if (p != MAP_FAILED) { pShared = static_cast<uint8*>(p); shared_size = static_cast<size_t>(hello.m_shared_size); }
       }
-      else
-      {
-        while ((data_len) && (m_lookahead_size < MAX_MATCH_LEN))
-        {
-          uint8 c = *pSrc++; data_len--;
-          uint dst_pos = (m_lookahead_pos + m_lookahead_size) & LZ_DICT_SIZE_MASK;
-          m_dict[dst_pos] = c; if (dst_pos < (MAX_MATCH_LEN - 1)) m_dict[LZ_DICT_SIZE + dst_pos] = c;
-          if (++m_lookahead_size >= MIN_MATCH_LEN)
-          {
-            uint ins_pos = (dst_pos - 2) & LZ_DICT_SIZE_MASK;
-            uint hash = ((m_dict[ins_pos] << 8) ^ (m_dict[(ins_pos + 1) & LZ_DICT_SIZE_MASK] << 4) ^ c) & (LZ_HASH_SIZE - 1);
-            m_next[ins_pos] = m_hash[hash]; m_hash[hash] = static_cast<uint16>(ins_pos);
-          }
-        }
-      }          
-      m_dict_size = TDEFL_MIN(LZ_DICT_SIZE - m_lookahead_size, m_dict_size);
-      if ((pSrc) && (m_lookahead_size < MAX_MATCH_LEN)) break;
-      
-      // Simple lazy/greedy parsing state machine.
-      uint len_to_move = 1, cur_match_dist = 0, cur_match_len = m_saved_match_len ? m_saved_match_len : (MIN_MATCH_LEN - 1);
-      find_match(m_lookahead_pos, m_dict_size, m_lookahead_size, cur_match_dist, cur_match_len);
-      if ((cur_match_len == MIN_MATCH_LEN) && (cur_match_dist >= 12U*1024U)) { cur_match_dist = cur_match_len = 0; } // reject really far small matches as not worth using
-      if (m_saved_match_len)
+      close(mfd);
+      return pShared;
+    }
+
+    void serve(offload_connection *pConn)
+    {
+      TDEFL_TRACE_THREAD_NAME("offload_server connection");
+      const int fd = pConn->m_fd; size_t shared_size = 0;
+      uint8 *pShared = accept_client(fd, shared_size);
+      offload_reply reply; memset(&reply, 0, sizeof(reply)); reply.m_status = pShared ? OFFLOAD_STATUS_OK : OFFLOAD_STATUS_FAILED;
+      bool connected = (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(reply))) && (pShared);
+      while (connected)
       {
-        if (cur_match_len > m_saved_match_len)
+        offload_request req; ssize_t n;
+        { TDEFL_TRACE_SPAN(wait_span, TRACE_WAIT); n = recv(fd, &req, sizeof(req), 0); }
+        if (n != static_cast<ssize_t>(sizeof(req))) break;
+        memset(&reply, 0, sizeof(reply)); reply.m_status = OFFLOAD_STATUS_FAILED;
+        // The client shares the buffer, so it can only hurt itself by changing it meanwhile; the ranges are all that must be checked.
+        const bool valid = (req.m_op == OFFLOAD_OP_COMPRESS) && (req.m_in_ofs <= shared_size) && (req.m_in_len <= shared_size - req.m_in_ofs) && (req.m_out_ofs <= shared_size) && (req.m_out_capacity <= shared_size - req.m_out_ofs);
+        const dictionary *pDict = NULL;
+        for (uint i = 0; (valid) && (req.m_dict_id) && (i < m_num_dicts); i++) if (m_pDicts[i].m_id == req.m_dict_id) { pDict = &m_pDicts[i]; break; }
+        if ((valid) && (req.m_dict_id) && (!pDict))
+          reply.m_status = OFFLOAD_STATUS_UNKNOWN_DICT;
+        else if (valid)
         {
-          record_literal((uint8)m_saved_lit);
-          if (cur_match_len >= 64)
-          {
-            record_match(cur_match_len, cur_match_dist);
-            m_saved_match_len = 0; len_to_move = cur_match_len;
-          }
-          else
+          compressor *pComp = acquire_compressor();
+          buffer_output_stream out(pShared + req.m_out_ofs, static_cast<size_t>(req.m_out_capacity));
+          if ((pComp) && (compress_with_dictionary(pComp, &out, static_cast<int>(req.m_flags), pDict ? pDict->m_pData : NULL, pDict ? pDict->m_len : 0, pShared + req.m_in_ofs, static_cast<size_t>(req.m_in_len))))
           {
-            m_saved_lit = m_dict[m_lookahead_pos]; m_saved_match_dist = cur_match_dist; m_saved_match_len = cur_match_len; len_to_move = 1;
+            reply.m_status = OFFLOAD_STATUS_OK; reply.m_out_len = out.get_size();
           }
+          if (pComp) release_compressor(pComp);
         }
-        else
         {
-          record_match(m_saved_match_len, m_saved_match_dist);
-          len_to_move = m_saved_match_len - 1; m_saved_match_len = 0;
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_stats.m_num_requests++;
+          if (reply.m_status == OFFLOAD_STATUS_OK) { m_stats.m_bytes_in += req.m_in_len; m_stats.m_bytes_out += reply.m_out_len; } else m_stats.m_num_failed++;
         }
+        connected = send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(reply));
       }
-      else if (!cur_match_dist)
-        record_literal(m_dict[m_lookahead_pos]);
-      else if ((m_greedy_parsing) || (cur_match_len >= 64))
+      if (pShared) munmap(pShared, shared_size);
+      // The fd is closed by whoever joins this thread, so stop() can't shut down a reused descriptor.
+      pConn->m_done = true;
+    }
+
+    // Joins and frees the finished connections (all of them, once stopping). The joins happen without the lock, which serve() needs to finish a request.
+    void reap_connections(bool all)
+    {
+      offload_connection *pReaped = NULL;
       {
-        record_match(cur_match_len, cur_match_dist);
-        len_to_move = cur_match_len;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (uint i = 0; i < m_num_conns; )
+        {
+          offload_connection *pConn = m_pConns[i];
+          if ((!all) && (!pConn->m_done)) { i++; continue; }
+          pConn->m_pNext_reaped = pReaped; pReaped = pConn;
+          m_pConns[i] = m_pConns[--m_num_conns];
+        }
       }
-      else
+      while (pReaped)
       {
-        m_saved_lit = m_dict[m_lookahead_pos]; m_saved_match_dist = cur_match_dist; m_saved_match_len = cur_match_len;
+        offload_connection *pConn = pReaped; pReaped = pConn->m_pNext_reaped;
+        pConn->m_thread.join(); close(pConn->m_fd); TDEFL_DELETE pConn;
       }
-      // Move the lookahead forward by len_to_move bytes.
-      m_lookahead_pos = (m_lookahead_pos + len_to_move) & LZ_DICT_SIZE_MASK;
-      TDEFL_ASSERT(m_lookahead_size >= len_to_move); m_lookahead_size -= len_to_move;
-      m_dict_size = TDEFL_MIN(m_dict_size + len_to_move, LZ_DICT_SIZE);
     }
-    if (!pData)
+
+    void accept_loop()
     {
-      if (m_saved_match_len) record_match(m_saved_match_len, m_saved_match_dist);
-      flush_block(true);
-      if (m_flags & WRITE_ZLIB_HEADER) { for (uint i = 0; i < 4; i++) { TDEFL_PUT_BITS((m_adler32 >> 24) & 0xFF, 8); m_adler32 <<= 8; } }
-      flush_output_buffer(); m_pStream = NULL;
+      for ( ; ; )
+      {
+        int fd = accept4(m_listen_fd, NULL, NULL, SOCK_CLOEXEC); const int err = errno;
+        // Clients write into the daemon's memory and get its output, so other users are turned away.
+        if ((fd >= 0) && (!offload_peer_is_same_user(fd))) { close(fd); continue; }
+        reap_connections(false);
+        if (fd < 0)
+        {
+          // Only stop() ends the loop. Running out of descriptors or buffers backs off so connections can close, anything else (an aborted
+          // connection, a signal) is retried at once.
+          { std::lock_guard<std::mutex> lock(m_mutex); if (m_stop) break; }
+          if ((err == EMFILE) || (err == ENFILE) || (err == ENOBUFS) || (err == ENOMEM)) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          continue;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) { close(fd); break; }
+        if (m_num_conns == m_conn_capacity)
+        {
+          uint new_capacity = TDEFL_MAX(16U, m_conn_capacity * 2U);
+          offload_connection **pNew = static_cast<offload_connection**>(TDEFL_REALLOC(m_pConns, new_capacity * sizeof(offload_connection*)));
+          if (!pNew) { close(fd); continue; }
+          m_pConns = pNew; m_conn_capacity = new_capacity;
+        }
+        offload_connection *pConn = TDEFL_NEW offload_connection(fd); if (!pConn) { close(fd); continue; }
+        pConn->m_thread = std::thread(&state::serve, this, pConn);
+        m_pConns[m_num_conns++] = pConn; m_stats.m_num_clients++;
+      }
     }
-    return m_all_writes_succeeded;
+  };
+
+  offload_server::offload_server() : m_pState(NULL), m_pDicts(NULL), m_num_dicts(0)
+  {
   }
 
-  bool compressor::init(output_stream *pStream, int flags)
+  offload_server::~offload_server()
   {
-    if (!pStream) return false;
-    m_pStream = pStream; m_flags = static_cast<uint>(flags); m_max_probes = ((flags & 0xFFF) + 2) / 3; m_greedy_parsing = (flags & GREEDY_PARSING_FLAG) != 0;
-    if (!(flags & NONDETERMINISTIC_PARSING_FLAG)) memset(m_hash, 0xFF, sizeof(m_hash));
-    m_lookahead_pos = 0; m_lookahead_size = 0; m_dict_size = 0;
-    m_pLZ_code_buf = m_lz_code_buf + 1; m_pLZ_flags = m_lz_code_buf; m_num_flags_left = 8;
-    m_pOutput_buf = m_output_buf; m_bits_in = 0; m_bit_buffer = 0; m_all_writes_succeeded = true;
-    m_saved_match_dist = 0, m_saved_match_len = 0, m_saved_lit = 0; m_adler32 = 1;
-    if (m_flags & WRITE_ZLIB_HEADER) { TDEFL_PUT_BITS(0x78, 8); TDEFL_PUT_BITS(1, 8); }
-    return m_all_writes_succeeded;
+    stop();
+    for (uint i = 0; i < m_num_dicts; i++) TDEFL_FREE(m_pDicts[i].m_pData);
+    TDEFL_FREE(m_pDicts);
   }
 
-  // ------------------- High-level helpers (only the below methods use the heap in any way).
-  void expandable_malloc_output_stream::init(size_t initial_capacity)
+  bool offload_server::add_dictionary(const void *pDict, uint dict_len)
   {
-    clear();
-    if (initial_capacity)
+    if ((m_pState) || (!pDict) || (!dict_len)) return false;
+    const uint len = TDEFL_MIN(dict_len, 32768U);
+    dictionary *pNew = static_cast<dictionary*>(TDEFL_REALLOC(m_pDicts, (m_num_dicts + 1U) * sizeof(dictionary))); if (!pNew) return false;
+    m_pDicts = pNew;
+    dictionary &d = m_pDicts[m_num_dicts];
+    if ((d.m_pData = static_cast<uint8*>(TDEFL_MALLOC(len))) == NULL) return false;
+    memcpy(d.m_pData, static_cast<const uint8*>(pDict) + dict_len - len, len); d.m_len = len; d.m_id = adler32(d.m_pData, len, 1);
+    m_num_dicts++;
+    return true;
+  }
+
+  bool offload_server::start(const char *pSocket_path, uint max_pooled_compressors)
+  {
+    stop();
+    sockaddr_un addr; memset(&addr, 0, sizeof(addr)); addr.sun_family = AF_UNIX;
+    if (!get_offload_socket_path(pSocket_path, addr.sun_path, sizeof(addr.sun_path))) return false;
+    // Only a socket the same user left behind is replaced.
+    struct stat st;
+    if (!lstat(addr.sun_path, &st))
     {
-      m_pBuf = TDEFL_MALLOC(initial_capacity);
-      m_capacity = m_pBuf ? initial_capacity : 0; 
+      if ((!S_ISSOCK(st.st_mode)) || (st.st_uid != geteuid()) || (unlink(addr.sun_path))) return false;
+    }
+    else if (errno != ENOENT)
+      return false;
+    state *pState = TDEFL_NEW state; if (!pState) return false;
+    strcpy(pState->m_socket_path, addr.sun_path);
+    pState->m_pDicts = m_pDicts; pState->m_num_dicts = m_num_dicts; pState->m_max_pooled = max_pooled_compressors;
+    if ((max_pooled_compressors) && ((pState->m_pPool = static_cast<compressor**>(TDEFL_MALLOC(max_pooled_compressors * sizeof(compressor*)))) == NULL)) { TDEFL_DELETE pState; return false; }
+    pState->m_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if ((pState->m_listen_fd < 0) || (bind(pState->m_listen_fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) || (lstat(addr.sun_path, &st)) || (listen(pState->m_listen_fd, 64)))
+    {
+      if (pState->m_listen_fd >= 0) close(pState->m_listen_fd);
+      TDEFL_DELETE pState; return false;
     }
+    pState->m_socket_dev = st.st_dev; pState->m_socket_ino = st.st_ino;
+    pState->m_accept_thread = std::thread(&state::accept_loop, pState);
+    m_pState = pState;
+    return true;
   }
-    
-  void expandable_malloc_output_stream::clear() 
-  { 
-    TDEFL_FREE(m_pBuf); m_size = m_capacity = 0; 
+
+  const char *offload_server::get_socket_path() const
+  {
+    return m_pState ? m_pState->m_socket_path : NULL;
   }
 
-  bool expandable_malloc_output_stream::put_buf(const void* pBuf, int len)
+  void offload_server::stop()
   {
-    size_t new_size = m_size + len;
-    if (new_size > m_capacity)
+    state *pState = m_pState; if (!pState) return;
     {
-      size_t new_capacity = m_capacity; do { new_capacity = TDEFL_MAX(128U, new_capacity << 1U); } while (new_size > new_capacity);
-      void *pNew_buf = TDEFL_REALLOC(m_pBuf, new_capacity); if (!pNew_buf) return false;
-      m_pBuf = pNew_buf; m_capacity = new_capacity;
+      std::lock_guard<std::mutex> lock(pState->m_mutex);
+      pState->m_stop = true;
+      // Wakes accept() and the connections' recv() calls.
+      shutdown(pState->m_listen_fd, SHUT_RDWR);
+      for (uint i = 0; i < pState->m_num_conns; i++) shutdown(pState->m_pConns[i]->m_fd, SHUT_RDWR);
     }
-    memcpy((uint8*)m_pBuf + m_size, pBuf, len); m_size = new_size;
-    return true;
+    // No connections can be added once the accept thread is gone, and every one left has been shut down.
+    pState->m_accept_thread.join();
+    pState->reap_connections(true);
+    // Only unlinks the path if it's still this server's socket.
+    struct stat st;
+    if ((!lstat(pState->m_socket_path, &st)) && (st.st_dev == pState->m_socket_dev) && (st.st_ino == pState->m_socket_ino)) unlink(pState->m_socket_path);
+    close(pState->m_listen_fd);
+    TDEFL_DELETE pState; m_pState = NULL;
   }
 
-  bool buffer_output_stream::put_buf(const void* pBuf, int len)
+  offload_server::stats offload_server::get_stats()
   {
-    size_t new_size = m_size + len; if (new_size > m_capacity) return false;
-    memcpy((uint8*)m_pBuf + m_size, pBuf, len); m_size = new_size;
-    return true;
+    stats s; memset(&s, 0, sizeof(s));
+    state *pState = m_pState; if (!pState) return s;
+    std::lock_guard<std::mutex> lock(pState->m_mutex);
+    return pState->m_stats;
   }
+#endif // __linux__
 
-  bool compress_mem_to_output_stream(const void *pBuf, size_t buf_len, output_stream *pStream, int flags)
+#if TDEFL_TRACING
+  // ------------------- Tracing
+  // Thread buffers are kept on a global list and never freed, so a thread's spans outlive it. Only its own thread writes a buffer: trace_start() just bumps
+  // the generation, and each thread clears its buffer the next time it records. That reset is done under the lock, once per thread and trace, so it reads
+  // the generation and span limit of the same trace_start() and the exporter never sees a buffer half reset.
+  struct trace_event { uint64 m_start_ticks, m_end_ticks; trace_span_type m_type; };
+  struct trace_thread_buffer
   {
-    if ((buf_len) && (!pBuf)) return false;
-    compressor *pComp = TDEFL_NEW compressor;
-    bool succeeded = pComp->init(pStream, flags);
-    while (buf_len)
+    trace_event *m_pEvents;
+    uint m_capacity;
+    std::atomic<uint> m_num_events;
+    std::atomic<uint32> m_generation;
+    std::atomic<uint64> m_num_dropped;
+    uint m_tid;
+    char m_name[64];
+    trace_thread_buffer *m_pNext;
+
+    trace_thread_buffer() : m_pEvents(NULL), m_capacity(0), m_num_events(0), m_generation(0), m_num_dropped(0), m_tid(0), m_pNext(NULL) { m_name[0] = '\0'; }
+  };
+
+  static std::mutex g_trace_mutex;
+  static std::atomic<bool> g_trace_recording(false);
+  static std::atomic<uint32> g_trace_generation(0);
+  static uint g_trace_max_spans, g_trace_num_threads;
+  static uint64 g_trace_start_ticks;
+  static trace_thread_buffer *g_pTrace_buffers;
+  static thread_local trace_thread_buffer *t_pTrace_buffer;
+
+  static trace_thread_buffer *trace_get_thread_buffer()
+  {
+    if (t_pTrace_buffer) return t_pTrace_buffer;
+    trace_thread_buffer *pBuf = TDEFL_NEW trace_thread_buffer; if (!pBuf) return NULL;
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    pBuf->m_tid = ++g_trace_num_threads; pBuf->m_pNext = g_pTrace_buffers; g_pTrace_buffers = pBuf;
+    return t_pTrace_buffer = pBuf;
+  }
+
+  static void trace_record(uint64 start_ticks, uint64 end_ticks, trace_span_type type)
+  {
+    trace_thread_buffer *pBuf = trace_get_thread_buffer(); if (!pBuf) return;
+    if (pBuf->m_generation.load(std::memory_order_relaxed) != g_trace_generation.load(std::memory_order_relaxed))
     {
-      uint n = static_cast<uint>(TDEFL_MIN(16U * 1024U * 1024U, buf_len)); succeeded = succeeded && pComp->compress_data(pBuf, n); if (!succeeded) break;
-      pBuf = static_cast<const uint8*>(pBuf) + n; buf_len -= n;
+      // First span since trace_start().
+      std::lock_guard<std::mutex> lock(g_trace_mutex);
+      const uint max_spans = g_trace_max_spans;
+      if (pBuf->m_capacity != max_spans)
+      {
+        TDEFL_FREE(pBuf->m_pEvents); pBuf->m_pEvents = static_cast<trace_event*>(TDEFL_MALLOC(max_spans * sizeof(trace_event)));
+        pBuf->m_capacity = pBuf->m_pEvents ? max_spans : 0;
+      }
+      pBuf->m_num_events.store(0, std::memory_order_relaxed); pBuf->m_num_dropped.store(0, std::memory_order_relaxed);
+      pBuf->m_generation.store(g_trace_generation.load(std::memory_order_relaxed), std::memory_order_relaxed);
     }
-    succeeded = succeeded && pComp->compress_data(NULL, 0);
-    TDEFL_DELETE pComp; return succeeded;
+    const uint n = pBuf->m_num_events.load(std::memory_order_relaxed);
+    if (n == pBuf->m_capacity) { pBuf->m_num_dropped.fetch_add(1, std::memory_order_relaxed); return; }
+    trace_event &e = pBuf->m_pEvents[n]; e.m_start_ticks = start_ticks; e.m_end_ticks = end_ticks; e.m_type = type;
+    pBuf->m_num_events.store(n + 1, std::memory_order_release);
   }
-   
-  void *compress_mem_to_heap(const void *pSrc_buf, size_t src_buf_len, size_t *pOut_len, int flags)
+
+  trace_span::trace_span(trace_span_type type) : m_start_ticks(g_trace_recording.load(std::memory_order_relaxed) ? get_ticks() : 0), m_type(type)
   {
-    if (!pOut_len) return false; else *pOut_len = 0;
-    expandable_malloc_output_stream out_stream(TDEFL_MAX(32U, src_buf_len >> 1U));
-    if (!compress_mem_to_output_stream(pSrc_buf, src_buf_len, &out_stream, flags)) return NULL;
-    *pOut_len = out_stream.get_size();
-    void *p = out_stream.assume_buf_ownership();
-    return p;
   }
 
-  size_t compress_mem_to_mem(void *pOut_buf, size_t out_buf_len, const void *pSrc_buf, size_t src_buf_len, int flags)
+  // A span still open when recording stops is dropped, so nothing is written once trace_stop() returns.
+  trace_span::~trace_span()
   {
-    buffer_output_stream out_stream(pOut_buf, out_buf_len);
-    if (!compress_mem_to_output_stream(pSrc_buf, src_buf_len, &out_stream, flags)) return 0;
-    return out_stream.get_size();
+    if ((m_start_ticks) && (g_trace_recording.load(std::memory_order_relaxed))) trace_record(m_start_ticks, get_ticks(), m_type);
   }
-  
-  void *write_image_to_png_file_in_memory(const void *pImage, int w, int h, int num_chans, uint32 *pLen_out) 
+
+  void trace_start(uint max_spans_per_thread)
   {
-    *pLen_out = 0; const int bpl = w * num_chans; compressor *pComp = TDEFL_NEW compressor; expandable_malloc_output_stream out_stream(57+TDEFL_MAX(64U, (1+bpl)*h)); 
-    // write dummy header
-    int z; for (z = 41; z; --z) out_stream.put_buf(&z, 1);
-    // compress image data
-    pComp->init(&out_stream, tinydeflate::DEFAULT_MAX_PROBES | tinydeflate::WRITE_ZLIB_HEADER);
-    for (int y = 0; y < h; ++y) { pComp->compress_data(&z, 1); pComp->compress_data((uint8*)pImage + y * bpl, bpl); }
-    pComp->compress_data(NULL, 0); if (!pComp->get_all_writes_succeeded()) { TDEFL_DELETE pComp; return NULL; }
-    // write real header
-    *pLen_out = (uint32)(out_stream.get_size()-41);
-    uint8 pnghdr[41]={0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,0x00,0x00,0x00,0x0d,0x49,0x48,0x44,0x52,
-      0,0,(uint8)(w>>8),(uint8)w,0,0,(uint8)(h>>8),(uint8)h,8,"\0\0\04\02\06"[num_chans],0,0,0,0,0,0,0,
-      (uint8)(*pLen_out>>24),(uint8)(*pLen_out>>16),(uint8)(*pLen_out>>8),(uint8)*pLen_out,0x49,0x44,0x41,0x54};
-    uint32 c=crc32(pnghdr+12,17); for (int i=0; i<4; ++i, c<<=8) ((uint8*)(pnghdr+29))[i]=(uint8)(c>>24);
-    memcpy(out_stream.get_buf(), pnghdr, 41); 
-    // write footer (IDAT CRC-32, followed by IEND chunk)
-    if (!out_stream.put_buf("\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", 16)) { *pLen_out = 0; TDEFL_DELETE pComp; return NULL; }
-    c = crc32(out_stream.get_buf()+41-4, *pLen_out+4); for (int i=0; i<4; ++i, c<<=8) (out_stream.get_buf()+out_stream.get_size()-16)[i] = (uint8)(c >> 24);
-    // compute final size of file, grab compressed data buffer and return
-    *pLen_out += 57; void *pBuf = out_stream.assume_buf_ownership(); TDEFL_DELETE pComp; return pBuf;
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    g_trace_max_spans = TDEFL_MAX(max_spans_per_thread, 1U); g_trace_start_ticks = get_ticks();
+    g_trace_generation.fetch_add(1, std::memory_order_relaxed);
+    g_trace_recording.store(true, std::memory_order_release);
+  }
+
+  void trace_stop()
+  {
+    g_trace_recording.store(false, std::memory_order_release);
+  }
+
+  void trace_set_thread_name(const char *pName)
+  {
+    trace_thread_buffer *pBuf = trace_get_thread_buffer(); if (!pBuf) return;
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    uint len = 0;
+    // The name goes into a JSON string as is.
+    for ( ; (pName) && (pName[len]) && (len < sizeof(pBuf->m_name) - 1U); len++) pBuf->m_name[len] = ((pName[len] == '"') || (pName[len] == '\\') || (static_cast<uint8>(pName[len]) < 32U)) ? '_' : pName[len];
+    pBuf->m_name[len] = '\0';
   }
 
+  bool trace_write_chrome_json(output_stream *pOut)
+  {
+    static const char *s_span_names[TRACE_TOTAL_SPAN_TYPES] = { "compress", "dictionary priming", "block flush", "output write", "checksum", "wait" };
+    if (!pOut) return false;
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    const uint32 generation = g_trace_generation.load(std::memory_order_relaxed);
+    const double usecs_per_tick = 1000000.0 / static_cast<double>(get_ticks_per_second());
+    static const char s_header[] = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", s_footer[] = "\n]}\n";
+    char buf[256], name[sizeof(g_pTrace_buffers->m_name) + 16]; const char *pSep = "\n";
+    bool succeeded = pOut->put_buf(s_header, sizeof(s_header) - 1);
+    for (const trace_thread_buffer *pBuf = g_pTrace_buffers; (pBuf) && (succeeded); pBuf = pBuf->m_pNext)
+    {
+      if (pBuf->m_generation.load(std::memory_order_relaxed) != generation) continue;
+      const uint num_events = pBuf->m_num_events.load(std::memory_order_acquire);
+      if (pBuf->m_name[0]) strcpy(name, pBuf->m_name); else snprintf(name, sizeof(name), "thread %u", pBuf->m_tid);
+      int len = snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\",\"dropped_spans\":%llu}}", pSep, pBuf->m_tid,
+        name, static_cast<unsigned long long>(pBuf->m_num_dropped.load(std::memory_order_relaxed)));
+      succeeded = pOut->put_buf(buf, len); pSep = ",\n";
+      for (uint i = 0; (i < num_events) && (succeeded); i++)
+      {
+        const trace_event &e = pBuf->m_pEvents[i];
+        // Spans begun before trace_start() belong to the previous trace.
+        if (e.m_start_ticks < g_trace_start_ticks) continue;
+        len = snprintf(buf, sizeof(buf), ",\n{\"name\":\"%s\",\"cat\":\"tinydeflate\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", s_span_names[e.m_type], pBuf->m_tid,
+          static_cast<double>(e.m_start_ticks - g_trace_start_ticks) * usecs_per_tick, static_cast<double>(e.m_end_ticks - e.m_start_ticks) * usecs_per_tick);
+        succeeded = pOut->put_buf(buf, len);
+      }
+    }
+    return (succeeded) && (pOut->put_buf(s_footer, sizeof(s_footer) - 1));
+  }
+#endif // TDEFL_TRACING
+
+#endif // TDEFL_CPP11
+
 } // namespace tinydeflate
 
+#if defined(TINYDEFLATE_PACKER_MAIN) || (defined(TINYDEFLATE_DAEMON_MAIN) && TDEFL_CPP11 && defined(__linux__))
+#include <stdio.h>
+
+static unsigned char *tdefl_read_file(const char *pFilename, size_t *pSize)
+{
+  FILE *pFile = fopen(pFilename, "rb"); if (!pFile) return NULL;
+  long size = -1; if (!fseek(pFile, 0, SEEK_END)) size = ftell(pFile);
+  unsigned char *pBuf = (size >= 0) ? static_cast<unsigned char*>(TDEFL_MALLOC(TDEFL_MAX(size, 1L))) : NULL;
+  if ((pBuf) && ((fseek(pFile, 0, SEEK_SET)) || (fread(pBuf, 1, size, pFile) != static_cast<size_t>(size)))) { TDEFL_FREE(pBuf); pBuf = NULL; }
+  fclose(pFile);
+  *pSize = static_cast<size_t>(size); return pBuf;
+}
+#endif
+
+#ifdef TINYDEFLATE_PACKER_MAIN
+// ------------------- Asset packer
+// Build time asset packer, so programs can embed static assets already compressed instead of compressing them at startup:
+//  tinydeflate_pack [-p probes] output.h asset_file...
+// Each asset becomes a zlib stream in a static array named after its file name (characters that can't appear in an identifier become '_'),
+// along with its _size (uncompressed) and _compressed_size. Assets are compressed with 4095 probes unless -p says otherwise.
+int main(int argc, char *argv[])
+{
+  using namespace tinydeflate;
+  int probes = 4095, arg_index = 1;
+  if ((argc > 2) && (!strcmp(argv[1], "-p"))) { probes = TDEFL_MIN(TDEFL_MAX(atoi(argv[2]), 0), 4095); arg_index = 3; }
+  if (argc - arg_index < 2) { fprintf(stderr, "usage: %s [-p probes] output.h asset_file...\n", argv[0]); return EXIT_FAILURE; }
+  const char *pOut_filename = argv[arg_index++];
+  FILE *pOut = fopen(pOut_filename, "w"); if (!pOut) { fprintf(stderr, "can't create %s\n", pOut_filename); return EXIT_FAILURE; }
+  fprintf(pOut, "// Generated by the tinydeflate asset packer. Each array holds a zlib stream: inflate it into a buffer of the asset's _size bytes.\n#pragma once\n");
+  bool succeeded = true;
+  for ( ; (arg_index < argc) && (succeeded); arg_index++)
+  {
+    const char *pFilename = argv[arg_index]; size_t src_len = 0, comp_len = 0;
+    unsigned char *pSrc = tdefl_read_file(pFilename, &src_len); if (!pSrc) { fprintf(stderr, "can't read %s\n", pFilename); succeeded = false; break; }
+    uint8 *pComp = static_cast<uint8*>(compress_mem_to_heap(pSrc, src_len, &comp_len, probes | WRITE_ZLIB_HEADER)); TDEFL_FREE(pSrc);
+    if (!pComp) { fprintf(stderr, "can't compress %s\n", pFilename); succeeded = false; break; }
+
+    const char *pBase = pFilename; for (const char *p = pFilename; *p; p++) if ((*p == '/') || (*p == '\\')) pBase = p + 1;
+    char name[256]; size_t name_len = 0;
+    if ((*pBase >= '0') && (*pBase <= '9')) name[name_len++] = '_';
+    for ( ; (*pBase) && (name_len < sizeof(name) - 1); pBase++) { char c = *pBase; name[name_len++] = (((c | 0x20) >= 'a') && ((c | 0x20) <= 'z')) || ((c >= '0') && (c <= '9')) ? c : '_'; }
+    name[name_len] = '\0';
+
+    fprintf(pOut, "\nstatic const unsigned int %s_size = %luU;\nstatic const unsigned int %s_compressed_size = %luU;\nstatic const unsigned char %s[%lu] =\n{", name, static_cast<unsigned long>(src_len), name, static_cast<unsigned long>(comp_len), name, static_cast<unsigned long>(comp_len));
+    for (size_t i = 0; i < comp_len; i++) fprintf(pOut, "%s0x%02x,", (i & 15) ? "" : "\n  ", pComp[i]);
+    fprintf(pOut, "\n};\n");
+    printf("%s: %lu -> %lu bytes\n", name, static_cast<unsigned long>(src_len), static_cast<unsigned long>(comp_len));
+    TDEFL_FREE(pComp);
+  }
+  succeeded = (!ferror(pOut)) && (!fclose(pOut)) && (succeeded);
+  // Don't leave a partial header behind for the build to pick up.
+  if (!succeeded) { remove(pOut_filename); return EXIT_FAILURE; }
+  return EXIT_SUCCESS;
+}
+#endif // TINYDEFLATE_PACKER_MAIN
+
+#if defined(TINYDEFLATE_DAEMON_MAIN) && TDEFL_CPP11 && defined(__linux__)
+// ------------------- Offload daemon
+// Serves offload_client until SIGINT or SIGTERM:
+//  tinydeflate_daemon [-c max_pooled_compressors] [-d dictionary_file]... [socket_path]
+// Dictionaries are preloaded so clients can refer to them by their Adler-32 instead of sending them.
+#include <signal.h>
+
+int main(int argc, char *argv[])
+{
+  using namespace tinydeflate;
+  offload_server server; uint max_pooled = 8; const char *pSocket_path = TDEFL_OFFLOAD_SOCKET_PATH;
+  for (int i = 1; i < argc; i++)
+  {
+    if ((!strcmp(argv[i], "-c")) && (i + 1 < argc)) { int n = atoi(argv[++i]); max_pooled = static_cast<uint>(TDEFL_MAX(n, 0)); }
+    else if ((!strcmp(argv[i], "-d")) && (i + 1 < argc))
+    {
+      const char *pFilename = argv[++i]; size_t dict_len = 0;
+      unsigned char *pDict = tdefl_read_file(pFilename, &dict_len); const size_t len = TDEFL_MIN(dict_len, static_cast<size_t>(32768U));
+      bool added = (pDict) && (len) && (server.add_dictionary(pDict + dict_len - len, static_cast<uint>(len))); TDEFL_FREE(pDict);
+      if (!added) { fprintf(stderr, "can't load dictionary %s\n", pFilename); return EXIT_FAILURE; }
+    }
+    else if ((argv[i][0] != '-') && (i == argc - 1)) pSocket_path = argv[i];
+    else { fprintf(stderr, "usage: %s [-c max_pooled_compressors] [-d dictionary_file]... [socket_path]\n", argv[0]); return EXIT_FAILURE; }
+  }
+  // Blocked before start() so the server's threads inherit the mask and the signals are left for sigwait().
+  sigset_t signals; sigemptyset(&signals); sigaddset(&signals, SIGINT); sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  if (!server.start(pSocket_path, max_pooled)) { fprintf(stderr, "can't listen on %s\n", pSocket_path ? pSocket_path : "the default socket path"); return EXIT_FAILURE; }
+  printf("listening on %s\n", server.get_socket_path()); fflush(stdout);
+  int sig; sigwait(&signals, &sig);
+  offload_server::stats s = server.get_stats();
+  server.stop();
+  printf("%llu clients, %llu requests (%llu failed), %llu -> %llu bytes\n", static_cast<unsigned long long>(s.m_num_clients), static_cast<unsigned long long>(s.m_num_requests),
+    static_cast<unsigned long long>(s.m_num_failed), static_cast<unsigned long long>(s.m_bytes_in), static_cast<unsigned long long>(s.m_bytes_out));
+  return EXIT_SUCCESS;
+}
+#endif // TINYDEFLATE_DAEMON_MAIN
+
 #endif // TINYDEFLATE_HEADER_FILE_ONLY